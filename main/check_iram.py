@@ -0,0 +1,134 @@
+# PlatformIO post-build check that everything reachable from the stepper ISR runs from internal RAM.
+#
+# Walks the call graph of the firmware disassembly from the ISR entry points. Fails the build if a reachable
+# function sits in flash, if reachable code loads a literal from flash or a constant from flash rodata, if an
+# entry point the configuration selects is missing, or if an l32r line is not in the expected format. Prints the
+# IRAM footprint of the ISR code and the total IRAM use. Indirect calls (callx) cannot be followed, so the ISR
+# code avoids them.
+
+import os
+import re
+import subprocess
+
+Import("env")
+
+# ISR entry points (mangled names), each with the config.h flag and value that select it. The stepper interrupt is
+# the only one allocated with ESP_INTR_FLAG_IRAM. The Arduino core installs the GPIO interrupts of ultrasonicEcho()
+# and imuDataReady() without it by default, so they are held off while the cache is disabled and may run from flash
+ISR_ROOTS = [
+    ("_Z12TimerHandlerPv", "STEPPER_EVENT_DRIVEN", False),
+    ("_Z17EventTimerHandlerPv", "STEPPER_EVENT_DRIVEN", True),
+]
+
+# ESP32 memory map
+IRAM = (0x40080000, 0x400A0000)
+ROM = (0x40000000, 0x40070000)
+FLASH_TEXT = (0x400C2000, 0x40C00000)
+FLASH_RODATA = (0x3F400000, 0x3F800000)
+
+FUNC_RE = re.compile(r"^([0-9a-f]{8}) <(.+)>:$")
+CALL_RE = re.compile(r"\tcall(?:0|4|8|12)\s+([0-9a-f]+) <([^>+]+)")
+# l32r a2, <literal address> [<symbol+offset>] [(<literal value> [<symbol>])]. Binutils versions differ in the
+# annotations, so both are optional, and the literal address alone is checked when the value is not shown
+L32R_RE = re.compile(r"\tl32r\s+\w+, ([0-9a-f]+)(?: <[^>]*>)?(?: \(([0-9a-f]{8})\b[^)]*\))?\s*$")
+CONFIG_RE = re.compile(r"^const bool (\w+) = (true|false);", re.M)
+
+
+def in_range(addr, region):
+    return region[0] <= addr < region[1]
+
+
+def tool(name):
+    return env.subst("$CC").replace("gcc", name)
+
+
+def config_flags():
+    with open(os.path.join(env.subst("$PROJECT_SRC_DIR"), "config.h")) as config:
+        return {name: value == "true" for name, value in CONFIG_RE.findall(config.read())}
+
+
+def check_iram(source, target, env):
+    elf = str(target[0])
+    disasm = subprocess.check_output([tool("objdump"), "-d", elf], env=env["ENV"]).decode()
+    symbols = subprocess.check_output([tool("nm"), "-S", "--defined-only", elf], env=env["ENV"]).decode()
+
+    # Function address, calls and flash literals
+    errors = []
+    functions = {}
+    current = None
+    for line in disasm.splitlines():
+        m = FUNC_RE.match(line)
+        if m:
+            current = m.group(2)
+            functions[current] = {"addr": int(m.group(1), 16), "calls": set(), "rodata": set(), "unparsed": []}
+            continue
+        if current is None:
+            continue
+        m = CALL_RE.search(line)
+        if m:
+            functions[current]["calls"].add(m.group(2))
+        if "\tl32r" not in line:
+            continue
+        m = L32R_RE.search(line)
+        if not m:
+            functions[current]["unparsed"].append(line.strip())
+            continue
+        literal = int(m.group(1), 16)
+        if not (in_range(literal, IRAM) or in_range(literal, ROM)):
+            functions[current]["rodata"].add("literal at 0x%08x" % literal)
+        if m.group(2) and in_range(int(m.group(2), 16), FLASH_RODATA):
+            functions[current]["rodata"].add("rodata 0x%s" % m.group(2))
+
+    sizes = {}
+    for line in symbols.splitlines():
+        parts = line.split()
+        if len(parts) == 4:
+            sizes[parts[3]] = int(parts[1], 16)
+
+    # The roots the configuration selects, every one of which must be there
+    flags = config_flags()
+    pending = []
+    for root, flag, value in ISR_ROOTS:
+        if flag not in flags:
+            errors.append("config.h does not set %s, which selects %s" % (flag, root))
+        elif flags[flag] == value:
+            if root in functions:
+                pending.append(root)
+            else:
+                errors.append("ISR entry point %s is not in the firmware" % root)
+
+    # Breadth-first walk from the ISR roots
+    reachable = []
+    seen = set(pending)
+    while pending:
+        name = pending.pop(0)
+        info = functions[name]
+        reachable.append(name)
+        if in_range(info["addr"], FLASH_TEXT):
+            errors.append("%s is in flash at 0x%08x" % (name, info["addr"]))
+        elif not (in_range(info["addr"], IRAM) or in_range(info["addr"], ROM)):
+            errors.append("%s is outside IRAM at 0x%08x" % (name, info["addr"]))
+        for literal in sorted(info["rodata"]):
+            errors.append("%s loads flash %s" % (name, literal))
+        for line in info["unparsed"]:
+            errors.append("%s has an l32r in an unexpected format: %s" % (name, line))
+        for callee in info["calls"]:
+            if callee in functions and callee not in seen:
+                seen.add(callee)
+                pending.append(callee)
+
+    footprint = sum(sizes.get(name, 0) for name in reachable if in_range(functions[name]["addr"], IRAM))
+    iram_used = sum(sizes.get(name, 0) for name in functions if in_range(functions[name]["addr"], IRAM))
+
+    print("Stepper ISR: %d reachable functions, %d bytes of IRAM" % (len(reachable), footprint))
+    for name in reachable:
+        print("  0x%08x %6d %s" % (functions[name]["addr"], sizes.get(name, 0), name))
+    print("IRAM code total: %d of %d bytes" % (iram_used, IRAM[1] - IRAM[0]))
+
+    if errors:
+        for error in errors:
+            print("ISR placement error: " + error)
+        env.Exit(1)
+
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", check_iram)
@@ -0,0 +1,245 @@
+#ifndef ATTITUDE_H
+#define ATTITUDE_H
+
+#include <Arduino.h>
+#include <Adafruit_Sensor.h>
+
+const float ATTITUDE_MAX_DT = 0.1;        // longer gaps between samples are not integrated (s)
+const float ATTITUDE_ACCEL_GATE = 0.5;    // skip accelerometer correction when its magnitude is this fraction off 1 g
+const float ATTITUDE_ONE_G = 9.80665;     // (m/s/s)
+const float ATTITUDE_STILL_RATE = 0.02;   // yaw rates below this are taken as gyro bias (rad/s)
+const float ATTITUDE_YAW_BIAS_GAIN = 0.5; // rate at which yaw bias is learned while still, without a bias model (1/s)
+
+// Remove the robot's own forward acceleration (m/s/s, forward positive) from an accelerometer reading, so it is not
+// read as tilt. The sensor's z axis points forward when upright, tilted by pitch
+void compensateLinearAccel(sensors_event_t &a, float forwardAccel, float pitch)
+{
+    a.acceleration.x += forwardAccel * sin(pitch);
+    a.acceleration.z -= forwardAccel * cos(pitch);
+}
+
+// Mahony quaternion attitude estimator. Gyro rates are integrated over the measured time between samples and
+// corrected towards the accelerometer's gravity direction with a PI term, whose integral tracks gyro bias.
+// The sensor's x axis is vertical, so pitch is the tilt of gravity from x towards z, as atan(z / x) before it
+class Attitude
+{
+
+public:
+    // Feed one sample taken at timestampUs (micros()). yawBiasGain is the rate at which yaw rates below
+    // ATTITUDE_STILL_RATE are taken as bias, 0 once the gyro is corrected by a bias model (1/s)
+    void update(const sensors_event_t &a, const sensors_event_t &g, uint32_t timestampUs, float kp, float ki,
+                float yawBiasGain)
+    {
+        float ax = a.acceleration.x, ay = a.acceleration.y, az = a.acceleration.z;
+        float norm = sqrt(ax * ax + ay * ay + az * az);
+
+        if (!initialised)
+        {
+            if (norm > 0)
+                initialise(ax / norm, ay / norm, az / norm);
+            lastUs = timestampUs;
+            return;
+        }
+
+        float dt = static_cast<int32_t>(timestampUs - lastUs) * 1e-6f;
+        lastUs = timestampUs;
+        if (dt <= 0 || dt > ATTITUDE_MAX_DT)
+            return;
+
+        // Gravity direction in the sensor frame, as currently estimated
+        float vx = 2 * (q1 * q3 - q0 * q2);
+        float vy = 2 * (q0 * q1 + q2 * q3);
+        float vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+        float gx = g.gyro.x, gy = g.gyro.y, gz = g.gyro.z;
+
+        // Correct towards the measured gravity unless the wheels are accelerating the sensor hard
+        if (fabs(norm - ATTITUDE_ONE_G) < ATTITUDE_ACCEL_GATE * ATTITUDE_ONE_G)
+        {
+            ax /= norm;
+            ay /= norm;
+            az /= norm;
+            float ex = ay * vz - az * vy;
+            float ey = az * vx - ax * vz;
+            float ez = ax * vy - ay * vx;
+
+            biasX += ki * ex * dt;
+            biasY += ki * ey * dt;
+            biasZ += ki * ez * dt;
+            gx += kp * ex;
+            gy += kp * ey;
+            gz += kp * ez;
+        }
+        gx += biasX;
+        gy += biasY;
+        gz += biasZ;
+
+        // q += q * (0, g) * dt / 2
+        float h = 0.5f * dt;
+        float w0 = q0, w1 = q1, w2 = q2, w3 = q3;
+        q0 += (-w1 * gx - w2 * gy - w3 * gz) * h;
+        q1 += (w0 * gx + w2 * gz - w3 * gy) * h;
+        q2 += (w0 * gy - w1 * gz + w3 * gx) * h;
+        q3 += (w0 * gz + w1 * gy - w2 * gx) * h;
+        normalise();
+
+        // Rates from the bias-corrected gyro, without the proportional correction
+        float rx = g.gyro.x + biasX, ry = g.gyro.y + biasY, rz = g.gyro.z + biasZ;
+        vx = 2 * (q1 * q3 - q0 * q2);
+        vy = 2 * (q0 * q1 + q2 * q3);
+        vz = q0 * q0 - q1 * q1 - q2 * q2 + q3 * q3;
+
+        pitch = atan(vz / vx);
+        pitchRate = ry;
+        // rotation about the vertical, signed like gyro.x whichever way up the sensor is mounted
+        yawRate = (rx * vx + ry * vy + rz * vz) * (vx < 0 ? -1 : 1) + yawBias;
+        // gravity says nothing about heading, so learn the vertical bias while the robot is not turning
+        if (fabs(yawRate) < ATTITUDE_STILL_RATE)
+            yawBias -= yawRate * yawBiasGain * dt;
+        yaw += yawRate * dt;
+    }
+
+    float getPitch()
+    {
+        return pitch;
+    }
+
+    float getPitchRate()
+    {
+        return pitchRate;
+    }
+
+    // Heading integrated from yaw rate, unwrapped (rad)
+    float getYaw()
+    {
+        return yaw;
+    }
+
+    float getYawRate()
+    {
+        return yawRate;
+    }
+
+    // Drop the yaw bias learned while still, once the gyro is corrected upstream
+    void clearYawBias()
+    {
+        yawBias = 0;
+    }
+
+private:
+    bool initialised = false;
+    uint32_t lastUs = 0;
+    float q0 = 1, q1 = 0, q2 = 0, q3 = 0;
+    float biasX = 0, biasY = 0, biasZ = 0;
+    float yawBias = 0;
+    float pitch = 0, pitchRate = 0, yaw = 0, yawRate = 0;
+
+    // Start from the rotation taking the measured gravity direction u to the reference z axis
+    void initialise(float ux, float uy, float uz)
+    {
+        if (uz < -0.999f)
+        {
+            q0 = 0;
+            q1 = 1;
+            q2 = 0;
+            q3 = 0;
+        }
+        else
+        {
+            q0 = 1 + uz;
+            q1 = uy;
+            q2 = -ux;
+            q3 = 0;
+            normalise();
+        }
+        pitch = atan(uz / ux);
+        initialised = true;
+    }
+
+    void normalise()
+    {
+        float norm = sqrt(q0 * q0 + q1 * q1 + q2 * q2 + q3 * q3);
+        q0 /= norm;
+        q1 /= norm;
+        q2 /= norm;
+        q3 /= norm;
+    }
+};
+
+// Two-state Kalman filter over pitch and pitch gyro bias, fed the accelerometer's atan(z / x) as its measurement.
+// The 2x2 covariance is kept as four floats and every product is written out, so an update costs a few dozen flops
+class PitchKalman
+{
+
+public:
+    // Feed one sample taken at timestampUs (micros()). Skips the measurement while the accelerometer is off 1 g
+    void update(const sensors_event_t &a, const sensors_event_t &g, uint32_t timestampUs, float qAngle, float qBias,
+                float rAngle)
+    {
+        float ax = a.acceleration.x, ay = a.acceleration.y, az = a.acceleration.z;
+        float measured = atan(az / ax);
+
+        if (!initialised)
+        {
+            angle = measured;
+            lastUs = timestampUs;
+            initialised = true;
+            return;
+        }
+
+        float dt = static_cast<int32_t>(timestampUs - lastUs) * 1e-6f;
+        lastUs = timestampUs;
+        if (dt <= 0 || dt > ATTITUDE_MAX_DT)
+            return;
+
+        // Predict: the angle follows the bias-corrected gyro
+        rate = g.gyro.y - bias;
+        angle += rate * dt;
+        p00 += dt * (dt * p11 - p01 - p10 + qAngle);
+        p01 -= dt * p11;
+        p10 -= dt * p11;
+        p11 += qBias * dt;
+
+        float norm = sqrt(ax * ax + ay * ay + az * az);
+        if (fabs(norm - ATTITUDE_ONE_G) >= ATTITUDE_ACCEL_GATE * ATTITUDE_ONE_G)
+            return;
+
+        // Correct with the accelerometer angle
+        float s = p00 + rAngle;
+        float k0 = p00 / s;
+        float k1 = p10 / s;
+        float innovation = measured - angle;
+        angle += k0 * innovation;
+        bias += k1 * innovation;
+
+        float q00 = p00, q01 = p01;
+        p00 -= k0 * q00;
+        p01 -= k0 * q01;
+        p10 -= k1 * q00;
+        p11 -= k1 * q01;
+    }
+
+    float getPitch()
+    {
+        return angle;
+    }
+
+    float getPitchRate()
+    {
+        return rate;
+    }
+
+    // Gyro y bias estimate (rad/s)
+    float getBias()
+    {
+        return bias;
+    }
+
+private:
+    bool initialised = false;
+    uint32_t lastUs = 0;
+    float angle = 0, bias = 0, rate = 0;
+    float p00 = 0, p01 = 0, p10 = 0, p11 = 0;
+};
+
+#endif // ATTITUDE_H
@@ -0,0 +1,262 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "config.h"
+#include "bench_scenarios.h"
+
+// Stepper ISR tick types that costs are broken down by, from cheapest to most expensive
+enum TickType
+{
+    TICK_IDLE,         // both motors stopped
+    TICK_CRUISE,       // stepping at an unchanged speed
+    TICK_SPEED_CHANGE, // a speed update changed a motor's speed
+    TICK_REVERSAL,     // a motor changed direction
+    TICK_TYPES
+};
+
+const char *const TICK_TYPE_NAMES[TICK_TYPES] = {"idle", "cruise", "speed_change", "reversal"};
+
+const int ISR_HIST_BUCKETS = 64; // the last bucket collects everything above
+const int ISR_HIST_SHIFT = 5;    // 32 cycles per bucket
+
+// Cycle count statistics for one tick type
+struct IsrCycleStats
+{
+    uint32_t count;
+    uint32_t max;
+    uint64_t total;
+    uint32_t hist[ISR_HIST_BUCKETS];
+};
+
+IsrCycleStats isrStats[TICK_TYPES];
+volatile bool isrStatsReset = false; // set to have the ISR clear isrStats
+
+// Read the CPU cycle counter
+static inline uint32_t IRAM_ATTR cycleCount()
+{
+    uint32_t ccount;
+    asm volatile("rsr %0, ccount" : "=a"(ccount));
+    return ccount;
+}
+
+// Classify a tick by comparing the published motor speeds with the previous tick's
+TickType IRAM_ATTR classifyTick(const StepperState &state)
+{
+    static int32_t last[2] = {0, 0};
+    TickType type = TICK_IDLE;
+
+    for (int i = 0; i < 2; i++)
+    {
+        int32_t speed = state.motor[i].speed;
+        TickType motorType;
+        if ((speed > 0 && last[i] < 0) || (speed < 0 && last[i] > 0))
+            motorType = TICK_REVERSAL;
+        else if (speed != last[i])
+            motorType = TICK_SPEED_CHANGE;
+        else if (speed != 0)
+            motorType = TICK_CRUISE;
+        else
+            motorType = TICK_IDLE;
+
+        if (motorType > type)
+            type = motorType;
+        last[i] = speed;
+    }
+    return type;
+}
+
+// Record the cost of one ISR invocation
+void IRAM_ATTR recordIsrCycles(uint32_t cycles, TickType type)
+{
+    if (isrStatsReset)
+    {
+        for (int t = 0; t < TICK_TYPES; t++)
+        {
+            isrStats[t].count = 0;
+            isrStats[t].max = 0;
+            isrStats[t].total = 0;
+            for (int b = 0; b < ISR_HIST_BUCKETS; b++)
+                isrStats[t].hist[b] = 0;
+        }
+        isrStatsReset = false;
+    }
+
+    IsrCycleStats &stats = isrStats[type];
+    stats.count++;
+    stats.total += cycles;
+    if (cycles > stats.max)
+        stats.max = cycles;
+
+    uint32_t bucket = cycles >> ISR_HIST_SHIFT;
+    if (bucket >= ISR_HIST_BUCKETS)
+        bucket = ISR_HIST_BUCKETS - 1;
+    stats.hist[bucket]++;
+}
+
+// Cycle count that the given fraction of samples stay within, to histogram resolution. Do not call from ISR
+uint32_t isrPercentile(const IsrCycleStats &stats, float fraction)
+{
+    uint32_t wanted = static_cast<uint32_t>(stats.count * fraction);
+    uint32_t seen = 0;
+    for (int b = 0; b < ISR_HIST_BUCKETS - 1; b++)
+    {
+        seen += stats.hist[b];
+        if (seen >= wanted)
+            return (b + 1) << ISR_HIST_SHIFT;
+    }
+    return stats.max;
+}
+
+// Cost of one stepper tick for the step1/step2 pair in each scenario, printed over serial. Runs on private instances
+// with the drivers disabled, before the stepper interrupt starts
+void benchmarkSteppers()
+{
+    const int BENCH_TICKS = 20000;
+    const int WARMUP_TICKS = 5000; // reach cruise speed before timing
+
+    pinMode(STEPPER_EN, OUTPUT);
+    digitalWrite(STEPPER_EN, true);
+
+    Serial.println("Stepper tick cycles (mean / max): step pair");
+    for (int s = 0; s < BENCH_SCENARIOS; s++)
+    {
+        BenchScenario scenario = static_cast<BenchScenario>(s);
+        step a(STEPPER_INTERVAL_US, STEPPER1_STEP_PIN, STEPPER1_DIR_PIN);
+        step b(STEPPER_INTERVAL_US, STEPPER2_STEP_PIN, STEPPER2_DIR_PIN);
+        uint64_t pairTotal = 0;
+        uint32_t pairMax = 0;
+
+        for (int i = -WARMUP_TICKS; i < BENCH_TICKS; i++)
+        {
+            float accel, speed;
+            benchTargets(scenario, i < 0 && scenario == BENCH_ACCELERATING ? 0 : i, accel, speed);
+            if (i % 400 == 0)
+            {
+                // opposite directions, as in a turn
+                a.applyCommand(a.commandRad(accel, speed));
+                b.applyCommand(b.commandRad(accel, -speed));
+            }
+
+            uint32_t start = cycleCount();
+            a.runStepper();
+            b.runStepper();
+            uint32_t pairCycles = cycleCount() - start;
+
+            if (i >= 0)
+            {
+                pairTotal += pairCycles;
+                pairMax = pairCycles > pairMax ? pairCycles : pairMax;
+            }
+        }
+
+        Serial.printf("  %-12s %5u / %5u\n", BENCH_SCENARIO_NAMES[s], static_cast<uint32_t>(pairTotal / BENCH_TICKS),
+                      pairMax);
+    }
+}
+
+// Compare the GPIO writes of a tick where both motors step: the six per-pin gpioWriteFast() calls the step pair makes,
+// against one set and one clear of all four pins at once. The difference is the most that batching the step pair's
+// writes could save, in cycles per tick, printed over serial. Drivers disabled
+void benchmarkGpioWrites()
+{
+    const int ROUNDS = 10000;
+    const uint32_t STEP_MASK = (1UL << STEPPER1_STEP_PIN) | (1UL << STEPPER2_STEP_PIN);
+    const uint32_t DIR_MASK = (1UL << STEPPER1_DIR_PIN) | (1UL << STEPPER2_DIR_PIN);
+
+    pinMode(STEPPER_EN, OUTPUT);
+    digitalWrite(STEPPER_EN, true);
+
+    uint32_t start = cycleCount();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        gpioWriteFast(STEPPER1_STEP_PIN, HIGH);
+        gpioWriteFast(STEPPER1_DIR_PIN, i & 1);
+        gpioWriteFast(STEPPER1_STEP_PIN, LOW);
+        gpioWriteFast(STEPPER2_STEP_PIN, HIGH);
+        gpioWriteFast(STEPPER2_DIR_PIN, i & 1);
+        gpioWriteFast(STEPPER2_STEP_PIN, LOW);
+    }
+    uint32_t perPin = cycleCount() - start;
+
+    start = cycleCount();
+    for (int i = 0; i < ROUNDS; i++)
+    {
+        REG_WRITE(GPIO_OUT_W1TS_REG, STEP_MASK | (i & 1 ? DIR_MASK : 0));
+        REG_WRITE(GPIO_OUT_W1TC_REG, STEP_MASK | (i & 1 ? 0 : DIR_MASK));
+    }
+    uint32_t batched = cycleCount() - start;
+
+    Serial.printf("Stepping tick GPIO write cycles: per pin %u, batched %u\n", perPin / ROUNDS, batched / ROUNDS);
+}
+
+// Compare the step period by fastDivide() with the hardware divider, in cycles per call over the speed range, printed
+// over serial. STEP_FAST_DIVIDE should only be set if fastDivide() is the cheaper
+void benchmarkDivide()
+{
+    const int SPEEDS = 256;
+    const int ROUNDS = 40;
+    step motor(STEPPER_INTERVAL_US, STEPPER1_STEP_PIN, STEPPER1_DIR_PIN);
+    const uint32_t scale = motor.PERIOD_SCALE;
+
+    // spread over the whole speed range, read through volatile so neither loop is folded away
+    volatile uint32_t speeds[SPEEDS];
+    for (int i = 0; i < SPEEDS; i++)
+        speeds[i] = 1 + static_cast<uint32_t>(static_cast<uint64_t>(motor.MAX_SPEED) * motor.SPEED_SCALE * i / SPEEDS);
+    volatile uint32_t sink;
+    uint32_t mismatches = 0;
+    for (int i = 0; i < SPEEDS; i++)
+        mismatches += fastDivide(scale, speeds[i]) != scale / speeds[i];
+
+    uint32_t start = cycleCount();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < SPEEDS; i++)
+            sink = speeds[i];
+    uint32_t loopCycles = cycleCount() - start;
+
+    start = cycleCount();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < SPEEDS; i++)
+            sink = fastDivide(scale, speeds[i]);
+    uint32_t fastCycles = cycleCount() - start;
+
+    start = cycleCount();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int i = 0; i < SPEEDS; i++)
+            sink = scale / speeds[i];
+    uint32_t divideCycles = cycleCount() - start;
+    (void)sink;
+
+    const float calls = SPEEDS * ROUNDS;
+    Serial.printf("Step period cycles per call, less the loop: fastDivide %.1f, hardware divide %.1f (%u mismatches)\n",
+                  (static_cast<int32_t>(fastCycles - loopCycles)) / calls,
+                  (static_cast<int32_t>(divideCycles - loopCycles)) / calls, mismatches);
+}
+
+// Cost of the gyro spectrum analysis and the pitch rate notches, printed over serial. analyse() runs in the spectrum
+// task on the other core; every notch runs on each IMU sample in the balance task. Runs on private instances fed a tone
+void benchmarkSpectrum()
+{
+    const int ROUNDS = 10000;
+    const float TONE_HZ = 137.3;
+    static SpectrumAnalyzer analyzer(GYRO_SAMPLE_RATE_HZ);
+
+    int i = 0;
+    while (!analyzer.push(sin(2 * PI * TONE_HZ * i++ / GYRO_SAMPLE_RATE_HZ)))
+        ;
+    uint32_t start = cycleCount();
+    analyzer.analyse(MAX_NOTCHES);
+    uint32_t analyseCycles = cycleCount() - start;
+
+    Biquad notch;
+    notch.configureNotch(TONE_HZ, NOTCH_Q, GYRO_SAMPLE_RATE_HZ);
+    volatile float sink = 0;
+    start = cycleCount();
+    for (int r = 0; r < ROUNDS; r++)
+        sink = notch.process(sink + 1);
+    uint32_t notchCycles = cycleCount() - start;
+
+    Serial.printf("Gyro spectrum cycles: analyse %u, notch %.1f per sample\n", analyseCycles,
+                  static_cast<float>(notchCycles) / ROUNDS);
+}
+
+#endif // BENCH_H
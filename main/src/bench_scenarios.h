@@ -0,0 +1,45 @@
+#ifndef BENCH_SCENARIOS_H
+#define BENCH_SCENARIOS_H
+
+// Stepper benchmark scenarios, shared by benchmarkSteppers() on the target and the host benchmark in
+// test/test_stepper_bench
+
+enum BenchScenario
+{
+    BENCH_IDLE,
+    BENCH_CRUISE,
+    BENCH_ACCELERATING,
+    BENCH_REVERSAL,
+    BENCH_SCENARIOS
+};
+
+const char *const BENCH_SCENARIO_NAMES[BENCH_SCENARIOS] = {"idle", "cruise", "accelerating", "reversal"};
+
+// Motor targets of a scenario at tick i, in rad/s/s and rad/s
+void benchTargets(BenchScenario scenario, int i, float &accel, float &speed)
+{
+    switch (scenario)
+    {
+    case BENCH_IDLE:
+        accel = 0;
+        speed = 0;
+        break;
+    case BENCH_CRUISE:
+        accel = 1000;
+        speed = 10;
+        break;
+    case BENCH_ACCELERATING:
+        accel = 20;
+        speed = 20;
+        break;
+    case BENCH_REVERSAL:
+        // swing through zero every 10 ms
+        accel = 200;
+        speed = (i / 500) % 2 ? 1 : -1;
+        break;
+    default:
+        break;
+    }
+}
+
+#endif // BENCH_SCENARIOS_H
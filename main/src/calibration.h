@@ -0,0 +1,123 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <Arduino.h>
+#include <Adafruit_Sensor.h>
+#include <Preferences.h>
+
+const uint16_t CALIBRATION_VERSION = 1;       // bump when Calibration changes
+const float CALIBRATION_REFRESH_GAIN = 0.1;   // weight of a new still window in the stored offsets
+const float CALIBRATION_MIN_NORM = 0.8;       // accelerometer magnitudes outside these fractions of 1 g are not trusted
+const float CALIBRATION_MAX_NORM = 1.2;
+const float CALIBRATION_ONE_G = 9.80665;      // (m/s/s)
+
+// IMU offsets and the hand-tuned balance offsets, stored as one blob in NVS. Only what a still robot can observe is
+// measured: the gyro offsets, the lateral accelerometer offset, which is zero on level ground at any pitch, and the
+// accelerometer scale, from its magnitude. A forward accelerometer offset reads as tilt and is part of bias
+struct Calibration
+{
+    uint16_t version;
+    uint16_t size;           // sizeof(Calibration), so a layout change is caught even without a version bump
+    float gyroOffset[3];     // gyro x, y, z reading at rest (rad/s)
+    float accelOffsetY;      // lateral accelerometer reading at rest (m/s/s)
+    float accelScale;        // 1 g over the accelerometer magnitude at rest
+    float pitchBias;         // bias, the balance pitch (rad)
+    float yawBias;           // yaw_bias
+    float cameraBias;        // camera_bias
+    uint32_t crc;            // CRC-32 of everything before it
+};
+
+// Standard reflected CRC-32, polynomial 0xEDB88320
+uint32_t crc32(const uint8_t *bytes, size_t length)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++)
+    {
+        crc ^= bytes[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+uint32_t calibrationCrc(const Calibration &calibration)
+{
+    return crc32(reinterpret_cast<const uint8_t *>(&calibration), offsetof(Calibration, crc));
+}
+
+// Calibration with no offsets, and the given balance offsets
+Calibration defaultCalibration(float pitchBias, float yawBias, float cameraBias)
+{
+    Calibration calibration = {};
+    calibration.version = CALIBRATION_VERSION;
+    calibration.size = sizeof(Calibration);
+    calibration.accelScale = 1;
+    calibration.pitchBias = pitchBias;
+    calibration.yawBias = yawBias;
+    calibration.cameraBias = cameraBias;
+    return calibration;
+}
+
+// Read the blob from NVS. Returns false, leaving calibration unchanged, if it is missing, of another version or
+// layout, or corrupt
+bool loadCalibration(const char *space, Calibration &calibration)
+{
+    Preferences preferences;
+    if (!preferences.begin(space, true))
+        return false;
+    Calibration stored;
+    bool ok = preferences.getBytesLength("blob") == sizeof(stored) &&
+              preferences.getBytes("blob", &stored, sizeof(stored)) == sizeof(stored);
+    preferences.end();
+    if (!ok || stored.version != CALIBRATION_VERSION || stored.size != sizeof(Calibration) ||
+        stored.crc != calibrationCrc(stored))
+        return false;
+
+    calibration = stored;
+    return true;
+}
+
+bool saveCalibration(const char *space, Calibration &calibration)
+{
+    calibration.crc = calibrationCrc(calibration);
+    Preferences preferences;
+    if (!preferences.begin(space, false))
+        return false;
+    bool ok = preferences.putBytes("blob", &calibration, sizeof(calibration)) == sizeof(calibration);
+    preferences.end();
+    return ok;
+}
+
+// Take the offsets from the means of a still window, gyro x, y, z then accelerometer x, y, z as StillWindow reports
+// them. weight 1 replaces the offsets, as on first boot; smaller weights blend the window in. Returns false if the
+// accelerometer magnitude is implausible
+bool measureCalibration(Calibration &calibration, const float *mean, float weight)
+{
+    float norm = sqrt(mean[3] * mean[3] + mean[4] * mean[4] + mean[5] * mean[5]);
+    if (norm < CALIBRATION_MIN_NORM * CALIBRATION_ONE_G || norm > CALIBRATION_MAX_NORM * CALIBRATION_ONE_G)
+        return false;
+
+    for (int axis = 0; axis < 3; axis++)
+        calibration.gyroOffset[axis] += weight * (mean[axis] - calibration.gyroOffset[axis]);
+    calibration.accelOffsetY += weight * (mean[4] - calibration.accelOffsetY);
+    calibration.accelScale += weight * (CALIBRATION_ONE_G / norm - calibration.accelScale);
+    return true;
+}
+
+// Remove the accelerometer offsets from a raw reading
+void applyAccelCalibration(const Calibration &calibration, sensors_event_t &a)
+{
+    a.acceleration.x *= calibration.accelScale;
+    a.acceleration.y = (a.acceleration.y - calibration.accelOffsetY) * calibration.accelScale;
+    a.acceleration.z *= calibration.accelScale;
+}
+
+// Remove the gyro offsets from a raw reading
+void applyGyroCalibration(const Calibration &calibration, sensors_event_t &g)
+{
+    g.gyro.x -= calibration.gyroOffset[0];
+    g.gyro.y -= calibration.gyroOffset[1];
+    g.gyro.z -= calibration.gyroOffset[2];
+}
+
+#endif // CALIBRATION_H
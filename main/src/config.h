@@ -3,12 +3,27 @@
 
 #include <Arduino.h>
 #include <Wire.h>
-#include <TimerInterrupt_Generic.h>
+#include <driver/timer.h>
+#include <soc/timer_group_reg.h>
 #include <Adafruit_MPU6050.h>
 #include <Adafruit_Sensor.h>
 #include <step.h>
+#include <mailbox.h>
+#include <imu.h>
+#include <attitude.h>
+#include <wheel_velocity.h>
+#include <decimator.h>
+#include <spectrum.h>
+#include <gyro_bias.h>
+#include <calibration.h>
+#include <ultrasonic.h>
+#include <obstacle.h>
+#include <loop_timing.h>
+#include <pid_controller.h>
+#include <lqr.h>
 #include <ESPAsyncWebServer.h>
 #include <ArduinoJson.h>
+#include <Ticker.h>
 
 // The Stepper pins
 #define STEPPER1_DIR_PIN 18  // Arduino D6
@@ -20,6 +35,10 @@
 // Diagnostic pin for oscilloscope
 #define TOGGLE_PIN 32 // Arduino A4
 
+// MPU6050 data ready interrupt, a wire from the MPU6050 INT pin. Needed by IMU_FIFO_MODE, which polls the FIFO
+// instead if the interrupt stays silent
+#define MPU_INT_PIN 27
+
 #define trigPin 26 // Arduino A1
 #define echoPin 25 // Arduino A2
 
@@ -29,21 +48,82 @@ const int LOOP_INTERVAL_INNER = 8; // strongly affect stability!!!!!!!!!!!!!!
 const int LOOP_INTERVAL_OUTER = 10;
 const int TURN_INTERVAL = 20;
 const int STEPPER_INTERVAL_US = 20;
+const bool STEPPER_EVENT_DRIVEN = false; // arm a one-shot alarm at the next step edge instead of a fixed STEPPER_INTERVAL_US tick
+const int STEPPER_MIN_ALARM_US = 5;      // shortest one-shot alarm, covers ISR entry and exit
+const bool STEPPER_DDA = false;          // phase accumulator step generation, see step::setDDA()
+// a one-shot alarm advances the motors by up to MAX_SPEED_INTERVAL_US, over which the phase overflows at high rates
+static_assert(!(STEPPER_DDA && STEPPER_EVENT_DRIVEN), "STEPPER_DDA needs the fixed STEPPER_INTERVAL_US tick");
+const bool RUN_STEPPER_BENCH = false;    // print stepper tick, GPIO write, divide and spectrum cycles at boot
+const bool RECORD_ISR_STATS = true;      // keep per-tick-type ISR cycle histograms, served on /isrStats
+const bool IMU_FIFO_MODE = true;          // read the MPU6050 through its FIFO and data ready interrupt, see MPU_INT_PIN
+const uint16_t IMU_SAMPLE_RATE_HZ = 1000; // MPU6050 sample rate in FIFO mode, a divisor of 1 kHz
+const uint32_t IMU_BURST_SAMPLES = 4;     // samples gathered in the FIFO before draining them between ticks
+const int GYRO_FILTER_RATIO = IMU_FIFO_MODE ? IMU_SAMPLE_RATE_HZ * LOOP_INTERVAL_INNER / 1000 : 1; // samples per tick
+// on-chip low pass. In FIFO mode the decimator does the rest, see decimator.py
+const mpu6050_bandwidth_t IMU_DLPF_BANDWIDTH = IMU_FIFO_MODE ? MPU6050_BAND_260_HZ : MPU6050_BAND_44_HZ;
+const uint32_t IMU_I2C_CLOCK_HZ = 400000;
+const float GYRO_SAMPLE_RATE_HZ = IMU_FIFO_MODE ? IMU_SAMPLE_RATE_HZ : 1000.0 / LOOP_INTERVAL_INNER; // rate fed to the notches
+const bool MEASURED_WHEEL_VELOCITY = true; // velocity loop feedback from step edge timing rather than the commanded speed
+const bool GYRO_TEMP_MODEL = true;           // learn gyro bias against die temperature and remove it before fusion
+const char *const GYRO_MODEL_NAMESPACE = "gyro_temp"; // NVS namespace of the model
+const int TEMPERATURE_INTERVAL = 1000;       // IMU die temperature read and model save check period (ms)
+const char *const CALIBRATION_NAMESPACE = "calibration"; // NVS namespace of the calibration blob
+const unsigned long CALIBRATION_BOOT_MS = 3000;   // longest wait for a still window without a stored calibration
+const unsigned long CALIBRATION_SAVE_MS = 300000; // shortest time between NVS writes of refreshed offsets
+const float KALMAN_Q_ANGLE = 0.001; // PitchKalman process noise of the angle (rad^2/s)
+const float KALMAN_Q_BIAS = 0.003;  // PitchKalman process noise of the gyro bias (rad^2/s^3)
+const float KALMAN_R_ANGLE = 0.03;  // PitchKalman variance of the accelerometer angle (rad^2)
 const int CONTROLLER_INTERVAL = 100;
+const int BALANCE_TICK_MS = 1;      // balance task wake period, for draining the IMU; divides LOOP_INTERVAL_INNER
+const int BUZZER_INTERVAL_MS = 10;  // buzzer task wake period
+const int BUZZER_QUEUE_LENGTH = 4;  // melody requests waiting for the buzzer task
 const int ACTION_INTERVAL = 5000;
 
+// FreeRTOS tasks. The balance task has core 1 to itself but for the stepper interrupt and the state task; Wi-Fi, the
+// web server, the spectrum analysis and the buzzer run on core 0
+const BaseType_t CONTROL_CORE = APP_CPU_NUM;
+const BaseType_t NETWORK_CORE = PRO_CPU_NUM;
+const UBaseType_t BALANCE_TASK_PRIORITY = configMAX_PRIORITIES - 5; // below only system tasks such as Wi-Fi
+const UBaseType_t STATE_TASK_PRIORITY = 5;
+const UBaseType_t BUZZER_TASK_PRIORITY = 2;
+const uint32_t BALANCE_TASK_STACK = 8192;
+const uint32_t STATE_TASK_STACK = 8192; // NVS writes
+const uint32_t BUZZER_TASK_STACK = 4096;
+
+// Wheel geometry for in-place turns on wheel travel
+const float WHEEL_RADIUS = 0.034; // (m)
+const float WHEEL_BASE = 0.165;   // distance between the wheel contact points (m)
+const float TURN_MOVE_SPEED = 4.0;  // wheel speed of in-place turns (rad/s)
+const float TURN_MOVE_ACCEL = 20.0; // wheel acceleration of in-place turns (rad/s/s)
+
 // PID control gains
 float vertical_kp = 200;  // 200//200//300//300
 float vertical_kd = 300;  // 300//400//400//375
 float velocity_kp = 0.03; // 0.04//0.03//0.015//0.03
 float velocity_ki = velocity_kp / 200;
+float lqr_k_pitch = 2194; // LQR balance gains, from lqr.py
+float lqr_k_rate = 219.9;
+float lqr_k_position = 27.36;
+float lqr_k_speed = 28.08;
 float turn_kp = -0.5; // 1
 float turn_kd = -1;   // 2
 float turn_speed = 0.0;
 float turn_direction = 0.0;
 float camera_kp = 0.02;
 float camera_kd = 0.0;
+float attitude_kp = 2.5;  // attitude estimator accelerometer correction, about its crossover (rad/s)
+float attitude_ki = 0.05; // attitude estimator gyro bias learning rate
+float accel_comp_gain = 1.0; // fraction of the commanded wheel acceleration removed from the accelerometer, 0 disables
+int gyro_filter = DECIMATOR_CIC1; // DecimatorMode from the IMU rate to the control rate, see decimator.py
+int gyro_filter_taps = 8;         // decimator kernel length
+int pitch_estimator = 0;  // pitch and pitch rate source, 0 Mahony attitude, 1 PitchKalman
+int notch_count = 1;      // vibration peaks notched out of the pitch rate, 0 to MAX_NOTCHES
+int balance_controller = BALANCE_CASCADE; // BalanceController, 0 cascaded PD/PI, 1 LQR state feedback
+int loop_policy = LOOP_SKIP; // LoopPolicy of the periodic loops after a stall, 0 catch up, 1 skip
+float wheel_jerk = 0.0; // S-curve jerk limit (rad/s/s/s), 0 for constant acceleration ramps
+float wheel_speed_limit = 20.0; // wheel speed limit of every motor command, at most MAX_SPEED (rad/s)
 bool turning = false;
+bool wheel_turning = false; // in-place turn on wheel travel in progress, heading loop paused
 bool back_to_track = false;
 
 // vertical loop
@@ -53,6 +133,7 @@ float gyro_y;
 
 // velocity loop
 float velocity1;
+float wheel_accel = 0.0; // mean wheel acceleration last commanded, in wheel direction (rad/s/s)
 float velcoity2;
 float velocity_input = 0.0;
 
@@ -65,7 +146,6 @@ float cam_rho = 0.0;
 float cam_theta = 0.0;
 float gyro_x = 0.0;
 float current_yaw = 0.0;
-float previous_yaw = 0.0;
 const bool continue_turning = false;
 float turn_loop_count = 0.0;
 
@@ -89,15 +169,14 @@ bool color_detected = false;
 bool tracking = true;
 
 // ultrasonic sensor
-
-long duration;
-int distance;
-bool ultrasonic_flag = false;
-bool stop_flag = false;
+const uint32_t ULTRASONIC_STALE_US = 300000;   // a range older than this means the sensor stopped answering
+float distance = ULTRASONIC_MAX_RANGE;         // latest filtered range (cm)
+float obstacle_standoff = 0.15;                // distance from an obstacle to stop at (m)
+float obstacle_decel = 0.3;                    // braking deceleration for obstacles, about 1.7 deg of lean (m/s/s)
+volatile bool ultrasonic_flag = false;         // braking for an obstacle, for the buzzer task's alarm
 
 // Motion target values
 float target_velocity = -1;
-float last_target_velocity = 0;
 float target_angle = 0.0;
 
 // web controller
@@ -148,7 +227,10 @@ struct BuzzerTask
     BuzzerState state;
 };
 
-BuzzerTask *currentBuzzerTask = nullptr;
+// The buzzer task owns the melodies below. Other tasks send it the one to play, or nullptr to stop, and read back
+// whether it is idle
+QueueHandle_t buzzerRequests = nullptr;
+volatile bool buzzerIdle = true; // no melody playing, written only by the buzzer task
 
 BuzzerTask beat1 = {
     {NOTE_C4, NOTE_D4, NOTE_E4, NOTE_F4, NOTE_G4, NOTE_A4, NOTE_B4, NOTE_C4},
@@ -172,10 +254,69 @@ BuzzerTask alarm2 = {
     IDLE};
 
 // Global objects
-ESP32Timer ITimer(3);
 Adafruit_MPU6050 mpu;
+ImuFifo imu(MPU_INT_PIN);
+Attitude attitude;
+PitchKalman pitchKalman;
+GyroTempModel gyroModel;
+StillWindow stillWindow;
+Ultrasonic ultrasonic;
+Ticker ultrasonicTicker;
+ObstacleBrake obstacle;
+Calibration calibration = defaultCalibration(bias, yaw_bias, camera_bias);
+bool imuCalibrated = false;     // calibration was loaded or measured, rather than the defaults
+bool calibrationDirty = false;  // offsets refreshed since the last save
+Decimator pitchRateFilter;
+Decimator yawRateFilter;
+SpectrumAnalyzer gyroSpectrum(GYRO_SAMPLE_RATE_HZ);
+Biquad pitchNotch[MAX_NOTCHES];
+float pitchNotchHz[MAX_NOTCHES] = {0}; // current notch centres, 0 when bypassed (Hz)
+TaskHandle_t spectrumTaskHandle = nullptr;
+TaskHandle_t balanceTaskHandle = nullptr;
+TaskHandle_t stateTaskHandle = nullptr;
+TaskHandle_t buzzerTaskHandle = nullptr;
+Pid<float, PidDerivative, PidMeasuredRate> verticalPid;                     // PD on pitch, D from the gyro
+Pid<float, PidErrorFilter, PidIntegral, PidIntegralClamp> velocityPid;    // PI on the filtered wheel speed error
+Pid<float, PidDerivativeOnMeasurement, PidMeasuredRate> headingPid;       // PD on yaw, D from the gyro
+Pid<float, PidDerivativeOnMeasurement, PidMeasuredRate> cameraPid;        // PD on the camera's line offset
+BalanceLqr balanceLqr;                                                     // state feedback alternative to the first two
+LoopTiming innerTiming(LOOP_INTERVAL_INNER * 1000);
+LoopTiming outerTiming(LOOP_INTERVAL_OUTER * 1000);
+LoopTiming controllerTiming(CONTROLLER_INTERVAL * 1000);
+portMUX_TYPE imuStateLock = portMUX_INITIALIZER_UNLOCKED; // calibration and gyroModel, learned by the balance task
 step step1(STEPPER_INTERVAL_US, STEPPER1_STEP_PIN, STEPPER1_DIR_PIN);
 step step2(STEPPER_INTERVAL_US, STEPPER2_STEP_PIN, STEPPER2_DIR_PIN);
+
+// Both motors' commands, published to the ISR together
+struct StepperCommand
+{
+    MotorCommand motor[2];
+};
+
+// Both motors' position moves, started by the ISR on the same tick
+struct StepperMove
+{
+    MotorMove motor[2];
+};
+
+// Both motors' state, published by the ISR every tick
+struct StepperState
+{
+    MotorState motor[2];
+    uint32_t moveVersion; // version of the last StepperMove started
+};
+
+// Gyro decimator settings, published by the web handlers and applied by the balance task between samples
+struct DecimatorSettings
+{
+    int mode; // DecimatorMode
+    int taps;
+};
+
+Mailbox<StepperCommand> stepperCommand;
+Mailbox<StepperMove> stepperMove;
+Mailbox<StepperState> stepperState;
+Mailbox<DecimatorSettings> decimatorSettings;
 // wifi
 AsyncWebServer server(80);
 AsyncEventSource events("/events");
@@ -0,0 +1,110 @@
+#ifndef DECIMATOR_H
+#define DECIMATOR_H
+
+#include <Arduino.h>
+
+const int DECIMATOR_MAX_TAPS = 32; // also the history kept
+
+enum DecimatorMode
+{
+    DECIMATOR_LATEST, // newest sample only
+    DECIMATOR_CIC1,   // mean of the last taps samples
+    DECIMATOR_CIC2,   // two cascaded means, a triangle 2 * taps - 1 long
+    DECIMATOR_FIR     // Hamming windowed sinc, cut off at the output Nyquist frequency
+};
+
+// Design the kernel of a decimator mode, newest sample first, for decimation by ratio. Returns the kernel length,
+// clipped to DECIMATOR_MAX_TAPS. Without decimation only the latest sample is used. decimator.py designs the same
+// kernels to print their delay and attenuation
+int designDecimator(int mode, int taps, int ratio, float *kernel)
+{
+    if (ratio <= 1)
+        mode = DECIMATOR_LATEST;
+    if (taps < 1)
+        taps = 1;
+    if (taps > DECIMATOR_MAX_TAPS)
+        taps = DECIMATOR_MAX_TAPS;
+
+    int length = 1;
+    kernel[0] = 1;
+    if (mode == DECIMATOR_CIC1 || mode == DECIMATOR_CIC2)
+    {
+        length = taps;
+        for (int i = 0; i < length; i++)
+            kernel[i] = 1;
+        if (mode == DECIMATOR_CIC2)
+        {
+            // convolve the boxcar with itself
+            length = 2 * taps - 1 < DECIMATOR_MAX_TAPS ? 2 * taps - 1 : DECIMATOR_MAX_TAPS;
+            for (int i = 0; i < length; i++)
+                kernel[i] = taps - abs(i - (taps - 1));
+        }
+    }
+    else if (mode == DECIMATOR_FIR)
+    {
+        length = taps;
+        float cutoff = 0.5f / ratio; // output Nyquist, in cycles per input sample
+        float centre = (length - 1) / 2.0f;
+        for (int i = 0; i < length; i++)
+        {
+            float x = i - centre;
+            float sinc = x == 0 ? 2 * cutoff : sin(2 * PI * cutoff * x) / (PI * x);
+            float window = length > 1 ? 0.54f - 0.46f * cos(2 * PI * i / (length - 1)) : 1;
+            kernel[i] = sinc * window;
+        }
+    }
+
+    float sum = 0;
+    for (int i = 0; i < length; i++)
+        sum += kernel[i];
+    for (int i = 0; i < length; i++)
+        kernel[i] /= sum;
+    return length;
+}
+
+// FIR decimator over a stream of high-rate samples. Every sample is pushed, and output() is read once per
+// control tick, so only the taps that are used are ever multiplied
+class Decimator
+{
+
+public:
+    // Select the kernel. ratio is the number of input samples per output
+    void configure(int mode, int taps, int ratio)
+    {
+        length = designDecimator(mode, taps, ratio, kernel);
+    }
+
+    void push(float sample)
+    {
+        head = (head + 1) % DECIMATOR_MAX_TAPS;
+        history[head] = sample;
+        if (filled < DECIMATOR_MAX_TAPS)
+            filled++;
+    }
+
+    // Filtered value at the newest sample, with a delay of (length - 1) / 2 input samples
+    float output()
+    {
+        int n = length < filled ? length : filled;
+        if (n == 0)
+            return 0;
+
+        float sum = 0, weight = 0;
+        for (int i = 0; i < n; i++)
+        {
+            sum += kernel[i] * history[(head + DECIMATOR_MAX_TAPS - i) % DECIMATOR_MAX_TAPS];
+            weight += kernel[i];
+        }
+        // renormalise while the history is still shorter than the kernel
+        return sum / weight;
+    }
+
+private:
+    float kernel[DECIMATOR_MAX_TAPS] = {1};
+    float history[DECIMATOR_MAX_TAPS] = {0};
+    int length = 1;
+    int head = 0;
+    int filled = 0;
+};
+
+#endif // DECIMATOR_H
@@ -0,0 +1,105 @@
+# Print the latency and attenuation of the gyro decimator configurations in decimator.h, combined with each
+# MPU6050 on-chip low pass setting, so gyro_filter, gyro_filter_taps and IMU_DLPF_BANDWIDTH can be picked deliberately.
+# Pure Python, no numpy needed.
+import argparse
+import cmath
+import math
+
+# Mirrors DecimatorMode in decimator.h
+MODES = {0: "latest", 1: "cic1", 2: "cic2", 3: "fir"}
+MAX_TAPS = 32
+
+# MPU6050 DLPF settings: Adafruit name, gyro bandwidth (Hz) and delay (ms) from the register map
+DLPF = [
+    ("MPU6050_BAND_260_HZ", 256, 0.98),
+    ("MPU6050_BAND_184_HZ", 188, 1.9),
+    ("MPU6050_BAND_94_HZ", 98, 2.8),
+    ("MPU6050_BAND_44_HZ", 42, 4.8),
+    ("MPU6050_BAND_21_HZ", 20, 8.3),
+]
+
+
+def design(mode, taps, ratio):
+    """Same kernel as designDecimator() in decimator.h, newest sample first"""
+    if ratio <= 1:
+        mode = 0
+    taps = max(1, min(taps, MAX_TAPS))
+    kernel = [1.0]
+    if mode in (1, 2):
+        kernel = [1.0] * taps
+        if mode == 2:
+            length = min(2 * taps - 1, MAX_TAPS)
+            kernel = [float(taps - abs(i - (taps - 1))) for i in range(length)]
+    elif mode == 3:
+        cutoff = 0.5 / ratio
+        centre = (taps - 1) / 2.0
+        kernel = []
+        for i in range(taps):
+            x = i - centre
+            sinc = 2 * cutoff if x == 0 else math.sin(2 * math.pi * cutoff * x) / (math.pi * x)
+            window = 0.54 - 0.46 * math.cos(2 * math.pi * i / (taps - 1)) if taps > 1 else 1.0
+            kernel.append(sinc * window)
+    total = sum(kernel)
+    return [k / total for k in kernel]
+
+
+def gain(kernel, freq, rate):
+    return abs(sum(k * cmath.exp(-2j * math.pi * freq / rate * i) for i, k in enumerate(kernel)))
+
+
+def dlpf_gain(bandwidth, freq):
+    # single pole approximation of the on-chip filter
+    return 1 / math.sqrt(1 + (freq / bandwidth) ** 2)
+
+
+def db(x):
+    return 20 * math.log10(max(x, 1e-9))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Gyro decimator latency and attenuation")
+    parser.add_argument("--rate", type=float, default=1000, help="IMU sample rate, IMU_SAMPLE_RATE_HZ (Hz)")
+    parser.add_argument("--ratio", type=int, default=8, help="samples per control tick, GYRO_FILTER_RATIO")
+    parser.add_argument("--band", type=float, default=10, help="control bandwidth to keep alias free (Hz)")
+    parser.add_argument("--dlpf", default="all", help="Adafruit DLPF name to show, or all")
+    args = parser.parse_args()
+
+    out_rate = args.rate / args.ratio
+    # input frequencies that fold into the control band after decimation
+    aliases = []
+    k = 1
+    while k * out_rate - args.band < args.rate / 2:
+        for step in range(11):
+            f = k * out_rate + args.band * (step / 5 - 1)
+            if f <= args.rate / 2:
+                aliases.append(f)
+        k += 1
+    print(f"IMU {args.rate:g} Hz decimated by {args.ratio} to {out_rate:g} Hz, control band {args.band:g} Hz")
+    print("delay: decimator + DLPF (ms); band gain: at the control band edge (dB);")
+    print("alias: worst gain of what folds into the control band (dB); noise: rms of white gyro noise after both filters")
+    print("The DLPF is modelled as a single pole at its bandwidth")
+    print()
+    print(f"{'DLPF':<22}{'filter':<8}{'taps':>5}{'delay':>8}{'band':>8}{'alias':>8}{'noise':>8}")
+
+    configs = [(0, 1)] + [(mode, taps) for mode in (1, 2, 3) for taps in (2, 4, 8, 16)]
+    for name, bandwidth, dlpf_delay in DLPF:
+        if args.dlpf != "all" and args.dlpf != name:
+            continue
+        for mode, taps in configs:
+            kernel = design(mode, taps, args.ratio)
+            delay = (len(kernel) - 1) / 2 / args.rate * 1000 + dlpf_delay
+            band = gain(kernel, args.band, args.rate) * dlpf_gain(bandwidth, args.band)
+            alias = 0
+            for f in aliases:
+                alias = max(alias, gain(kernel, f, args.rate) * dlpf_gain(bandwidth, f))
+            # white gyro noise through both filters, relative to the unfiltered gyro
+            points = 500
+            power = sum((gain(kernel, f, args.rate) * dlpf_gain(bandwidth, f)) ** 2
+                        for f in (args.rate / 2 * (i + 0.5) / points for i in range(points)))
+            noise = math.sqrt(power / points)
+            print(f"{name:<22}{MODES[mode]:<8}{taps:>5}{delay:>8.2f}{db(band):>8.2f}{db(alias):>8.1f}{noise:>8.2f}")
+        print()
+
+
+if __name__ == "__main__":
+    main()
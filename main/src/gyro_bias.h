@@ -0,0 +1,246 @@
+#ifndef GYRO_BIAS_H
+#define GYRO_BIAS_H
+
+#include <Arduino.h>
+#include <Adafruit_Sensor.h>
+#include <Preferences.h>
+
+const float GYRO_TEMP_MIN = -8;            // lower edge of the first temperature bin (°C)
+const float GYRO_TEMP_BIN_WIDTH = 2;       // (°C)
+const int GYRO_TEMP_BINS = 40;             // up to 72 °C
+const uint32_t GYRO_STILL_SAMPLES = 500;   // samples per stationary window
+const float GYRO_STILL_NOISE = 0.004;      // largest gyro standard deviation of a stationary window (rad/s)
+const float GYRO_STILL_ACCEL_NOISE = 0.05; // largest accelerometer standard deviation of a stationary window (m/s/s)
+const float GYRO_MAX_BIAS = 0.35;          // larger window means are motion, not bias (rad/s)
+const float GYRO_BIN_MAX_WEIGHT = 64;      // windows after which a bin becomes a moving average, so it can still adapt
+const uint32_t GYRO_MODEL_SAVE_MS = 60000; // shortest time between NVS writes of the model
+const uint8_t GYRO_MODEL_VERSION = 1;
+
+// Detects windows of samples in which the sensor is still, and their mean readings
+class StillWindow
+{
+
+public:
+    // Accumulate a raw sample. Returns true when a window has completed still, with its means in getMean()
+    bool observe(const sensors_event_t &a, const sensors_event_t &g)
+    {
+        const float sample[6] = {g.gyro.x, g.gyro.y, g.gyro.z, a.acceleration.x, a.acceleration.y, a.acceleration.z};
+        // relative to the window's first sample, so the variance does not cancel catastrophically
+        if (count == 0)
+            for (int i = 0; i < 6; i++)
+                origin[i] = sample[i];
+        for (int i = 0; i < 6; i++)
+        {
+            float d = sample[i] - origin[i];
+            sum[i] += d;
+            sumSquares[i] += d * d;
+        }
+        if (++count < GYRO_STILL_SAMPLES)
+            return false;
+
+        bool still = true;
+        for (int i = 0; i < 6; i++)
+        {
+            float m = sum[i] / count;
+            float deviation = sqrt(max(sumSquares[i] / count - m * m, 0.0f));
+            still &= deviation < (i < 3 ? GYRO_STILL_NOISE : GYRO_STILL_ACCEL_NOISE);
+            mean[i] = origin[i] + m;
+            if (i < 3)
+                still &= fabs(mean[i]) < GYRO_MAX_BIAS;
+            sum[i] = sumSquares[i] = 0;
+        }
+        count = 0;
+        return still;
+    }
+
+    // Gyro x, y, z (rad/s) then accelerometer x, y, z (m/s/s) means of the last still window
+    const float *getMean()
+    {
+        return mean;
+    }
+
+private:
+    uint32_t count = 0;
+    float origin[6] = {0};
+    float sum[6] = {0};
+    float sumSquares[6] = {0};
+    float mean[6] = {0};
+};
+
+// Stationary gyro means per temperature bin, as stored in NVS
+struct GyroTempData
+{
+    uint8_t version;
+    float weight[GYRO_TEMP_BINS];  // windows averaged into the bin, 0 for an empty bin
+    float celsius[GYRO_TEMP_BINS]; // mean temperature of those windows (°C)
+    float mean[GYRO_TEMP_BINS][3]; // gyro x, y, z (rad/s)
+};
+
+// Per-axis gyro bias as a function of die temperature. The gyro means of still windows are averaged into temperature
+// bins, and the bias is a weighted least squares line through the bins' means, or their mean while they
+// span a single bin. correct() subtracts the bias at the last temperature given, so its per-sample cost is three
+// subtractions
+class GyroTempModel
+{
+
+public:
+    GyroTempModel()
+    {
+        clear();
+        dirty = false;
+    }
+
+    // Forget everything learned. The empty model is written on the next save()
+    void clear()
+    {
+        data = {};
+        data.version = GYRO_MODEL_VERSION;
+        bias[0] = bias[1] = bias[2] = 0;
+        trained = false;
+        dirty = true;
+    }
+
+    // Die temperature (°C), read at a low rate
+    void setTemperature(float celsius)
+    {
+        if (fabs(celsius - temperature) < 0.05f)
+            return;
+        temperature = celsius;
+        fit();
+    }
+
+    // Remove the modelled bias from a gyro reading
+    void correct(sensors_event_t &g)
+    {
+        g.gyro.x -= bias[0];
+        g.gyro.y -= bias[1];
+        g.gyro.z -= bias[2];
+    }
+
+    // Add the gyro means of a still window at the current temperature to its bin
+    void learn(const float *mean)
+    {
+        learn(temperature, mean);
+    }
+
+    void learn(float celsius, const float *mean)
+    {
+        int bin = static_cast<int>(floor((celsius - GYRO_TEMP_MIN) / GYRO_TEMP_BIN_WIDTH));
+        bin = constrain(bin, 0, GYRO_TEMP_BINS - 1);
+        float weight = min(data.weight[bin] + 1, GYRO_BIN_MAX_WEIGHT);
+        for (int axis = 0; axis < 3; axis++)
+            data.mean[bin][axis] += (mean[axis] - data.mean[bin][axis]) / weight;
+        data.celsius[bin] += (celsius - data.celsius[bin]) / weight;
+        data.weight[bin] = weight;
+        dirty = true;
+        fit();
+    }
+
+    float getBias(int axis)
+    {
+        return bias[axis];
+    }
+
+    float getTemperature()
+    {
+        return temperature;
+    }
+
+    // Whether any stationary window has been learned, so the bias is more than zero
+    bool isTrained()
+    {
+        return trained;
+    }
+
+    int getBins()
+    {
+        int bins = 0;
+        for (int i = 0; i < GYRO_TEMP_BINS; i++)
+            bins += data.weight[i] > 0;
+        return bins;
+    }
+
+    // Read the model from NVS. Returns false, leaving the model empty, if none of this version is stored
+    bool load(const char *space)
+    {
+        Preferences preferences;
+        if (!preferences.begin(space, true))
+            return false;
+        GyroTempData stored;
+        bool ok = preferences.getBytesLength("model") == sizeof(stored) &&
+                  preferences.getBytes("model", &stored, sizeof(stored)) == sizeof(stored) &&
+                  stored.version == GYRO_MODEL_VERSION;
+        preferences.end();
+        if (!ok)
+            return false;
+
+        data = stored;
+        dirty = false;
+        fit();
+        return true;
+    }
+
+    // Whether the model has learned since the last write and GYRO_MODEL_SAVE_MS has passed, to spare flash
+    bool saveDue(unsigned long nowMs)
+    {
+        return dirty && (savedMs == 0 || nowMs - savedMs >= GYRO_MODEL_SAVE_MS);
+    }
+
+    // Copy of the model for save(), which is then counted as written at nowMs. Taking a copy lets the slow NVS write
+    // run outside the task that learns. A failed write is retried after the next learn()
+    GyroTempData snapshot(unsigned long nowMs)
+    {
+        dirty = false;
+        savedMs = nowMs;
+        return data;
+    }
+
+    static bool save(const char *space, const GyroTempData &data)
+    {
+        Preferences preferences;
+        if (!preferences.begin(space, false))
+            return false;
+        bool ok = preferences.putBytes("model", &data, sizeof(data)) == sizeof(data);
+        preferences.end();
+        return ok;
+    }
+
+private:
+    GyroTempData data;
+    float bias[3];
+    float temperature = 25;
+    bool trained = false;
+    bool dirty = false;
+    unsigned long savedMs = 0;
+
+    // Weighted least squares line through the bins, evaluated at the current temperature
+    void fit()
+    {
+        float n = 0, st = 0, stt = 0, sb[3] = {0}, stb[3] = {0};
+        for (int i = 0; i < GYRO_TEMP_BINS; i++)
+        {
+            float w = data.weight[i];
+            if (w == 0)
+                continue;
+            float t = data.celsius[i] - temperature;
+            n += w;
+            st += w * t;
+            stt += w * t * t;
+            for (int axis = 0; axis < 3; axis++)
+            {
+                sb[axis] += w * data.mean[i][axis];
+                stb[axis] += w * t * data.mean[i][axis];
+            }
+        }
+
+        trained = n > 0;
+        if (!trained)
+            return;
+        // temperature is the origin, so the intercept is the bias here
+        float det = n * stt - st * st;
+        for (int axis = 0; axis < 3; axis++)
+            bias[axis] = det > 0.25f * n * n ? (stt * sb[axis] - st * stb[axis]) / det : sb[axis] / n;
+    }
+};
+
+#endif // GYRO_BIAS_H
@@ -0,0 +1,328 @@
+#ifndef IMU_H
+#define IMU_H
+
+#include <Arduino.h>
+#include <Wire.h>
+#include <Adafruit_Sensor.h>
+
+// MPU6050 registers used by the FIFO driver
+const uint8_t MPU_ADDRESS = 0x68;
+const uint8_t MPU_SMPLRT_DIV = 0x19;
+const uint8_t MPU_CONFIG = 0x1A;
+const uint8_t MPU_FIFO_EN = 0x23;
+const uint8_t MPU_INT_PIN_CFG = 0x37;
+const uint8_t MPU_INT_ENABLE = 0x38;
+const uint8_t MPU_INT_STATUS = 0x3A;
+const uint8_t MPU_TEMP_OUT_H = 0x41;
+const uint8_t MPU_USER_CTRL = 0x6A;
+const uint8_t MPU_FIFO_COUNT_H = 0x72;
+const uint8_t MPU_FIFO_R_W = 0x74;
+
+const uint8_t MPU_FIFO_ACCEL_GYRO = 0x78; // FIFO_EN: accelerometer and all gyro axes, no temperature
+const uint8_t MPU_INT_DATA_RDY = 0x01;
+const uint8_t MPU_INT_FIFO_OFLOW = 0x10;
+const uint8_t MPU_USER_FIFO_EN = 0x40;
+const uint8_t MPU_USER_FIFO_RESET = 0x04;
+
+const uint16_t MPU_GYRO_RATE_HZ = 1000;     // gyro output rate with the digital low pass filter on
+const uint16_t MPU_GYRO_RATE_FAST_HZ = 8000; // gyro output rate with DLPF_CFG 0 or 7, the 260 Hz setting
+const size_t MPU_FIFO_SIZE = 1024;
+const size_t FIFO_SAMPLE_BYTES = 12;    // accel x, y, z then gyro x, y, z, big endian
+const size_t FIFO_BURST_SAMPLES = 10;   // samples per I2C read, within the 128 byte Wire buffer
+const size_t IMU_QUEUE_SIZE = 32;
+const uint32_t IMU_READY_TIMEOUT_PERIODS = 20; // sample periods without a data ready interrupt before polling
+
+// Scale of the raw readings at the ranges set in setupSystem()
+const float ACCEL_LSB_PER_G = 16384.0;   // +-2 g
+const float GYRO_LSB_PER_DPS = 131.0;    // +-250 deg/s
+const float STANDARD_GRAVITY = 9.80665;
+const float TEMP_LSB_PER_C = 340.0;
+const float TEMP_OFFSET_C = 36.53;
+
+// One raw accelerometer and gyro reading
+struct ImuSample
+{
+    int16_t accel[3];
+    int16_t gyro[3];
+    uint32_t timestampUs; // micros() at which the sample was taken
+};
+
+// Decode whole samples from a FIFO byte stream into out, leaving their timestamps unset. Returns the number of samples
+// decoded; a trailing partial sample is left for the caller
+size_t parseFifo(const uint8_t *bytes, size_t length, ImuSample *out, size_t maxSamples)
+{
+    size_t count = length / FIFO_SAMPLE_BYTES;
+    if (count > maxSamples)
+        count = maxSamples;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const uint8_t *sample = bytes + i * FIFO_SAMPLE_BYTES;
+        for (int axis = 0; axis < 3; axis++)
+        {
+            out[i].accel[axis] = static_cast<int16_t>((sample[2 * axis] << 8) | sample[2 * axis + 1]);
+            out[i].gyro[axis] = static_cast<int16_t>((sample[6 + 2 * axis] << 8) | sample[7 + 2 * axis]);
+        }
+    }
+    return count;
+}
+
+// Convert a raw sample to the units of Adafruit_MPU6050::getEvent(), m/s/s and rad/s
+void toEvents(const ImuSample &sample, sensors_event_t &a, sensors_event_t &g)
+{
+    const float accelScale = STANDARD_GRAVITY / ACCEL_LSB_PER_G;
+    const float gyroScale = DEG_TO_RAD / GYRO_LSB_PER_DPS;
+
+    a.acceleration.x = sample.accel[0] * accelScale;
+    a.acceleration.y = sample.accel[1] * accelScale;
+    a.acceleration.z = sample.accel[2] * accelScale;
+    g.gyro.x = sample.gyro[0] * gyroScale;
+    g.gyro.y = sample.gyro[1] * gyroScale;
+    g.gyro.z = sample.gyro[2] * gyroScale;
+    a.timestamp = g.timestamp = sample.timestampUs / 1000;
+}
+
+// Data ready interrupt count and the micros() of the latest one, written by imuDataReady()
+volatile uint32_t imuReadyCount = 0;
+volatile uint32_t imuReadyUs = 0;
+
+void IRAM_ATTR imuDataReady()
+{
+    imuReadyUs = micros();
+    imuReadyCount = imuReadyCount + 1;
+}
+
+// MPU6050 acquisition through the hardware FIFO. The data ready interrupt counts samples as they are taken, poll()
+// drains them from the FIFO in bursts only when there is something to read, and the control loop takes timestamped
+// samples from a queue without touching the bus. The interrupt needs the MPU6050 INT pin wired to intPin. If it stays
+// silent for IMU_READY_TIMEOUT_PERIODS, poll() reads the FIFO count on its own schedule instead, timing the samples
+// back from the read, until the interrupt is heard again
+class ImuFifo
+{
+
+public:
+    ImuFifo(uint8_t intPin)
+    {
+        this->intPin = intPin;
+    }
+
+    // Set the sample rate and start the FIFO and data ready interrupt. Call after the ranges and filter are set
+    bool begin(uint16_t sampleRateHz)
+    {
+        periodUs = 1000000 / sampleRateHz;
+
+        // the sample rate divides the gyro output rate, which depends on the low pass setting
+        uint8_t config;
+        if (!readRegisters(MPU_CONFIG, &config, 1))
+            return false;
+        uint8_t dlpf = config & 0x07;
+        uint16_t gyroRate = dlpf == 0 || dlpf == 7 ? MPU_GYRO_RATE_FAST_HZ : MPU_GYRO_RATE_HZ;
+
+        if (!writeRegister(MPU_SMPLRT_DIV, gyroRate / sampleRateHz - 1) ||
+            !writeRegister(MPU_INT_PIN_CFG, 0x00) || // active high push-pull 50 us pulse
+            !writeRegister(MPU_FIFO_EN, MPU_FIFO_ACCEL_GYRO) ||
+            !writeRegister(MPU_INT_ENABLE, MPU_INT_DATA_RDY | MPU_INT_FIFO_OFLOW))
+            return false;
+
+        pinMode(intPin, INPUT);
+        attachInterrupt(digitalPinToInterrupt(intPin), imuDataReady, RISING);
+        lastReadyUs = micros();
+        return resetFifo();
+    }
+
+    // Move samples from the FIFO into the queue. Returns the number queued, or -1 on a bus error. Does no I2C
+    // transfer until the interrupt has reported minSamples new samples, so reads can be batched into bursts
+    int poll(uint32_t minSamples = 1)
+    {
+        uint32_t readyCount, readyUs;
+        uint32_t nowUs = micros();
+        readReady(readyCount, readyUs);
+
+        // data ready watchdog
+        if (readyCount != lastReadyCount)
+        {
+            lastReadyCount = readyCount;
+            lastReadyUs = nowUs;
+            polled = false;
+        }
+        else if (!polled && nowUs - lastReadyUs > IMU_READY_TIMEOUT_PERIODS * periodUs)
+        {
+            polled = true;
+            readyTimeouts++;
+        }
+
+        if (polled)
+        {
+            if (nowUs - polledUs < minSamples * periodUs)
+                return 0;
+            polledUs = nowUs;
+        }
+        else if (readyCount - sequence < minSamples || readyCount == sequence)
+            return 0;
+
+        uint8_t status, countBytes[2];
+        if (!readRegisters(MPU_INT_STATUS, &status, 1) || !readRegisters(MPU_FIFO_COUNT_H, countBytes, 2))
+            return -1;
+
+        size_t fifoBytes = (countBytes[0] << 8) | countBytes[1];
+        if ((status & MPU_INT_FIFO_OFLOW) || fifoBytes >= MPU_FIFO_SIZE || fifoBytes % FIFO_SAMPLE_BYTES)
+        {
+            // samples were lost or the stream is misaligned, so timestamps cannot be trusted either
+            overflows++;
+            return resetFifo() ? 0 : -1;
+        }
+
+        // Sample n is taken at the nth data ready interrupt, and one more may have landed since readReady().
+        // Resync if the counts disagree by more than that
+        size_t fifoSamples = fifoBytes / FIFO_SAMPLE_BYTES;
+        if (polled)
+        {
+            // without the interrupt the newest sample is taken as just read
+            readyCount = sequence + fifoSamples;
+            readyUs = nowUs;
+        }
+        uint32_t pending = readyCount - sequence;
+        if (fifoSamples < pending || fifoSamples > pending + 1)
+            sequence = readyCount - fifoSamples;
+
+        size_t queued = 0;
+        while (fifoSamples > 0)
+        {
+            size_t burst = fifoSamples < FIFO_BURST_SAMPLES ? fifoSamples : FIFO_BURST_SAMPLES;
+            uint8_t bytes[FIFO_BURST_SAMPLES * FIFO_SAMPLE_BYTES];
+            ImuSample samples[FIFO_BURST_SAMPLES];
+
+            if (!readRegisters(MPU_FIFO_R_W, bytes, burst * FIFO_SAMPLE_BYTES))
+                return -1;
+
+            size_t parsed = parseFifo(bytes, burst * FIFO_SAMPLE_BYTES, samples, burst);
+            for (size_t i = 0; i < parsed; i++)
+            {
+                // counted back from the latest interrupt, forward if the sample came after we read it
+                int32_t behind = static_cast<int32_t>(readyCount - 1 - sequence);
+                samples[i].timestampUs = readyUs - behind * static_cast<int32_t>(periodUs);
+                push(samples[i]);
+                sequence++;
+            }
+            fifoSamples -= burst;
+            queued += parsed;
+        }
+        return queued;
+    }
+
+    // Read the die temperature (°C), which the FIFO does not carry. Returns false on a bus error
+    bool readTemperature(float &celsius)
+    {
+        uint8_t bytes[2];
+        if (!readRegisters(MPU_TEMP_OUT_H, bytes, 2))
+            return false;
+        celsius = static_cast<int16_t>((bytes[0] << 8) | bytes[1]) / TEMP_LSB_PER_C + TEMP_OFFSET_C;
+        return true;
+    }
+
+    // Take the oldest queued sample. Returns false if the queue is empty
+    bool pop(ImuSample &sample)
+    {
+        if (head == tail)
+            return false;
+        sample = queue[tail];
+        tail = (tail + 1) % IMU_QUEUE_SIZE;
+        return true;
+    }
+
+    size_t available()
+    {
+        return (head + IMU_QUEUE_SIZE - tail) % IMU_QUEUE_SIZE;
+    }
+
+    uint32_t getOverflows()
+    {
+        return overflows;
+    }
+
+    uint32_t getDropped()
+    {
+        return dropped;
+    }
+
+    // True while the data ready interrupt is silent and poll() reads the FIFO on its own schedule
+    bool isPolled()
+    {
+        return polled;
+    }
+
+    uint32_t getReadyTimeouts()
+    {
+        return readyTimeouts;
+    }
+
+private:
+    uint8_t intPin;
+    uint32_t periodUs = 0;
+    uint32_t sequence = 0; // data ready count of the next sample in the FIFO
+    uint32_t overflows = 0;
+    uint32_t dropped = 0; // samples overwritten in a full queue
+    uint32_t lastReadyCount = 0;
+    uint32_t lastReadyUs = 0; // micros() at which poll() last saw the data ready count change
+    uint32_t polledUs = 0;    // micros() of the last FIFO read without the interrupt
+    bool polled = false;
+    uint32_t readyTimeouts = 0;
+    ImuSample queue[IMU_QUEUE_SIZE];
+    size_t head = 0;
+    size_t tail = 0;
+
+    // Queue a sample, overwriting the oldest if full
+    void push(const ImuSample &sample)
+    {
+        queue[head] = sample;
+        head = (head + 1) % IMU_QUEUE_SIZE;
+        if (head == tail)
+        {
+            tail = (tail + 1) % IMU_QUEUE_SIZE;
+            dropped++;
+        }
+    }
+
+    // Copy the interrupt's count and time as a pair
+    void readReady(uint32_t &count, uint32_t &us)
+    {
+        do
+        {
+            count = imuReadyCount;
+            us = imuReadyUs;
+        } while (count != imuReadyCount);
+    }
+
+    bool resetFifo()
+    {
+        uint32_t readyCount, readyUs;
+        if (!writeRegister(MPU_USER_CTRL, MPU_USER_FIFO_RESET) || !writeRegister(MPU_USER_CTRL, MPU_USER_FIFO_EN))
+            return false;
+        readReady(readyCount, readyUs);
+        sequence = readyCount;
+        return true;
+    }
+
+    bool writeRegister(uint8_t reg, uint8_t value)
+    {
+        Wire.beginTransmission(MPU_ADDRESS);
+        Wire.write(reg);
+        Wire.write(value);
+        return Wire.endTransmission() == 0;
+    }
+
+    bool readRegisters(uint8_t reg, uint8_t *out, size_t length)
+    {
+        Wire.beginTransmission(MPU_ADDRESS);
+        Wire.write(reg);
+        if (Wire.endTransmission(false) != 0)
+            return false;
+        if (Wire.requestFrom(static_cast<uint16_t>(MPU_ADDRESS), length, true) != length)
+            return false;
+        for (size_t i = 0; i < length; i++)
+            out[i] = Wire.read();
+        return true;
+    }
+};
+
+#endif // IMU_H
@@ -2,6 +2,7 @@
 #define INTERNET_H
 
 #include "config.h"
+#include "bench.h"
 
 //reset manual control states
 void resetStates()
@@ -188,6 +189,22 @@ void handleSetVariable(AsyncWebServerRequest *request)
             {
                 velocity_ki = varValue;
             }
+            else if (varName == "lqr_k_pitch")
+            {
+                lqr_k_pitch = varValue;
+            }
+            else if (varName == "lqr_k_rate")
+            {
+                lqr_k_rate = varValue;
+            }
+            else if (varName == "lqr_k_position")
+            {
+                lqr_k_position = varValue;
+            }
+            else if (varName == "lqr_k_speed")
+            {
+                lqr_k_speed = varValue;
+            }
             else if (varName == "turn_kp")
             {
                 turn_kp = varValue;
@@ -204,6 +221,53 @@ void handleSetVariable(AsyncWebServerRequest *request)
             {
                 camera_kd = varValue;
             }
+            else if (varName == "attitude_kp")
+            {
+                attitude_kp = varValue;
+            }
+            else if (varName == "attitude_ki")
+            {
+                attitude_ki = varValue;
+            }
+            else if (varName == "accel_comp_gain")
+            {
+                accel_comp_gain = varValue;
+            }
+            else if (varName == "gyro_filter")
+            {
+                gyro_filter = varValue;
+                decimatorSettings.write({gyro_filter, gyro_filter_taps});
+            }
+            else if (varName == "gyro_filter_taps")
+            {
+                gyro_filter_taps = varValue;
+                decimatorSettings.write({gyro_filter, gyro_filter_taps});
+            }
+            else if (varName == "pitch_estimator")
+            {
+                pitch_estimator = varValue;
+            }
+            else if (varName == "balance_controller")
+            {
+                balance_controller = varValue != 0 ? BALANCE_LQR : BALANCE_CASCADE;
+            }
+            else if (varName == "loop_policy")
+            {
+                loop_policy = varValue != 0 ? LOOP_SKIP : LOOP_CATCH_UP;
+            }
+            else if (varName == "notch_count")
+            {
+                notch_count = constrain(static_cast<int>(varValue), 0, MAX_NOTCHES);
+            }
+            else if (varName == "wheel_jerk")
+            {
+                // applied by the balance task, with its next command
+                wheel_jerk = varValue;
+            }
+            else if (varName == "wheel_speed_limit")
+            {
+                wheel_speed_limit = varValue;
+            }
             else if (varName == "target_velocity")
             {
                 target_velocity = varValue;
@@ -220,6 +284,18 @@ void handleSetVariable(AsyncWebServerRequest *request)
             {
                 yaw_bias = varValue;
             }
+            else if (varName == "camera_bias")
+            {
+                camera_bias = varValue;
+            }
+            else if (varName == "obstacle_standoff")
+            {
+                obstacle_standoff = varValue;
+            }
+            else if (varName == "obstacle_decel")
+            {
+                obstacle_decel = varValue;
+            }
             else if (varName == "tracking")
             {
                 if (varValue == 1)
@@ -275,19 +351,37 @@ void handleSetVariable(AsyncWebServerRequest *request)
 //handle getting variables
 void handleGetVariables(AsyncWebServerRequest *request)
 {
-    StaticJsonDocument<500> jsonResponse;
+    StaticJsonDocument<1024> jsonResponse;
     jsonResponse["vertical_kp"] = vertical_kp;
     jsonResponse["vertical_kd"] = vertical_kd;
     jsonResponse["velocity_kp"] = velocity_kp;
     jsonResponse["velocity_ki"] = velocity_ki;
+    jsonResponse["lqr_k_pitch"] = lqr_k_pitch;
+    jsonResponse["lqr_k_rate"] = lqr_k_rate;
+    jsonResponse["lqr_k_position"] = lqr_k_position;
+    jsonResponse["lqr_k_speed"] = lqr_k_speed;
     jsonResponse["turn_kp"] = turn_kp;
     jsonResponse["turn_kd"] = turn_kd;
     jsonResponse["camera_kp"] = camera_kp;
     jsonResponse["camera_kd"] = camera_kd;
+    jsonResponse["attitude_kp"] = attitude_kp;
+    jsonResponse["attitude_ki"] = attitude_ki;
+    jsonResponse["accel_comp_gain"] = accel_comp_gain;
+    jsonResponse["gyro_filter"] = gyro_filter;
+    jsonResponse["gyro_filter_taps"] = gyro_filter_taps;
+    jsonResponse["pitch_estimator"] = pitch_estimator;
+    jsonResponse["notch_count"] = notch_count;
+    jsonResponse["balance_controller"] = balance_controller;
+    jsonResponse["loop_policy"] = loop_policy;
+    jsonResponse["wheel_jerk"] = wheel_jerk;
+    jsonResponse["wheel_speed_limit"] = wheel_speed_limit;
     jsonResponse["target_velocity"] = target_velocity;
     jsonResponse["target_angle"] = target_angle;
     jsonResponse["bias"] = bias;
     jsonResponse["yaw_bias"] = yaw_bias;
+    jsonResponse["camera_bias"] = camera_bias;
+    jsonResponse["obstacle_standoff"] = obstacle_standoff;
+    jsonResponse["obstacle_decel"] = obstacle_decel;
     jsonResponse["tracking"] = tracking;
     jsonResponse["color_detected"] = color_detected;
     jsonResponse["back_to_track"] = back_to_track;
@@ -309,6 +403,142 @@ void handleData(AsyncWebServerRequest *request)
     request->send(200, "application/octet-stream", String((char *)buffer, 12));
 }
 
+//handle sending stepper ISR cycle statistics, per tick type
+void handleIsrStats(AsyncWebServerRequest *request)
+{
+    StaticJsonDocument<1024> jsonResponse;
+    jsonResponse["cpu_mhz"] = getCpuFrequencyMhz();
+    for (int t = 0; t < TICK_TYPES; t++)
+    {
+        // the ISR keeps writing, so work on a copy
+        IsrCycleStats stats = isrStats[t];
+        JsonObject type = jsonResponse.createNestedObject(TICK_TYPE_NAMES[t]);
+        type["count"] = stats.count;
+        type["mean"] = stats.count ? static_cast<uint32_t>(stats.total / stats.count) : 0;
+        type["p50"] = isrPercentile(stats, 0.5);
+        type["p99"] = isrPercentile(stats, 0.99);
+        type["p999"] = isrPercentile(stats, 0.999);
+        type["max"] = stats.max;
+    }
+
+    String response;
+    serializeJson(jsonResponse, response);
+
+    request->send(200, "application/json", response);
+}
+
+//handle sending the last gyro y spectrum and the notches tuned from it
+void handleSpectrum(AsyncWebServerRequest *request)
+{
+    DynamicJsonDocument jsonResponse(JSON_OBJECT_SIZE(5) + JSON_ARRAY_SIZE(MAX_NOTCHES) + JSON_ARRAY_SIZE(FFT_SIZE / 2));
+    jsonResponse["rate"] = gyroSpectrum.getRate();
+    jsonResponse["bin_hz"] = gyroSpectrum.getBinHz();
+    jsonResponse["analyse_us"] = gyroSpectrum.getAnalyseUs();
+    JsonArray notches = jsonResponse.createNestedArray("notches");
+    for (int n = 0; n < MAX_NOTCHES; n++)
+        notches.add(pitchNotchHz[n]);
+    // amplitude per bin from 0 Hz (rad/s)
+    JsonArray magnitude = jsonResponse.createNestedArray("magnitude");
+    const float *bins = gyroSpectrum.getMagnitude();
+    for (int i = 0; i < FFT_SIZE / 2; i++)
+        magnitude.add(bins[i]);
+
+    String response;
+    serializeJson(jsonResponse, response);
+
+    request->send(200, "application/json", response);
+}
+
+//handle sending the gyro bias model's temperature and the bias it removes at it
+void handleGyroBias(AsyncWebServerRequest *request)
+{
+    StaticJsonDocument<256> jsonResponse;
+    jsonResponse["temperature"] = gyroModel.getTemperature();
+    jsonResponse["trained"] = gyroModel.isTrained();
+    jsonResponse["bins"] = gyroModel.getBins();
+    JsonArray bias = jsonResponse.createNestedArray("bias");
+    for (int axis = 0; axis < 3; axis++)
+        bias.add(gyroModel.getBias(axis));
+
+    String response;
+    serializeJson(jsonResponse, response);
+
+    request->send(200, "application/json", response);
+}
+
+// Add one loop's timing statistics to a /timing response
+void addLoopTiming(JsonObject loop, LoopTiming &timing)
+{
+    LoopStats stats = timing.getStats();
+    loop["period_us"] = timing.getPeriodUs();
+    loop["count"] = stats.count;
+    loop["missed"] = stats.missed;
+    loop["catch_ups"] = stats.catchUps;
+    loop["skipped"] = stats.skipped;
+    loop["error_p50"] = LoopTiming::errorPercentile(stats, 0.5);
+    loop["error_p99"] = LoopTiming::errorPercentile(stats, 0.99);
+    loop["error_max"] = stats.maxError;
+    loop["run_mean"] = stats.count ? static_cast<uint32_t>(stats.totalRun / stats.count) : 0;
+    loop["run_p99"] = LoopTiming::runPercentile(stats, 0.99);
+    loop["run_max"] = stats.maxRun;
+    // bucket b counts times below 2^b us, down from the one below
+    JsonArray error = loop.createNestedArray("error_hist");
+    JsonArray run = loop.createNestedArray("run_hist");
+    for (int b = 0; b < LOOP_HIST_BUCKETS; b++)
+    {
+        error.add(stats.error[b]);
+        run.add(stats.run[b]);
+    }
+}
+
+//handle sending the periodic loops' timing statistics and histograms
+void handleTiming(AsyncWebServerRequest *request)
+{
+    const size_t loopSize = JSON_OBJECT_SIZE(13) + 2 * JSON_ARRAY_SIZE(LOOP_HIST_BUCKETS);
+    DynamicJsonDocument jsonResponse(JSON_OBJECT_SIZE(5) + 3 * loopSize + JSON_OBJECT_SIZE(4));
+    jsonResponse["policy"] = loop_policy;
+    addLoopTiming(jsonResponse.createNestedObject("inner"), innerTiming);
+    addLoopTiming(jsonResponse.createNestedObject("outer"), outerTiming);
+    addLoopTiming(jsonResponse.createNestedObject("controller"), controllerTiming);
+
+    // FIFO health, and whether the data ready interrupt has gone quiet and the FIFO is being polled
+    JsonObject fifo = jsonResponse.createNestedObject("imu");
+    fifo["polled"] = imu.isPolled();
+    fifo["readyTimeouts"] = imu.getReadyTimeouts();
+    fifo["overflows"] = imu.getOverflows();
+    fifo["dropped"] = imu.getDropped();
+
+    String response;
+    serializeJson(jsonResponse, response);
+
+    request->send(200, "application/json", response);
+}
+
+//handle resetting the loop timing statistics, cleared by each loop on its next run
+void handleTimingReset(AsyncWebServerRequest *request)
+{
+    innerTiming.reset();
+    outerTiming.reset();
+    controllerTiming.reset();
+    request->send(200, "text/plain", "OK");
+}
+
+//handle clearing the gyro bias model, also from NVS on the next save
+void handleGyroBiasReset(AsyncWebServerRequest *request)
+{
+    portENTER_CRITICAL(&imuStateLock);
+    gyroModel.clear();
+    portEXIT_CRITICAL(&imuStateLock);
+    request->send(200, "text/plain", "OK");
+}
+
+//handle resetting the stepper ISR cycle statistics, cleared by the ISR on its next run
+void handleIsrStatsReset(AsyncWebServerRequest *request)
+{
+    isrStatsReset = true;
+    request->send(200, "text/plain", "OK");
+}
+
 //setup wifi
 void setupWifi()
 {
@@ -335,6 +565,13 @@ void setupServer()
     server.on("/controller", HTTP_POST, handleController);
     server.on("/color", HTTP_POST, handleColor);
     server.on("/camera", HTTP_POST, handleCamera);
+    server.on("/isrStats", HTTP_GET, handleIsrStats);
+    server.on("/isrStats", HTTP_POST, handleIsrStatsReset);
+    server.on("/spectrum", HTTP_GET, handleSpectrum);
+    server.on("/gyroBias", HTTP_GET, handleGyroBias);
+    server.on("/gyroBias", HTTP_POST, handleGyroBiasReset);
+    server.on("/timing", HTTP_GET, handleTiming);
+    server.on("/timing", HTTP_POST, handleTimingReset);
     server.begin();
     Serial.println("HTTP server started");
 }
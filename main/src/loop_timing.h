@@ -0,0 +1,162 @@
+#ifndef LOOP_TIMING_H
+#define LOOP_TIMING_H
+
+#include <Arduino.h>
+
+const int LOOP_HIST_BUCKETS = 24;          // bucket b holds times below 2^b μs, down from the one below; up to 8 s
+const uint32_t LOOP_TIMING_SLACK_US = 500; // a wake this early still runs the loop, half a FreeRTOS tick
+
+// What a periodic loop does after a stall of more than a period
+enum LoopPolicy
+{
+    LOOP_CATCH_UP, // run once for every period missed, back to back
+    LOOP_SKIP      // run once, drop the missed periods and restart the schedule from that run, so the next one sees a
+                   // full period
+};
+
+// Timing statistics of one periodic loop
+struct LoopStats
+{
+    uint32_t count;    // runs
+    uint32_t missed;   // runs that finished after the end of their period
+    uint32_t catchUps; // runs started a whole period or more late, to catch up
+    uint32_t skipped;  // periods dropped
+    uint32_t maxError; // (μs)
+    uint32_t maxRun;   // (μs)
+    uint64_t totalRun; // (μs)
+    uint32_t error[LOOP_HIST_BUCKETS]; // start to start time less the period, either way
+    uint32_t run[LOOP_HIST_BUCKETS];   // start to finish
+};
+
+// Schedule and timing of a periodic loop, in micros(). due() is asked at each chance to run, such as every wake of
+// its task, and decides by the policy; done() ends the run. The statistics are only written by the loop's own task,
+// and a reset() from elsewhere is applied on its next run
+class LoopTiming
+{
+
+public:
+    LoopTiming(uint32_t periodUs)
+    {
+        this->periodUs = periodUs;
+    }
+
+    // Whether the loop should run at nowUs. If so, the run is timed until done()
+    bool due(uint32_t nowUs, LoopPolicy policy)
+    {
+        if (!started)
+        {
+            started = true;
+            next = nowUs + periodUs;
+            startUs = nowUs;
+            return false;
+        }
+        int32_t late = static_cast<int32_t>(nowUs + LOOP_TIMING_SLACK_US - next);
+        if (late < 0)
+            return false;
+
+        if (resetPending)
+        {
+            stats = {};
+            resetPending = false;
+        }
+        int32_t overdue = static_cast<int32_t>(nowUs - next);
+        uint32_t behind = overdue > 0 ? overdue / periodUs : 0; // whole periods missed
+        if (behind > 0 && policy == LOOP_SKIP)
+        {
+            stats.skipped += behind;
+            next = nowUs + periodUs;
+        }
+        else
+        {
+            if (behind > 0)
+                stats.catchUps++;
+            next += periodUs;
+        }
+
+        uint32_t period = nowUs - startUs;
+        startUs = nowUs;
+        stats.count++;
+        if (stats.count > 1)
+        {
+            int32_t error = static_cast<int32_t>(period - periodUs);
+            uint32_t size = error < 0 ? -error : error;
+            stats.error[bucket(size)]++;
+            stats.maxError = max(stats.maxError, size);
+        }
+        return true;
+    }
+
+    // The run started by due() finished at nowUs
+    void done(uint32_t nowUs)
+    {
+        uint32_t run = nowUs - startUs;
+        stats.run[bucket(run)]++;
+        stats.totalRun += run;
+        stats.maxRun = max(stats.maxRun, run);
+        if (static_cast<int32_t>(nowUs - next) > 0)
+            stats.missed++;
+    }
+
+    void reset()
+    {
+        resetPending = true;
+    }
+
+    uint32_t getPeriodUs()
+    {
+        return periodUs;
+    }
+
+    // Copy of the statistics. The loop may be writing them, so a copy can be a run out of step
+    LoopStats getStats()
+    {
+        return stats;
+    }
+
+    // Upper edge of the period error (μs) histogram bucket holding the given fraction of the periods
+    static uint32_t errorPercentile(const LoopStats &copy, float fraction)
+    {
+        return percentile(copy.error, copy.count > 0 ? copy.count - 1 : 0, fraction, copy.maxError);
+    }
+
+    // Upper edge of the run time (μs) histogram bucket holding the given fraction of the runs
+    static uint32_t runPercentile(const LoopStats &copy, float fraction)
+    {
+        return percentile(copy.run, copy.count, fraction, copy.maxRun);
+    }
+
+private:
+    uint32_t periodUs;
+    uint32_t next = 0;    // when the next run is due
+    uint32_t startUs = 0; // start of the last run
+    bool started = false;
+    volatile bool resetPending = false;
+    LoopStats stats = {};
+
+    // Number of significant bits, so bucket b holds [2^(b-1), 2^b)
+    static int bucket(uint32_t us)
+    {
+        int b = 0;
+        while (us > 0 && b < LOOP_HIST_BUCKETS - 1)
+        {
+            us >>= 1;
+            b++;
+        }
+        return b;
+    }
+
+    static uint32_t percentile(const uint32_t *hist, uint32_t count, float fraction, uint32_t largest)
+    {
+        uint32_t wanted = static_cast<uint32_t>(count * fraction);
+        uint32_t seen = 0;
+        for (int b = 0; b < LOOP_HIST_BUCKETS - 1; b++)
+        {
+            seen += hist[b];
+            if (seen >= wanted)
+                return min(static_cast<uint32_t>(1) << b, largest);
+        }
+        return largest;
+    }
+};
+
+#endif // LOOP_TIMING_H
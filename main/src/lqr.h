@@ -0,0 +1,66 @@
+#ifndef LQR_H
+#define LQR_H
+
+#include <Arduino.h>
+
+const float LQR_POSITION_LIMIT = 3.0; // wheel position error held within +-this, so a long push is not all undone (rad)
+
+// Balance controller, chosen at run time
+enum BalanceController
+{
+    BALANCE_CASCADE, // vertical() PD on pitch under the velocity() PI
+    BALANCE_LQR      // BalanceLqr state feedback
+};
+
+// State feedback gains, from lqr.py for the robot's measured mass and geometry
+struct LqrGains
+{
+    float pitch;    // (rad/s/s per rad)
+    float rate;     // (rad/s/s per rad/s)
+    float position; // (rad/s/s per rad)
+    float speed;    // (rad/s/s per rad/s)
+};
+
+// Full state feedback balance over pitch, pitch rate, wheel position and wheel speed, the LQR gains lqr.py solves for.
+// The wheel position is kept as its error from a reference that moves at the target speed, so a speed target is
+// followed without a standing pitch and a push is rolled back from. Wheel angles are relative to the body, as the
+// steps count them, and positive rolls backward like positive pitch leans
+class BalanceLqr
+{
+
+public:
+    // Start the reference at the wheels' position, steps summed over both wheels
+    void reset(int32_t steps)
+    {
+        lastSteps = steps;
+        positionError = 0;
+    }
+
+    // Wheel acceleration (rad/s/s) for pitch off the balance pitch (rad), its rate (rad/s), the wheel position (steps,
+    // summed over both wheels, of stepAngle rad each), the mean wheel speed and its target (rad/s), over a tick of
+    // dt (s)
+    float update(float pitch, float rate, int32_t steps, float speed, float target, float dt, float stepAngle,
+                 const LqrGains &gains)
+    {
+        positionError += (steps - lastSteps) * 0.5f * stepAngle - target * dt;
+        lastSteps = steps;
+        if (positionError > LQR_POSITION_LIMIT)
+            positionError = LQR_POSITION_LIMIT;
+        if (positionError < -LQR_POSITION_LIMIT)
+            positionError = -LQR_POSITION_LIMIT;
+        return gains.pitch * pitch + gains.rate * rate + gains.position * positionError +
+               gains.speed * (speed - target);
+    }
+
+    // Wheel position off the reference (rad)
+    float getPositionError()
+    {
+        return positionError;
+    }
+
+private:
+    int32_t lastSteps = 0;
+    float positionError = 0;
+};
+
+#endif // LQR_H
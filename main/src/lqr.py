@@ -0,0 +1,176 @@
+# Balance state feedback gains for the LQR controller in lqr.h. Linearizes the two-wheel inverted pendulum about
+# upright from the robot's measured mass and geometry, discretizes it at the control tick and solves the discrete
+# Riccati equation. Prints the gains as set_variable commands, and the closed-loop poles.
+# Pure Python, no numpy needed.
+#
+# Model: the steppers impose the wheel angle relative to the body, phi, so its acceleration u is the input.
+# State [pitch, pitch rate, phi, phi rate], pitch from the balance pitch, positive leaning backward, phi positive
+# rolling backward, as the firmware measures them. With the axle at x = r (phi + pitch), the body's rotation about
+# the axle, the wheels' rotation and the horizontal forces give, about upright,
+#   D pitch'' = m g l pitch - N u
+#   D = J + m (l + r)^2 + Iw + mw r^2    inertia about the contact point
+#   N = m r (l + r) + Iw + mw r^2
+import argparse
+import cmath
+import math
+
+GRAVITY = 9.80665
+
+
+def matmul(a, b):
+    return [[sum(a[i][k] * b[k][j] for k in range(len(b))) for j in range(len(b[0]))] for i in range(len(a))]
+
+
+def add(a, b):
+    return [[a[i][j] + b[i][j] for j in range(len(a[0]))] for i in range(len(a))]
+
+
+def scale(a, s):
+    return [[x * s for x in row] for row in a]
+
+
+def transpose(a):
+    return [list(row) for row in zip(*a)]
+
+
+def identity(n):
+    return [[1.0 if i == j else 0.0 for j in range(n)] for i in range(n)]
+
+
+def expm(a):
+    """Matrix exponential by scaling and squaring of the Taylor series"""
+    norm = max(sum(abs(x) for x in row) for row in a)
+    squarings = max(0, int(math.ceil(math.log2(norm))) + 1) if norm > 0 else 0
+    a = scale(a, 1 / 2 ** squarings)
+    result = identity(len(a))
+    term = identity(len(a))
+    for k in range(1, 20):
+        term = scale(matmul(term, a), 1 / k)
+        result = add(result, term)
+    for _ in range(squarings):
+        result = matmul(result, result)
+    return result
+
+
+def discretize(a, b, period):
+    """Zero-order hold: exp([[A, B], [0, 0]] T) = [[Ad, Bd], [0, I]]"""
+    n = len(a)
+    m = [row + [b[i][0]] for i, row in enumerate(a)] + [[0.0] * (n + 1)]
+    e = expm(scale(m, period))
+    return [row[:n] for row in e[:n]], [[row[n]] for row in e[:n]]
+
+
+def dlqr(a, b, q, r):
+    """Gain K of u = -K x minimizing sum x'Qx + u'Ru, single input, by iterating the discrete Riccati equation"""
+    at = transpose(a)
+    bt = transpose(b)
+    p = q
+    for _ in range(100000):
+        pa = matmul(p, a)
+        pb = matmul(p, b)
+        denominator = r + matmul(bt, pb)[0][0]
+        btpa = matmul(bt, pa)
+        correction = scale(matmul(matmul(at, pb), btpa), 1 / denominator)
+        following = add(q, add(matmul(at, pa), scale(correction, -1)))
+        change = max(abs(following[i][j] - p[i][j]) for i in range(len(p)) for j in range(len(p)))
+        p = following
+        if change <= 1e-12 * max(abs(x) for row in p for x in row):
+            break
+    else:
+        raise RuntimeError("Riccati iteration did not converge")
+    pb = matmul(p, b)
+    return scale(matmul(transpose(b), matmul(p, a)), 1 / (r + matmul(transpose(b), pb)[0][0]))[0]
+
+
+def poles(a):
+    """Eigenvalues, as the roots of the characteristic polynomial from Faddeev-LeVerrier, by Durand-Kerner"""
+    n = len(a)
+    coefficients = [1.0]
+    m = identity(n)
+    for k in range(1, n + 1):
+        am = matmul(a, m)
+        c = -sum(am[i][i] for i in range(n)) / k
+        coefficients.append(c)
+        m = add(am, scale(identity(n), c))
+    roots = [(0.4 + 0.9j) ** k for k in range(n)]
+    for _ in range(1000):
+        updated = []
+        for i, z in enumerate(roots):
+            value = sum(c * z ** (n - k) for k, c in enumerate(coefficients))
+            divisor = 1
+            for j, w in enumerate(roots):
+                if j != i:
+                    divisor *= z - w
+            updated.append(z - value / divisor)
+        roots = updated
+    return roots
+
+
+def model(args):
+    """Continuous A and B of the linearized pendulum, and the inertias used"""
+    body_inertia = args.body_inertia
+    if body_inertia is None:
+        # uniform slab of the body's height about its middle
+        body_inertia = args.body_mass * args.body_height ** 2 / 12
+    wheel_inertia = args.wheel_inertia
+    if wheel_inertia is None:
+        # uniform discs
+        wheel_inertia = args.wheel_mass * args.wheel_radius ** 2 / 2
+    m, l, r = args.body_mass, args.com_height, args.wheel_radius
+    d = body_inertia + m * (l + r) ** 2 + wheel_inertia + args.wheel_mass * r ** 2
+    n = m * r * (l + r) + wheel_inertia + args.wheel_mass * r ** 2
+    a = [[0.0, 1.0, 0.0, 0.0],
+         [m * GRAVITY * l / d, 0.0, 0.0, 0.0],
+         [0.0, 0.0, 0.0, 1.0],
+         [0.0, 0.0, 0.0, 0.0]]
+    b = [[0.0], [-n / d], [0.0], [1.0]]
+    return a, b, body_inertia, wheel_inertia
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Balance LQR gains from the robot's mass and geometry")
+    parser.add_argument("--body-mass", type=float, default=0.6, help="everything but the wheels (kg)")
+    parser.add_argument("--com-height", type=float, default=0.05, help="body centre of mass above the axle (m)")
+    parser.add_argument("--body-height", type=float, default=0.15, help="for the body inertia if not given (m)")
+    parser.add_argument("--body-inertia", type=float, default=None, help="pitch inertia about the body's centre of "
+                        "mass, from a swing test, (kg m^2)")
+    parser.add_argument("--wheel-mass", type=float, default=0.1, help="both wheels and what turns with them (kg)")
+    parser.add_argument("--wheel-radius", type=float, default=0.034, help="WHEEL_RADIUS (m)")
+    parser.add_argument("--wheel-inertia", type=float, default=None, help="both wheels about the axle, discs if not "
+                        "given (kg m^2)")
+    parser.add_argument("--period", type=float, default=8, help="control tick, LOOP_INTERVAL_INNER (ms)")
+    # Bryson's rule: each weight is one over the square of the largest acceptable excursion
+    parser.add_argument("--max-pitch", type=float, default=0.05, help="acceptable pitch excursion (rad)")
+    parser.add_argument("--max-rate", type=float, default=1.0, help="acceptable pitch rate (rad/s)")
+    parser.add_argument("--max-position", type=float, default=0.1, help="acceptable travel off the reference (m)")
+    parser.add_argument("--max-speed", type=float, default=0.3, help="acceptable speed off the target (m/s)")
+    parser.add_argument("--max-accel", type=float, default=100, help="acceptable wheel acceleration (rad/s/s)")
+    args = parser.parse_args()
+
+    a, b, body_inertia, wheel_inertia = model(args)
+    ad, bd = discretize(a, b, args.period * 1e-3)
+
+    # travel and its speed are r (phi + pitch) and its rate, so they are weighted through that map
+    r = args.wheel_radius
+    c = [[1, 0, 0, 0], [0, 1, 0, 0], [r, 0, r, 0], [0, r, 0, r]]
+    weights = [1 / args.max_pitch ** 2, 1 / args.max_rate ** 2, 1 / args.max_position ** 2, 1 / args.max_speed ** 2]
+    q = matmul(transpose(c), [[w * c[i][j] for j in range(4)] for i, w in enumerate(weights)])
+    k = dlqr(ad, bd, q, 1 / args.max_accel ** 2)
+
+    print(f"body inertia {body_inertia:.3g} kg m^2, wheel inertia {wheel_inertia:.3g} kg m^2")
+    print(f"pitch'' = {a[1][0]:.4g} pitch - {-b[1][0]:.4g} u, falling pole {math.sqrt(a[1][0]):.3g} rad/s")
+    print(f"cascade needs vertical_kp above {a[1][0] / -b[1][0]:.4g} to stand")
+    print()
+    print("closed-loop poles at the tick (z), and as continuous time constants")
+    closed = add(ad, scale(matmul(bd, [k]), -1))
+    for z in sorted(poles(closed), key=lambda z: -abs(z)):
+        s = cmath.log(z) / (args.period * 1e-3)
+        print(f"  z {z.real:+.4f}{z.imag:+.4f}j  tau {-1 / s.real * 1e3:7.1f} ms  {abs(s.imag) / (2 * math.pi):5.2f} Hz")
+    print()
+    # lqr.h commands acceleration = k . state, the negative of u = -K x
+    for name, gain in zip(("lqr_k_pitch", "lqr_k_rate", "lqr_k_position", "lqr_k_speed"), k):
+        print(f"{name}={-gain:.5g}")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,58 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <Arduino.h>
+#include <atomic>
+
+// Lock-free single-writer, single-reader mailbox for passing a struct between the control loop and the stepper ISR.
+// Values are double-buffered and published through a generation counter that is odd while a slot is being written.
+// The writer always fills the slot that does not hold the latest value, so a reader can copy the latest value while a
+// write is in progress, and it can detect the one case that tears, a second write overtaking its copy
+template <typename T>
+class Mailbox
+{
+
+public:
+    // Publish a new value. Only one context may write
+    void IRAM_ATTR write(const T &value)
+    {
+        uint32_t gen = generation.load(std::memory_order_relaxed);
+        uint32_t next = (gen >> 1) + 1;
+
+        generation.store(gen + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slots[next & 1] = value;
+        generation.store(gen + 2, std::memory_order_release);
+    }
+
+    // Copy the latest value and its version. Never waits; returns false if a write overtook the copy, in which case
+    // the caller keeps its previous value or tries again
+    bool IRAM_ATTR read(T &out, uint32_t &version)
+    {
+        uint32_t gen = generation.load(std::memory_order_acquire);
+        uint32_t latest = gen >> 1;
+
+        T copy = slots[latest & 1];
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        // The writer starts overwriting our slot at generation 2 * latest + 3
+        if (generation.load(std::memory_order_relaxed) - 2 * latest >= 3)
+            return false;
+
+        out = copy;
+        version = latest;
+        return true;
+    }
+
+    // Version of the latest published value, for a cheap "anything new?" check
+    uint32_t IRAM_ATTR version()
+    {
+        return generation.load(std::memory_order_acquire) >> 1;
+    }
+
+private:
+    T slots[2] = {};
+    std::atomic<uint32_t> generation{0};
+};
+
+#endif // MAILBOX_H
@@ -5,9 +5,11 @@
 void setup()
 {
     setupSystem();
+    startTasks();
 }
 
 void loop()
 {
-    controlLoop();
+    // everything runs in the tasks started by setup()
+    vTaskDelete(nullptr);
 }
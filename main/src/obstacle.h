@@ -0,0 +1,134 @@
+#ifndef OBSTACLE_H
+#define OBSTACLE_H
+
+#include <Arduino.h>
+#include <ultrasonic.h>
+
+const int OBSTACLE_HISTORY = 8;                 // ranges kept for the closing speed fit
+const float OBSTACLE_RATE_WINDOW = 0.4;         // closing speed fit window, back from the newest range (s)
+const float OBSTACLE_MEDIAN_LAG = (ULTRASONIC_MEDIAN - 1) / 2 * ULTRASONIC_PERIOD_MS * 1e-3; // of a ramp (s)
+const float OBSTACLE_EMERGENCY_FACTOR = 2;      // speed limit slew over the planned deceleration, for late obstacles
+const float OBSTACLE_JUMP = 0.3;                // a range this far from the last one is a different obstacle (m)
+const float OBSTACLE_RESPONSE = 0.7;            // time constant of the wheel speed after the velocity loop's target (s)
+
+// Obstacle ahead from the filtered ultrasonic range. The closing speed is a least squares slope over the recent
+// ranges, and the range is carried forward by it to the present, past the median filter's lag.
+// The wheel speed follows the velocity loop's target u as a lag of time constant t, so from speed w it covers the
+// integral of u plus t w before it stops. The target allowed is the one from which a ramp down at a steady
+// deceleration stops at the standoff: u^2 / (2 a) + t w = d - s. It falls at exactly a as the robot closes in. t is
+// the time to 63% of the cascade's wheel speed after a step in its target, about 0.7 s on test_lqr's pendulum. The
+// state feedback's quicker 0.35 s lands on the standoff too, as the target is planned again from w every tick.
+// Nothing in range, or a range that jumps, starts the history again, so an obstacle stepping in is not read as a
+// fast approach
+class ObstacleBrake
+{
+
+public:
+    // Add a reading from Ultrasonic::read(). Repeats of the last one are ignored
+    void addRange(const RangeReading &reading)
+    {
+        if (size > 0 && reading.count == counts[newest()])
+            return;
+        float range = reading.distance * 0.01f;
+        if (reading.distance >= ULTRASONIC_MAX_RANGE || (size > 0 && fabs(range - ranges[newest()]) > OBSTACLE_JUMP))
+            size = 0;
+        if (reading.distance >= ULTRASONIC_MAX_RANGE)
+        {
+            closing = 0;
+            return;
+        }
+
+        ranges[head] = range;
+        times[head] = reading.timeUs;
+        counts[head] = reading.count;
+        head = (head + 1) % OBSTACLE_HISTORY;
+        if (size < OBSTACLE_HISTORY)
+            size++;
+        fit();
+    }
+
+    // Range predicted at nowUs (m)
+    float getRange(uint32_t nowUs)
+    {
+        if (size == 0)
+            return ULTRASONIC_MAX_RANGE * 0.01f;
+        float age = static_cast<int32_t>(nowUs - times[newest()]) * 1e-6f + OBSTACLE_MEDIAN_LAG;
+        float range = ranges[newest()] - closing * age;
+        return range > 0 ? range : 0;
+    }
+
+    // Rate at which the range is falling (m/s)
+    float getClosingSpeed()
+    {
+        return closing;
+    }
+
+    // Time until the range reaches zero at the current closing speed, or a negative value if it is not closing (s)
+    float getTimeToCollision(uint32_t nowUs)
+    {
+        return closing > 0 ? getRange(nowUs) / closing : -1;
+    }
+
+    // Highest forward speed target from which ramping down at decel (m/s/s) stops standoff (m) short of the obstacle,
+    // with the wheels at speed (m/s) now and following the target with a time constant of OBSTACLE_RESPONSE (m/s)
+    float allowedSpeed(uint32_t nowUs, float standoff, float decel, float speed)
+    {
+        float room = getRange(nowUs) - standoff - OBSTACLE_RESPONSE * speed;
+        if (room <= 0)
+            return 0;
+        return sqrt(2 * decel * room);
+    }
+
+    // Forward speed to command for a target forward speed (m/s), given the allowed one and the wheels' speed (m/s).
+    // While braking, the command falls by no more than OBSTACLE_EMERGENCY_FACTOR times decel (m/s/s) over the tick of
+    // dt (s) below the last command or the wheels' speed, whichever is lower, so the velocity loop's target never steps
+    // down below where the wheels are even for an obstacle found late. A last command the wheels have not reached yet
+    // is not held up
+    float limitSpeed(float target, float allowed, float decel, float dt, float speed)
+    {
+        float command = target;
+        if (allowed < target)
+        {
+            float floor = (last < speed ? last : speed) - OBSTACLE_EMERGENCY_FACTOR * decel * dt;
+            command = allowed > floor ? allowed : (floor < target ? floor : target);
+        }
+        last = command;
+        return command;
+    }
+
+private:
+    float ranges[OBSTACLE_HISTORY] = {0}; // (m)
+    uint32_t times[OBSTACLE_HISTORY] = {0};
+    uint32_t counts[OBSTACLE_HISTORY] = {0};
+    int head = 0;
+    int size = 0;
+    float closing = 0;
+    float last = 0; // last forward speed commanded (m/s)
+
+    int newest()
+    {
+        return (head + OBSTACLE_HISTORY - 1) % OBSTACLE_HISTORY;
+    }
+
+    void fit()
+    {
+        // time in s back from the newest range
+        float n = 0, st = 0, stt = 0, sr = 0, str = 0;
+        for (int k = 0; k < size; k++)
+        {
+            int i = (head + OBSTACLE_HISTORY - 1 - k) % OBSTACLE_HISTORY;
+            float t = -static_cast<int32_t>(times[newest()] - times[i]) * 1e-6f;
+            if (t < -OBSTACLE_RATE_WINDOW)
+                break;
+            n += 1;
+            st += t;
+            stt += t * t;
+            sr += ranges[i];
+            str += t * ranges[i];
+        }
+        float det = n * stt - st * st;
+        closing = n >= 3 && det > 0 ? -(n * str - st * sr) / det : 0;
+    }
+};
+
+#endif // OBSTACLE_H
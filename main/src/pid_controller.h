@@ -0,0 +1,313 @@
+#ifndef PID_CONTROLLER_H
+#define PID_CONTROLLER_H
+
+#include <limits>
+#include <type_traits>
+
+// Pid features, given as template arguments in any order
+struct PidIntegral {};                // integral term
+struct PidDerivative {};              // derivative term on the error
+struct PidDerivativeOnMeasurement {}; // derivative term on the measurement alone, so setpoint steps do not kick
+struct PidMeasuredRate {};            // derivative of the measurement passed to update(), such as a gyro rate
+struct PidFilteredDerivative {};      // first order low pass on the derivative
+struct PidErrorFilter {};             // first order low pass on the error, before the P and I terms
+struct PidIntegralClamp {};           // integral of the error held within [integralMin, integralMax]
+struct PidBackCalculation {};         // integral bled by how far the output was clamped; needs PidOutputClamp
+struct PidOutputClamp {};             // output held within [outputMin, outputMax]
+struct PidSetpointWeighting {};       // P term on b * setpoint - measurement, D term on c * setpoint - measurement
+
+// Whether Feature is one of Features
+template <typename Feature, typename... Features>
+struct PidHas : std::false_type
+{
+};
+
+template <typename Feature, typename First, typename... Rest>
+struct PidHas<Feature, First, Rest...>
+    : std::integral_constant<bool, std::is_same<Feature, First>::value || PidHas<Feature, Rest...>::value>
+{
+};
+
+// Gains and feature parameters, passed to every update() so they can be tuned at run time. Parameters of features
+// the controller does not have are ignored
+template <typename T>
+struct PidGains
+{
+    T kp, ki, kd;
+    T errorAlpha = 0;      // PidErrorFilter weight of the last filtered error
+    T derivativeAlpha = 0; // PidFilteredDerivative weight of the last filtered derivative
+    T integralMin = std::numeric_limits<T>::lowest();
+    T integralMax = std::numeric_limits<T>::max();
+    T outputMin = std::numeric_limits<T>::lowest();
+    T outputMax = std::numeric_limits<T>::max();
+    T kb = 0; // PidBackCalculation error per unit of output clamped away
+    T b = 1;  // PidSetpointWeighting setpoint weight of the P term
+    T c = 1;  // PidSetpointWeighting setpoint weight of the D term
+
+    PidGains(T kp, T ki = 0, T kd = 0) : kp(kp), ki(ki), kd(kd)
+    {
+    }
+};
+
+// State of the features, empty when a feature is off so the compiler drops it. Tag tells apart two uses of the same
+// kind of state
+
+// First order low pass
+template <typename T, bool On, typename Tag>
+struct PidLowPass
+{
+    T filter(T value, T)
+    {
+        return value;
+    }
+    void reset()
+    {
+    }
+};
+
+template <typename T, typename Tag>
+struct PidLowPass<T, true, Tag>
+{
+    T last = 0;
+    T filter(T value, T alpha)
+    {
+        last = (1 - alpha) * value + alpha * last;
+        return last;
+    }
+    void reset()
+    {
+        last = 0;
+    }
+};
+
+// Previous value, for a derivative by difference
+template <typename T, bool On, typename Tag>
+struct PidHistory
+{
+    T difference(T, T)
+    {
+        return 0;
+    }
+    void reset()
+    {
+    }
+};
+
+template <typename T, typename Tag>
+struct PidHistory<T, true, Tag>
+{
+    T last = 0;
+    T difference(T value, T dt)
+    {
+        T previous = last;
+        last = value;
+        return (value - previous) / dt;
+    }
+    void reset()
+    {
+        last = 0;
+    }
+};
+
+// Integral of the error, clamped and bled by back-calculation as configured
+template <typename T, bool On, bool Clamp, bool BackCalculation>
+struct PidIntegrator
+{
+    T term(T, T, T, const PidGains<T> &)
+    {
+        return 0;
+    }
+    T get()
+    {
+        return 0;
+    }
+    void reset()
+    {
+    }
+};
+
+template <typename T, bool Clamp, bool BackCalculation>
+struct PidIntegrator<T, true, Clamp, BackCalculation>
+{
+    T integral = 0;
+
+    // excess is how far the last output was clamped, clamped minus unclamped
+    T term(T error, T dt, T excess, const PidGains<T> &gains)
+    {
+        integral += error * dt;
+        if (BackCalculation)
+            integral += gains.kb * excess * dt;
+        if (Clamp)
+        {
+            if (integral > gains.integralMax)
+                integral = gains.integralMax;
+            if (integral < gains.integralMin)
+                integral = gains.integralMin;
+        }
+        return gains.ki * integral;
+    }
+    T get()
+    {
+        return integral;
+    }
+    void reset()
+    {
+        integral = 0;
+    }
+};
+
+// How far the last output was clamped, for back-calculation
+template <typename T, bool On>
+struct PidExcess
+{
+    T get()
+    {
+        return 0;
+    }
+    void set(T)
+    {
+    }
+    void reset()
+    {
+    }
+};
+
+template <typename T>
+struct PidExcess<T, true>
+{
+    T excess = 0;
+    T get()
+    {
+        return excess;
+    }
+    void set(T value)
+    {
+        excess = value;
+    }
+    void reset()
+    {
+        excess = 0;
+    }
+};
+
+// Which features a Pid has, and the state they need
+template <typename T, typename... Features>
+struct PidParts
+{
+    static const bool INTEGRAL = PidHas<PidIntegral, Features...>::value;
+    static const bool DERIVATIVE_ON_ERROR = PidHas<PidDerivative, Features...>::value;
+    static const bool DERIVATIVE = DERIVATIVE_ON_ERROR || PidHas<PidDerivativeOnMeasurement, Features...>::value;
+    static const bool MEASURED_RATE = PidHas<PidMeasuredRate, Features...>::value;
+    static const bool FILTERED_DERIVATIVE = PidHas<PidFilteredDerivative, Features...>::value;
+    static const bool ERROR_FILTER = PidHas<PidErrorFilter, Features...>::value;
+    static const bool INTEGRAL_CLAMP = PidHas<PidIntegralClamp, Features...>::value;
+    static const bool BACK_CALCULATION = PidHas<PidBackCalculation, Features...>::value;
+    static const bool OUTPUT_CLAMP = PidHas<PidOutputClamp, Features...>::value;
+    static const bool WEIGHTED = PidHas<PidSetpointWeighting, Features...>::value;
+
+    typedef PidLowPass<T, ERROR_FILTER, PidErrorFilter> ErrorFilter;
+    typedef PidLowPass<T, FILTERED_DERIVATIVE, PidFilteredDerivative> DerivativeFilter;
+    typedef PidHistory<T, DERIVATIVE_ON_ERROR, PidDerivative> SetpointHistory;
+    typedef PidHistory<T, DERIVATIVE && !MEASURED_RATE, PidMeasuredRate> MeasurementHistory;
+    typedef PidIntegrator<T, INTEGRAL, INTEGRAL_CLAMP, BACK_CALCULATION> Integrator;
+    typedef PidExcess<T, BACK_CALCULATION> Excess;
+};
+
+// PID controller with the features chosen at compile time. The object holds only the state those features need, so
+// a PD controller on a measured rate holds none. dt is in whatever unit the gains were tuned in
+template <typename T, typename... Features>
+class Pid : PidParts<T, Features...>::ErrorFilter,
+            PidParts<T, Features...>::DerivativeFilter,
+            PidParts<T, Features...>::SetpointHistory,
+            PidParts<T, Features...>::MeasurementHistory,
+            PidParts<T, Features...>::Integrator,
+            PidParts<T, Features...>::Excess
+{
+    typedef PidParts<T, Features...> Parts;
+    typedef typename Parts::ErrorFilter ErrorFilter;
+    typedef typename Parts::DerivativeFilter DerivativeFilter;
+    typedef typename Parts::SetpointHistory SetpointHistory;
+    typedef typename Parts::MeasurementHistory MeasurementHistory;
+    typedef typename Parts::Integrator Integrator;
+    typedef typename Parts::Excess Excess;
+
+    static const bool INTEGRAL = Parts::INTEGRAL;
+    static const bool DERIVATIVE_ON_ERROR = Parts::DERIVATIVE_ON_ERROR;
+    static const bool DERIVATIVE = Parts::DERIVATIVE;
+    static const bool MEASURED_RATE = Parts::MEASURED_RATE;
+    static const bool OUTPUT_CLAMP = Parts::OUTPUT_CLAMP;
+    static const bool WEIGHTED = Parts::WEIGHTED;
+
+    static_assert(!(DERIVATIVE_ON_ERROR && PidHas<PidDerivativeOnMeasurement, Features...>::value),
+                  "PidDerivative and PidDerivativeOnMeasurement are alternatives");
+    static_assert(DERIVATIVE || !(MEASURED_RATE || Parts::FILTERED_DERIVATIVE),
+                  "PidMeasuredRate and PidFilteredDerivative need a derivative term");
+    static_assert(INTEGRAL || !(Parts::INTEGRAL_CLAMP || Parts::BACK_CALCULATION),
+                  "PidIntegralClamp and PidBackCalculation need PidIntegral");
+    static_assert(OUTPUT_CLAMP || !Parts::BACK_CALCULATION, "PidBackCalculation needs PidOutputClamp");
+    static_assert(!(WEIGHTED && Parts::ERROR_FILTER),
+                  "PidErrorFilter filters the error, which setpoint weighting splits in two");
+
+public:
+    // Output for a setpoint and measurement, differencing the measurement for the derivative
+    T update(T setpoint, T measurement, T dt, const PidGains<T> &gains)
+    {
+        static_assert(!MEASURED_RATE, "PidMeasuredRate controllers take the rate");
+        return step(setpoint, measurement, MeasurementHistory::difference(measurement, dt), dt, gains);
+    }
+
+    // Output for a setpoint and measurement, with the measurement's rate of change
+    T update(T setpoint, T measurement, T rate, T dt, const PidGains<T> &gains)
+    {
+        static_assert(MEASURED_RATE, "only PidMeasuredRate controllers take the rate");
+        return step(setpoint, measurement, rate, dt, gains);
+    }
+
+    // Forget all state, as on a mode switch
+    void reset()
+    {
+        ErrorFilter::reset();
+        DerivativeFilter::reset();
+        SetpointHistory::reset();
+        MeasurementHistory::reset();
+        Integrator::reset();
+        Excess::reset();
+    }
+
+    void resetIntegral()
+    {
+        Integrator::reset();
+        Excess::reset();
+    }
+
+    // Integral of the error, 0 without PidIntegral
+    T getIntegral()
+    {
+        return Integrator::get();
+    }
+
+private:
+    T step(T setpoint, T measurement, T rate, T dt, const PidGains<T> &gains)
+    {
+        T error = ErrorFilter::filter(setpoint - measurement, gains.errorAlpha);
+        T output = gains.kp * (WEIGHTED ? gains.b * setpoint - measurement : error);
+        if (INTEGRAL)
+            output += Integrator::term(error, dt, Excess::get(), gains);
+        if (DERIVATIVE)
+        {
+            T derivative = -rate;
+            if (DERIVATIVE_ON_ERROR)
+                derivative = (WEIGHTED ? gains.c : 1) * SetpointHistory::difference(setpoint, dt) - rate;
+            output += gains.kd * DerivativeFilter::filter(derivative, gains.derivativeAlpha);
+        }
+        if (OUTPUT_CLAMP)
+        {
+            T clamped = output > gains.outputMax ? gains.outputMax : output < gains.outputMin ? gains.outputMin : output;
+            Excess::set(clamped - output);
+            output = clamped;
+        }
+        return output;
+    }
+};
+
+#endif // PID_CONTROLLER_H
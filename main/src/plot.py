@@ -24,9 +24,9 @@ yaw = []
 
 # List of variables to select from
 variables = [
-    "vertical_kp", "vertical_kd", "velocity_kp", "velocity_ki",
-    "turn_kp", "turn_kd",  "camera_kp", "camera_kd", 
-    "target_velocity", "target_angle","bias","yaw_bias","tracking","color_detected","back_to_track",
+    "vertical_kp", "vertical_kd", "velocity_kp", "velocity_ki", "lqr_k_pitch", "lqr_k_rate", "lqr_k_position", "lqr_k_speed",
+    "turn_kp", "turn_kd",  "camera_kp", "camera_kd", "attitude_kp", "attitude_ki", "accel_comp_gain", "gyro_filter", "gyro_filter_taps", "pitch_estimator", "notch_count", "balance_controller", "loop_policy", "wheel_jerk", "wheel_speed_limit",
+    "target_velocity", "target_angle","bias","yaw_bias","camera_bias","obstacle_standoff","obstacle_decel","tracking","color_detected","back_to_track",
 ]
 
 # Flag for square wave generation
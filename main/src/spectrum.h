@@ -0,0 +1,260 @@
+#ifndef SPECTRUM_H
+#define SPECTRUM_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <atomic>
+#include <mailbox.h>
+
+const int FFT_SIZE = 256;          // samples per spectrum, a power of two
+const int MAX_NOTCHES = 2;
+const float NOTCH_MIN_HZ = 40;     // lowest peak tracked, well above the balance dynamics (Hz)
+const float NOTCH_Q = 3;           // notch width, centre frequency over -3 dB bandwidth
+const float PEAK_THRESHOLD = 8;    // a peak's amplitude over the median bin's to be notched
+const float PEAK_SMOOTHING = 0.5;  // weight of a new peak frequency in its tracked value
+const float NOTCH_RETUNE_HZ = 1;   // smallest frequency change that recomputes a notch (Hz)
+
+// Second order IIR section, transposed direct form II
+class Biquad
+{
+
+public:
+    // RBJ cookbook notch at freq Hz for a stream sampled at rate Hz
+    void configureNotch(float freq, float q, float rate)
+    {
+        float w = 2 * PI * freq / rate;
+        float alpha = sin(w) / (2 * q);
+        float a0 = 1 + alpha;
+        b0 = 1 / a0;
+        b1 = -2 * cos(w) / a0;
+        b2 = b0;
+        a1 = b1;
+        a2 = (1 - alpha) / a0;
+    }
+
+    // Pass the input through unchanged
+    void bypass()
+    {
+        b0 = 1;
+        b1 = b2 = a1 = a2 = 0;
+    }
+
+    float process(float x)
+    {
+        float y = b0 * x + z1;
+        z1 = b1 * x - a1 * y + z2;
+        z2 = b2 * x - a2 * y;
+        return y;
+    }
+
+private:
+    float b0 = 1, b1 = 0, b2 = 0, a1 = 0, a2 = 0;
+    float z1 = 0, z2 = 0;
+};
+
+// In-place radix-2 complex FFT of n points, n a power of two
+void fft(float *re, float *im, int n)
+{
+    // bit reversal permutation
+    for (int i = 1, j = 0; i < n; i++)
+    {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            float t = re[i];
+            re[i] = re[j];
+            re[j] = t;
+            t = im[i];
+            im[i] = im[j];
+            im[j] = t;
+        }
+    }
+
+    for (int len = 2; len <= n; len <<= 1)
+    {
+        float angle = -2 * PI / len;
+        float wRe = cos(angle), wIm = sin(angle);
+        for (int i = 0; i < n; i += len)
+        {
+            float uRe = 1, uIm = 0;
+            for (int k = 0; k < len / 2; k++)
+            {
+                int a = i + k, b = i + k + len / 2;
+                float tRe = re[b] * uRe - im[b] * uIm;
+                float tIm = re[b] * uIm + im[b] * uRe;
+                re[b] = re[a] - tRe;
+                im[b] = im[a] - tIm;
+                re[a] += tRe;
+                im[a] += tIm;
+                float next = uRe * wRe - uIm * wIm;
+                uIm = uRe * wIm + uIm * wRe;
+                uRe = next;
+            }
+        }
+    }
+}
+
+// Find up to maxPeaks of the largest local maxima above minHz and threshold times the median bin, largest first.
+// Frequencies are refined by parabolic interpolation between bins. Returns the number found
+int findPeaks(const float *magnitude, int bins, float binHz, float minHz, float threshold, float *peakHz,
+              int maxPeaks)
+{
+    float sorted[FFT_SIZE / 2];
+    int count = bins < FFT_SIZE / 2 ? bins : FFT_SIZE / 2;
+    std::copy(magnitude, magnitude + count, sorted);
+    std::nth_element(sorted, sorted + count / 2, sorted + count);
+    float median = sorted[count / 2];
+
+    int found = 0;
+    int peakBin[MAX_NOTCHES];
+    for (int p = 0; p < maxPeaks && p < MAX_NOTCHES; p++)
+    {
+        int best = -1;
+        for (int i = static_cast<int>(minHz / binHz) + 1; i < bins - 1; i++)
+        {
+            bool taken = false;
+            for (int q = 0; q < found; q++)
+                taken |= abs(i - peakBin[q]) <= 2;
+            if (!taken && magnitude[i] > magnitude[i - 1] && magnitude[i] >= magnitude[i + 1] &&
+                magnitude[i] > threshold * median && (best < 0 || magnitude[i] > magnitude[best]))
+                best = i;
+        }
+        if (best < 0)
+            break;
+
+        float left = magnitude[best - 1], centre = magnitude[best], right = magnitude[best + 1];
+        float denominator = left - 2 * centre + right;
+        float offset = denominator != 0 ? 0.5f * (left - right) / denominator : 0;
+        peakBin[found] = best;
+        peakHz[found++] = (best + offset) * binHz;
+    }
+    return found;
+}
+
+// Notch frequencies published by the analyzer, 0 for an unused notch
+struct NotchTuning
+{
+    float freq[MAX_NOTCHES];
+};
+
+// Gyro spectrum analyzer. The control loop pushes samples into one half of a double buffer; when it is full and the
+// analyzer is idle the halves swap and analyse() runs on the full one in a low priority task, publishing the spectrum
+// and the tracked peak frequencies
+class SpectrumAnalyzer
+{
+
+public:
+    SpectrumAnalyzer(float rate)
+    {
+        this->rate = rate;
+        for (int i = 0; i < FFT_SIZE; i++)
+            window[i] = 0.5f - 0.5f * cos(2 * PI * i / (FFT_SIZE - 1));
+    }
+
+    // Add a sample. Returns true when a buffer is ready for analyse()
+    bool push(float sample)
+    {
+        samples[filling][fill++] = sample;
+        if (fill < FFT_SIZE)
+            return false;
+
+        fill = 0;
+        if (busy.load(std::memory_order_acquire))
+            return false; // still analysing, so this buffer is overwritten
+
+        ready = filling;
+        filling ^= 1;
+        busy.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // Compute the spectrum of the ready buffer and track its peaks. Runs in the analyzer task
+    void analyse(int notches)
+    {
+        uint32_t start = micros();
+        float re[FFT_SIZE], im[FFT_SIZE];
+
+        float mean = 0;
+        for (int i = 0; i < FFT_SIZE; i++)
+            mean += samples[ready][i];
+        mean /= FFT_SIZE;
+        for (int i = 0; i < FFT_SIZE; i++)
+        {
+            re[i] = (samples[ready][i] - mean) * window[i];
+            im[i] = 0;
+        }
+        busy.store(false, std::memory_order_release);
+
+        fft(re, im, FFT_SIZE);
+        // single sided amplitude, corrected for the Hann window's gain of 1/2
+        for (int i = 0; i < FFT_SIZE / 2; i++)
+            magnitude[i] = 4 * sqrt(re[i] * re[i] + im[i] * im[i]) / FFT_SIZE;
+
+        float peaks[MAX_NOTCHES];
+        int found = findPeaks(magnitude, FFT_SIZE / 2, getBinHz(), NOTCH_MIN_HZ, PEAK_THRESHOLD, peaks, notches);
+
+        // follow each notch to the nearest new peak, and drop notches whose peak has gone
+        NotchTuning next = {};
+        bool used[MAX_NOTCHES] = {};
+        for (int n = 0; n < notches && n < MAX_NOTCHES; n++)
+        {
+            int nearest = -1;
+            for (int p = 0; p < found; p++)
+                if (!used[p] && (nearest < 0 || fabs(peaks[p] - tracked[n]) < fabs(peaks[nearest] - tracked[n])))
+                    nearest = p;
+            if (nearest < 0)
+            {
+                tracked[n] = 0;
+                continue;
+            }
+            used[nearest] = true;
+            bool jumped = tracked[n] == 0 || fabs(peaks[nearest] - tracked[n]) > 4 * getBinHz();
+            tracked[n] = jumped ? peaks[nearest] : tracked[n] + PEAK_SMOOTHING * (peaks[nearest] - tracked[n]);
+            next.freq[n] = tracked[n];
+        }
+        tuning.write(next);
+
+        analyseUs = micros() - start;
+    }
+
+    float getBinHz()
+    {
+        return rate / FFT_SIZE;
+    }
+
+    float getRate()
+    {
+        return rate;
+    }
+
+    // Single sided amplitude spectrum of the last analysis, FFT_SIZE / 2 bins (input units)
+    const float *getMagnitude()
+    {
+        return magnitude;
+    }
+
+    // Duration of the last analyse() (μs)
+    uint32_t getAnalyseUs()
+    {
+        return analyseUs;
+    }
+
+    Mailbox<NotchTuning> tuning;
+
+private:
+    float rate;
+    float window[FFT_SIZE];
+    float samples[2][FFT_SIZE];
+    int filling = 0;
+    int ready = 0;
+    int fill = 0;
+    std::atomic<bool> busy{false};
+    float magnitude[FFT_SIZE / 2] = {0};
+    float tracked[MAX_NOTCHES] = {0};
+    uint32_t analyseUs = 0;
+};
+
+#endif // SPECTRUM_H
@@ -1,4 +1,107 @@
+#ifndef STEP_H
+#define STEP_H
+
 #include <Arduino.h>
+#include <atomic>
+#include <soc/soc.h>
+#include <soc/gpio_reg.h>
+
+// Functions and data reachable from the stepper ISR are kept in internal RAM (IRAM_ATTR / DRAM), so that the ISR
+// does not stall on the flash cache while Wi-Fi or flash writes hold it. check_iram.py verifies this at build time
+
+// Drive an output pin through the GPIO set/clear registers. ISR-safe replacement for digitalWrite
+static inline void IRAM_ATTR gpioWriteFast(uint8_t pin, bool level)
+{
+    if (pin < 32)
+        REG_WRITE(level ? GPIO_OUT_W1TS_REG : GPIO_OUT_W1TC_REG, 1UL << pin);
+    else
+        REG_WRITE(level ? GPIO_OUT1_W1TS_REG : GPIO_OUT1_W1TC_REG, 1UL << (pin - 32));
+}
+
+// Q40 reciprocal multiplier for floor(x / d). Uses a divide, so compute it once outside the ISR
+static inline uint32_t reciprocalOf(uint32_t d)
+{
+    return static_cast<uint32_t>(((1ULL << 40) + d - 1) / d);
+}
+
+// Floor division using a reciprocalOf(d) multiplier. Exact while x * (recip * d - 2^40) < 2^40, i.e. any 32-bit x for d = 500
+static inline uint32_t IRAM_ATTR divideByReciprocal(uint32_t x, uint32_t recip)
+{
+    return static_cast<uint32_t>((static_cast<uint64_t>(x) * recip) >> 40);
+}
+
+// Step periods by fastDivide() rather than the LX6 hardware divider. On the host fastDivide() takes twice as long as
+// a divide; set this only if benchmarkDivide() shows it winning on the target
+const bool STEP_FAST_DIVIDE = false;
+
+// Division-free floor(num / den) for num < 2^31, den > 0. Safe to call from ISR
+static inline uint32_t IRAM_ATTR fastDivide(uint32_t num, uint32_t den)
+{
+    // Normalise den into d = D * 2^32 with D in [0.5, 1)
+    int n = __builtin_clz(den);
+    uint32_t d = den << n;
+
+    // Linear seed for 1/D in Q30 (max error 1/17), refined by three Newton-Raphson iterations
+    uint32_t x = 3031741621u - static_cast<uint32_t>((static_cast<uint64_t>(2021161080u) * d) >> 32);
+    for (int i = 0; i < 3; i++)
+    {
+        uint32_t t = static_cast<uint32_t>((static_cast<uint64_t>(d) * x) >> 32);
+        x = static_cast<uint32_t>((static_cast<uint64_t>(x) * (0x80000000u - t)) >> 30);
+    }
+
+    // Bias low by one LSB so that the quotient estimate is never high, then it is at most one short
+    x -= 1;
+
+    // num / den = num * (1/D) * 2^n / 2^32
+    uint32_t q = static_cast<uint32_t>((static_cast<uint64_t>(num) * x) >> (62 - n));
+    if (num - q * den >= den)
+        q++;
+    return q;
+}
+
+// How a motor follows its command
+enum MotorMode
+{
+    SPEED_MODE, // ramp toward tSpeed at |accel|
+    ACCEL_MODE, // integrate signed accel, clamping the speed to +-tSpeed
+};
+
+// Commanded acceleration and target speed for one motor, in the units of step::accel and step::tSpeed
+struct MotorCommand
+{
+    int32_t accel;  // acceleration (steps/s/s)
+    int32_t tSpeed; // target speed, or speed clamp in ACCEL_MODE (steps/(SPEED_SCALE * s))
+    int32_t jerk;   // jerk limit, 0 for constant acceleration ramps (steps/s/s/s)
+    int32_t vMax;   // speed limit of both modes, at most MAX_SPEED (steps/(SPEED_SCALE * s))
+    MotorMode mode;
+};
+
+// Position move for one motor, added on top of its speed command
+struct MotorMove
+{
+    int32_t steps;  // distance, or target position if absolute (steps)
+    bool absolute;  // steps is a target position rather than a distance
+    int32_t speed;  // cruise speed (steps/(SPEED_SCALE * s))
+    int32_t accel;  // acceleration (steps/s/s)
+};
+
+// Consistent readback of one motor's position and speed
+struct MotorState
+{
+    int32_t position; // accumulated steps (steps)
+    int32_t speed;    // current speed (steps/(SPEED_SCALE * s))
+    bool moving;      // position move in progress
+    uint32_t clockUs; // motor clock at the snapshot, the time base of StepEdge (μs)
+};
+
+// Time and position of one step pulse
+struct StepEdge
+{
+    uint32_t timeUs;  // motor clock at the pulse (μs)
+    int32_t position; // position after the step (steps)
+};
+
+const uint32_t STEP_EDGES = 64; // step edges kept per motor, a power of two
 
 class step
 {
@@ -10,8 +113,16 @@ public:
     const int MICROSTEPS = 16;                                  // Number of microsteps per physical step
     const int STEPS = 200;                                      // Number of physical steps per revolution
     const float STEP_ANGLE = (2.0 * PI) / (STEPS * MICROSTEPS); // Angle per microstep (rad)
+    const uint32_t PERIOD_SCALE = 1000000 * SPEED_SCALE;        // Step period is PERIOD_SCALE / speed (μs)
+    const uint32_t ACCEL_RECIP = reciprocalOf(1000000 / SPEED_SCALE); // Multiplier for the μs to speed unit conversion
+    const uint32_t JERK_RECIP = reciprocalOf(1000000000000 / SPEED_SCALE); // Multiplier for the jerk to Q32 conversion
     int32_t accel = 0;                                          // current acceleration (steps/s)
     int32_t tSpeed = 0;                                         // current speed (steps/(SPEED_SCALE * s))
+    int32_t jerk = 0;                                           // jerk limit, 0 for constant acceleration ramps (steps/s/s/s)
+    MotorMode mode = SPEED_MODE;                                // how accel and tSpeed are followed
+    int32_t vMax = MAX_SPEED * SPEED_SCALE;                     // speed limit (steps/(SPEED_SCALE * s))
+    const int32_t MOVE_BRAKE = 1000000 / (2 * SPEED_SCALE);    // v^2 * MOVE_BRAKE / a is the stopping distance (speed unit μs)
+    const int32_t MOVE_MIN_ACCEL = 100;                         // lowest move acceleration that gains speed over a 5 μs update (steps/s/s)
 
     // Initialise the stepper with interval and pin numbers
     step(int i, int8_t sp, int8_t dp) : interval(i), stepPin(sp), dirPin(dp)
@@ -21,41 +132,55 @@ public:
     }
 
     // Update the stepper motor, performing a step and updating the speed as necessary. Call every interval μs
-    void runStepper()
+    void IRAM_ATTR runStepper()
+    {
+        advance(interval);
+    }
+
+    // Update the stepper motor after dt μs have elapsed since the last call. Used directly by the event-driven scheduler
+    void IRAM_ATTR advance(int32_t dt)
     {
         // Note: ESP32 doesn't support floating point calculations in an ISR, so this function only uses integer operations
 
         // Increment speed calculation interval timer
-        speedTimer += interval;
+        speedTimer += dt;
+        clockUs += dt;
 
+        // Phase accumulator stepping, see setDDA()
+        if (dda)
+        {
+            runPhase(dt);
+        }
         // Check for stepping active
-        if (step_period != 0)
+        else if (step_period != 0)
         {
 
             // Increment step timer
-            stepTimer += interval;
+            stepTimer += dt;
 
             // Check for step period elapsed
-            if (stepTimer > step_period)
+            if (stepTimer >= step_period)
             {
 
                 // Start pulse
-                digitalWrite(stepPin, HIGH);
+                gpioWriteFast(stepPin, HIGH);
 
-                // Roll back step timer by one period
-                stepTimer -= step_period;
+                // Keep the part of the next step already made since this one was due
+                stepPhase += stepRate * stepTimer - PERIOD_SCALE;
+                stepTimer = 0;
 
                 // Recaculate step interval
                 updateSpeed();
 
                 // Set step direction for next step
-                digitalWrite(dirPin, speed > 0);
+                gpioWriteFast(dirPin, rate > 0);
 
                 // Increment/decrement position counter
-                position += (speed > 0) ? 1 : -1;
+                position += (rate > 0) ? 1 : -1;
+                recordEdge();
 
                 // End pulse
-                digitalWrite(stepPin, LOW);
+                gpioWriteFast(stepPin, LOW);
             }
         }
         else
@@ -69,6 +194,25 @@ public:
             updateSpeed();
     }
 
+    // Select phase accumulator (DDA) step generation. The fractional step carries forward between ticks, so the
+    // average rate is exact and each edge lands within one tick of its ideal time. Fixed-tick scheduling only: the
+    // phase gains |rate| * dt per call, which overflows for the dt of an event-driven alarm at high rates. config.h
+    // rules out STEPPER_DDA with STEPPER_EVENT_DRIVEN at compile time
+    void setDDA(bool enable)
+    {
+        dda = enable;
+        phase = 0;
+    }
+
+    // Time until advance() next has work to do, either a step edge or a speed update (μs)
+    int32_t IRAM_ATTR nextEventUs()
+    {
+        int32_t next = MAX_SPEED_INTERVAL_US - speedTimer + 1;
+        if (step_period != 0 && step_period - stepTimer < next)
+            next = step_period - stepTimer;
+        return next;
+    }
+
     // Set acceleration in rad/s/s. Do not call from ISR
     void setAccelerationRad(float accelRad)
     {
@@ -93,6 +237,131 @@ public:
         tSpeed = speed;
     }
 
+    // Set the jerk limit in rad/s/s/s, 0 for none. It shapes SPEED_MODE ramps into S-curves and slews ACCEL_MODE
+    // commands. It is carried by the commands built from now on, and reaches the ISR with them. Call from the task
+    // that builds commands
+    void setJerkRad(float jerkRad)
+    {
+        commandJerk = static_cast<int>(jerkRad / STEP_ANGLE);
+    }
+
+    // Set the speed limit in rad/s, at most MAX_SPEED. Like the jerk limit, it is carried by the commands built from
+    // now on. Call from the task that builds commands
+    void setMaxSpeedRad(float speedRad)
+    {
+        float limit = (speedRad < 0 ? -speedRad : speedRad) * SPEED_SCALE / STEP_ANGLE;
+        commandVMax = limit < MAX_SPEED * SPEED_SCALE ? static_cast<int32_t>(limit) : MAX_SPEED * SPEED_SCALE;
+    }
+
+    // Build a command from acceleration in rad/s/s and target speed in rad/s. Do not call from ISR
+    MotorCommand commandRad(float accelRad, float speedRad)
+    {
+        MotorCommand command;
+        command.accel = static_cast<int>(accelRad / STEP_ANGLE);
+        command.tSpeed = static_cast<int>(speedRad * SPEED_SCALE / STEP_ANGLE);
+        command.jerk = commandJerk;
+        command.vMax = commandVMax;
+        command.mode = SPEED_MODE;
+        return command;
+    }
+
+    // Build a signed acceleration command in rad/s/s, with the speed clamped to +-limitRad rad/s. Do not call from ISR
+    MotorCommand accelCommandRad(float accelRad, float limitRad)
+    {
+        MotorCommand command = commandRad(accelRad, limitRad < 0 ? -limitRad : limitRad);
+        command.mode = ACCEL_MODE;
+        return command;
+    }
+
+    // Apply a command received from the control loop
+    void IRAM_ATTR applyCommand(const MotorCommand &command)
+    {
+        // Account for the time since the last update under the old command
+        updateSpeed();
+
+        accel = command.accel;
+        tSpeed = command.tSpeed;
+        jerk = command.jerk;
+        vMax = command.vMax;
+        mode = command.mode;
+    }
+
+    // Build a relative move of steps microsteps at up to speedRad rad/s and accelRad rad/s/s. Do not call from ISR
+    MotorMove moveCommand(int32_t steps, float speedRad, float accelRad)
+    {
+        MotorMove move;
+        move.steps = steps;
+        move.absolute = false;
+        move.speed = static_cast<int>(speedRad * SPEED_SCALE / STEP_ANGLE);
+        move.accel = static_cast<int>(accelRad / STEP_ANGLE);
+        return move;
+    }
+
+    // Build a move to absolute position target in microsteps. Do not call from ISR
+    MotorMove moveToCommand(int32_t target, float speedRad, float accelRad)
+    {
+        MotorMove move = moveCommand(target, speedRad, accelRad);
+        move.absolute = true;
+        return move;
+    }
+
+    // Start a move received from the control loop. The move adds to the speed ramp, so a balancing robot can turn
+    // in place with opposite moves on each wheel while the balance loop keeps both wheels' common speed. A move with
+    // no speed or no acceleration could never finish, so it completes at once without moving
+    void IRAM_ATTR startMove(const MotorMove &move)
+    {
+        int32_t steps = move.absolute ? move.steps - position : move.steps;
+        moveLeft = static_cast<int64_t>(steps) * PERIOD_SCALE;
+        moveVMax = move.speed < 0 ? -move.speed : move.speed;
+        moveAccel = move.accel < 0 ? -move.accel : move.accel;
+        moving = steps != 0 && moveVMax != 0 && moveAccel != 0;
+        if (moving && moveAccel < MOVE_MIN_ACCEL)
+            moveAccel = MOVE_MIN_ACCEL;
+        if (!moving)
+            moveSpeed = 0;
+    }
+
+    // Snapshot position and speed for the control loop
+    MotorState IRAM_ATTR getState()
+    {
+        MotorState state;
+        state.position = position;
+        state.speed = rate;
+        state.moving = moving;
+        state.clockUs = clockUs;
+        return state;
+    }
+
+    // Copy up to n of the latest step edges into out, oldest first. Returns the number copied. Retries while the ISR
+    // overwrites the entries being copied, so n must leave it some headroom below STEP_EDGES. Do not call from ISR
+    uint32_t copyEdges(StepEdge *out, uint32_t n)
+    {
+        while (true)
+        {
+            uint32_t end = edgeCount.load(std::memory_order_acquire);
+            uint32_t count = end < n ? end : n;
+            for (uint32_t i = 0; i < count; i++)
+                out[i] = edges[(end - count + i) & (STEP_EDGES - 1)];
+            std::atomic_thread_fence(std::memory_order_acquire);
+
+            // The edge being written when we finish replaces the one STEP_EDGES before it
+            if (edgeCount.load(std::memory_order_relaxed) - end < STEP_EDGES - count)
+                return count;
+        }
+    }
+
+    // Get speed of a snapshot in rad/s. Do not call from ISR
+    float getSpeedRad(const MotorState &state)
+    {
+        return static_cast<float>(state.speed) * STEP_ANGLE / SPEED_SCALE;
+    }
+
+    // Get position of a snapshot in rads. Do not call from ISR
+    float getPositionRad(const MotorState &state)
+    {
+        return static_cast<float>(state.position) * STEP_ANGLE;
+    }
+
     // Get position in microsteps
     int getPosition()
     {
@@ -108,67 +377,288 @@ public:
     // Get current speed in microsteps/(SPEED_SCALE * s)
     float getSpeed()
     {
-        return speed;
+        return rate;
     }
 
     // Get current speed in rad/s. Do not call from ISR
     float getSpeedRad()
     {
-        return static_cast<float>(speed) * STEP_ANGLE / SPEED_SCALE;
+        return static_cast<float>(rate) * STEP_ANGLE / SPEED_SCALE;
     }
 
 private:
-    int32_t stepTimer = 0;   // time since last step (μs)
+    int32_t stepTimer = 0;   // time since the last step or speed update (μs)
     int32_t speedTimer = 0;  // time since last speed update (μs)
-    int32_t step_period = 0; // current time between steps (μs)
+    int32_t step_period = 0; // time from stepPhase to the next step (μs)
+    uint32_t stepRate = 0;   // |rate| that step_period was calculated for (steps/(SPEED_SCALE * s))
+    uint32_t stepPhase = 0;  // part of the next step made when stepTimer last started, of PERIOD_SCALE
     int32_t position = 0;    // current accumulated steps (steps)
     int8_t stepPin;          // output pin number for step
     int8_t dirPin;           // output pin number for direction
     int32_t speed = 0;       // current steps per SPEED_SCALE seconds (steps)
     int32_t interval;        // interval between calls to runStepper (μs)
+    int32_t commandJerk = 0; // jerk limit put in the commands built here (steps/s/s/s)
+    int32_t commandVMax = MAX_SPEED * SPEED_SCALE; // speed limit put in the commands built here
+    bool dda = false;        // phase accumulator step generation enabled
+    uint32_t phase = 0;      // accumulated step fraction, one step per PERIOD_SCALE (steps * μs / (SPEED_SCALE * s))
+    int64_t accelQ = 0;      // S-curve acceleration, Q32 (steps/(SPEED_SCALE * s) per μs)
+    int64_t speedFrac = 0;   // S-curve speed remainder below one speed unit, Q32 (steps/(SPEED_SCALE * s))
+    int32_t rate = 0;        // stepping rate, speed plus moveSpeed (steps/(SPEED_SCALE * s))
+    bool moving = false;     // position move in progress
+    int32_t moveSpeed = 0;   // current move profile speed (steps/(SPEED_SCALE * s))
+    int32_t moveVMax = 0;    // move cruise speed (steps/(SPEED_SCALE * s))
+    int32_t moveAccel = 0;   // move acceleration (steps/s/s)
+    int64_t moveLeft = 0;    // distance left to move, PERIOD_SCALE per step (steps/(SPEED_SCALE * s) * μs)
+    uint32_t clockUs = 0;    // time advanced since start (μs)
+    StepEdge edges[STEP_EDGES];        // ring of the latest step edges
+    std::atomic<uint32_t> edgeCount{0}; // step edges recorded, the next is written at edgeCount % STEP_EDGES
 
-    // Update the motor speed and step interval
-    void updateSpeed()
+    // Advance the phase accumulator by dt μs and step when a whole step has accumulated
+    void IRAM_ATTR runPhase(int32_t dt)
     {
+        if (rate == 0)
+        {
+            phase = 0;
+            return;
+        }
 
-        if (accel < 0)
-            accel = -accel;
+        phase += static_cast<uint32_t>(rate > 0 ? rate : -rate) * dt;
+        if (phase >= PERIOD_SCALE)
+        {
+            // Start pulse
+            gpioWriteFast(stepPin, HIGH);
+
+            // Keep the remainder for the next step
+            phase -= PERIOD_SCALE;
+
+            // Recalculate speed
+            updateSpeed();
+
+            // Set step direction for next step
+            gpioWriteFast(dirPin, rate > 0);
+
+            // Increment/decrement position counter
+            position += (rate > 0) ? 1 : -1;
+            recordEdge();
 
-        // Calculate change to speed
-        if (speed < tSpeed)
+            // End pulse
+            gpioWriteFast(stepPin, LOW);
+        }
+    }
+
+    // Time for a speed to cover phaseLeft of PERIOD_SCALE, rounded up to the next μs
+    uint32_t IRAM_ATTR stepPeriod(uint32_t phaseLeft, uint32_t speed)
+    {
+        return STEP_FAST_DIVIDE ? fastDivide(phaseLeft + speed - 1, speed) : (phaseLeft + speed - 1) / speed;
+    }
+
+    // Add the step just taken to the edge ring
+    void IRAM_ATTR recordEdge()
+    {
+        uint32_t count = edgeCount.load(std::memory_order_relaxed);
+        edges[count & (STEP_EDGES - 1)].timeUs = clockUs;
+        edges[count & (STEP_EDGES - 1)].position = position;
+        edgeCount.store(count + 1, std::memory_order_release);
+    }
+
+    // Update the motor speed and step interval
+    void IRAM_ATTR updateSpeed()
+    {
+
+        if (mode == ACCEL_MODE)
         {
-            speed += accel * speedTimer / (1000000 / SPEED_SCALE);
-            if (speed > tSpeed)
-            {
-                speed = tSpeed;
-            }
-            if (speed > MAX_SPEED * SPEED_SCALE)
-            {
-                speed = MAX_SPEED * SPEED_SCALE;
-            }
+            updateSpeedAccel();
+        }
+        else if (jerk != 0)
+        {
+            updateSpeedJerk();
         }
         else
         {
-            speed -= accel * speedTimer / (1000000 / SPEED_SCALE);
+            if (accel < 0)
+                accel = -accel;
+
+            // Speed change for the elapsed time, equal to accel * speedTimer / (1000000 / SPEED_SCALE)
+            int32_t dSpeed = divideByReciprocal(accel * speedTimer, ACCEL_RECIP);
+
+            // Calculate change to speed
             if (speed < tSpeed)
             {
-                speed = tSpeed;
+                speed += dSpeed;
+                if (speed > tSpeed)
+                {
+                    speed = tSpeed;
+                }
+                if (speed > vMax)
+                {
+                    speed = vMax;
+                }
             }
-            if (speed < -MAX_SPEED * SPEED_SCALE)
+            else
             {
-                speed = -MAX_SPEED * SPEED_SCALE;
+                speed -= dSpeed;
+                if (speed < tSpeed)
+                {
+                    speed = tSpeed;
+                }
+                if (speed < -vMax)
+                {
+                    speed = -vMax;
+                }
             }
+            accelQ = 0;
+            speedFrac = 0;
         }
 
+        // Add any position move on top of the speed ramp
+        if (moving)
+            updateMove();
+        rate = speed + moveSpeed;
+        if (rate > MAX_SPEED * SPEED_SCALE)
+            rate = MAX_SPEED * SPEED_SCALE;
+        if (rate < -MAX_SPEED * SPEED_SCALE)
+            rate = -MAX_SPEED * SPEED_SCALE;
+
         // Reset speed calculation timer
         speedTimer = 0;
 
-        // Calculate step period
-        if (speed == 0)
+        // Calculate the time to the next step. Not needed by the phase accumulator. The part of a step made at the
+        // old rate is kept, so the steps fall where the integral of the rate crosses each whole step, through ramps too
+        if (dda || rate == 0)
+        {
             step_period = 0;
-        else if (speed > 0)
-            step_period = 1000000 * SPEED_SCALE / speed;
+            stepRate = 0;
+            stepPhase = 0;
+        }
+        else
+        {
+            stepPhase += stepRate * stepTimer;
+            stepTimer = 0;
+            stepRate = rate > 0 ? rate : -rate;
+            step_period = stepPeriod(stepPhase < PERIOD_SCALE ? PERIOD_SCALE - stepPhase : 1, stepRate);
+        }
+    }
+
+    // Acceleration command mode. Integrates the signed acceleration, carrying the fraction below one speed unit so
+    // that small commands are not truncated away, and clamps the speed to +-tSpeed. With a jerk limit the
+    // acceleration slews to each new command at that limit instead of stepping to it
+    void IRAM_ATTR updateSpeedAccel()
+    {
+        int32_t limit = tSpeed < vMax ? tSpeed : vMax;
+
+        int64_t accelTarget = (static_cast<int64_t>(accel) * ACCEL_RECIP) >> 8;
+        if (jerk != 0)
+        {
+            int64_t dAccel = ((static_cast<int64_t>(jerk < 0 ? -jerk : jerk) * JERK_RECIP) >> 8) * speedTimer;
+            if (accelQ < accelTarget)
+                accelQ = accelQ + dAccel < accelTarget ? accelQ + dAccel : accelTarget;
+            else
+                accelQ = accelQ - dAccel > accelTarget ? accelQ - dAccel : accelTarget;
+        }
         else
-            step_period = -1000000 * SPEED_SCALE / speed;
+        {
+            accelQ = accelTarget;
+        }
+        int64_t dSpeedQ = accelQ * speedTimer + speedFrac;
+        int32_t dSpeed = static_cast<int32_t>(dSpeedQ >> 32);
+        speedFrac = dSpeedQ - (static_cast<int64_t>(dSpeed) << 32);
+        speed += dSpeed;
+
+        if (speed > limit)
+        {
+            speed = limit;
+            speedFrac = 0;
+        }
+        else if (speed < -limit)
+        {
+            speed = -limit;
+            speedFrac = 0;
+        }
     }
-};
\ No newline at end of file
+
+    // Trapezoidal move profile. Integrates the distance moved, brakes once the stopping distance reaches the distance
+    // left, and finishes once it is used up. The steps follow the same integral, so they stop on the target
+    void IRAM_ATTR updateMove()
+    {
+        moveLeft -= static_cast<int64_t>(moveSpeed) * speedTimer;
+
+        int32_t dSpeed = divideByReciprocal(moveAccel * speedTimer, ACCEL_RECIP);
+        int64_t left = moveLeft > 0 ? moveLeft : -moveLeft;
+        int32_t towards = moveLeft > 0 ? moveSpeed : -moveSpeed;
+
+        // Done once the distance is used up and the move can stop within this update. The steps follow the distance,
+        // so the last one has fired on the target
+        if ((moveLeft == 0 || towards < 0) && (moveSpeed > 0 ? moveSpeed : -moveSpeed) <= dSpeed)
+        {
+            moveSpeed = 0;
+            moving = false;
+            return;
+        }
+
+        // Stopping distance in speed unit μs is v^2 * MOVE_BRAKE / a, compared without dividing. The speed drops once
+        // per update, up to MAX_SPEED_INTERVAL_US apart, which travels up to v * dv / (2 * a) further, so brake on
+        // v * (v + dv) with the dv of the longest update
+        int32_t dSpeedMax = divideByReciprocal(moveAccel * MAX_SPEED_INTERVAL_US, ACCEL_RECIP);
+        bool braking = towards > 0 && ((static_cast<int64_t>(towards) * (towards + dSpeedMax) * MOVE_BRAKE) >> 10) >=
+                                          moveAccel * (left >> 10);
+
+        if (braking)
+            towards = towards > dSpeed ? towards - dSpeed : 0;
+        else
+            towards = towards + dSpeed < moveVMax ? towards + dSpeed : moveVMax;
+        moveSpeed = moveLeft > 0 ? towards : -towards;
+    }
+
+    // Jerk-limited S-curve speed update. The acceleration slews toward +-accel at the jerk limit, and starts slewing
+    // back to zero once the speed it would still gain while doing so covers the remaining speed error
+    void IRAM_ATTR updateSpeedJerk()
+    {
+        int32_t target = tSpeed > vMax ? vMax : (tSpeed < -vMax ? -vMax : tSpeed);
+        int32_t error = target - speed;
+
+        if (accel < 0)
+            accel = -accel;
+
+        // Limits in Q32 speed units per μs and per μs^2
+        int64_t accelLimit = (static_cast<int64_t>(accel) * ACCEL_RECIP) >> 8;
+        int64_t jerkQ = (static_cast<int64_t>(jerk < 0 ? -jerk : jerk) * JERK_RECIP) >> 8;
+
+        if (error == 0)
+        {
+            accelQ = 0;
+            speedFrac = 0;
+            return;
+        }
+
+        // Speed still gained while ramping acceleration a to zero is a^2 / (2 * jerk)
+        int64_t accelTarget = 0;
+        int64_t towards = error > 0 ? accelQ : -accelQ;
+        int64_t towardsQ16 = towards >> 16;
+        int64_t remaining = error > 0 ? error : -error;
+        if (towards <= 0 || remaining * 2 * jerkQ > towardsQ16 * towardsQ16)
+            accelTarget = error > 0 ? accelLimit : -accelLimit;
+
+        // Slew acceleration toward its target
+        int64_t dAccel = jerkQ * speedTimer;
+        if (accelQ < accelTarget)
+            accelQ = accelQ + dAccel < accelTarget ? accelQ + dAccel : accelTarget;
+        else
+            accelQ = accelQ - dAccel > accelTarget ? accelQ - dAccel : accelTarget;
+
+        // Integrate speed, carrying the fraction below one speed unit
+        int64_t dSpeedQ = accelQ * speedTimer + speedFrac;
+        int32_t dSpeed = static_cast<int32_t>(dSpeedQ >> 32);
+        speedFrac = dSpeedQ - (static_cast<int64_t>(dSpeed) << 32);
+        speed += dSpeed;
+
+        // Land exactly on the target rather than overshooting it
+        if ((error > 0 && speed >= target) || (error < 0 && speed <= target))
+        {
+            speed = target;
+            accelQ = 0;
+            speedFrac = 0;
+        }
+    }
+};
+
+#endif // STEP_H
@@ -0,0 +1,135 @@
+#ifndef ULTRASONIC_H
+#define ULTRASONIC_H
+
+#include <Arduino.h>
+#include <algorithm>
+#include <mailbox.h>
+
+const uint32_t ULTRASONIC_PERIOD_MS = 50;          // between pings, long enough for the last one's echoes to die away
+const uint32_t ULTRASONIC_TRIGGER_US = 10;         // trigger pulse width
+const uint32_t ULTRASONIC_RISE_TIMEOUT_US = 10000; // an echo pulse starting later than this after the trigger is stray
+const uint32_t ULTRASONIC_MIN_ECHO_US = 116;       // 2 cm, the sensor's blind zone; shorter pulses are noise
+const uint32_t ULTRASONIC_MAX_ECHO_US = 23200;     // 4 m; longer pulses are the sensor's own no-echo timeout
+const float ULTRASONIC_US_PER_CM = 58.0;           // echo time per cm of range, there and back at 343 m/s
+const float ULTRASONIC_MAX_RANGE = 400;            // reported when nothing echoes (cm)
+const int ULTRASONIC_MEDIAN = 5;                   // readings in the median filter, odd
+
+// Filtered range, computed by read()
+struct RangeReading
+{
+    float distance;   // median of the last ULTRASONIC_MEDIAN echoes (cm)
+    uint32_t timeUs;  // micros() of the trigger of the newest echo in it
+    uint32_t count;   // echoes accepted so far
+};
+
+// Raw echo pulse widths, published by the interrupt on each accepted echo
+struct EchoPulses
+{
+    uint32_t widthUs[ULTRASONIC_MEDIAN]; // the last ULTRASONIC_MEDIAN widths, newest at (count - 1) % ULTRASONIC_MEDIAN
+    uint32_t timeUs;                     // micros() of the trigger of the newest
+    uint32_t count;                      // echoes accepted so far
+};
+
+// HC-SR04 ranging without blocking. startPing() runs from a timer and arms the state machine before the trigger
+// pulse; echoEdge() runs from the echo pin's interrupt and times the pulse. An edge that does not fit the state, such
+// as crosstalk from another sensor or a late echo of the previous ping, is counted and ignored, and a ping with no
+// echo is counted as a timeout when the next one starts. The interrupt only publishes the integer widths of the
+// accepted echoes; read() takes their median and converts it to a range in the control loop
+class Ultrasonic
+{
+
+public:
+    // Arm for a new ping whose trigger pulse ends at nowUs
+    void startPing(uint32_t nowUs)
+    {
+        if (state != IDLE)
+            timeouts++;
+        pingUs = nowUs;
+        state = WAIT_RISE;
+    }
+
+    // Echo pin changed, to high or low, at nowUs (micros())
+    void IRAM_ATTR echoEdge(bool high, uint32_t nowUs)
+    {
+        if (high)
+        {
+            if (state != WAIT_RISE || nowUs - pingUs > ULTRASONIC_RISE_TIMEOUT_US)
+            {
+                stray++;
+                return;
+            }
+            riseUs = nowUs;
+            state = WAIT_FALL;
+            return;
+        }
+
+        if (state != WAIT_FALL)
+        {
+            stray++;
+            return;
+        }
+        state = IDLE;
+
+        uint32_t width = nowUs - riseUs;
+        if (width < ULTRASONIC_MIN_ECHO_US)
+        {
+            stray++;
+            return;
+        }
+        pulses.widthUs[pulses.count % ULTRASONIC_MEDIAN] = width;
+        pulses.timeUs = pingUs;
+        pulses.count++;
+        published.write(pulses);
+    }
+
+    // Latest filtered range, the median of the last ULTRASONIC_MEDIAN echoes, the nearer middle one of an even count.
+    // Returns false if there has been no echo yet
+    bool read(RangeReading &reading)
+    {
+        EchoPulses latest;
+        uint32_t version;
+        if (!published.read(latest, version) || latest.count == 0)
+            return false;
+
+        // the range only grows with the width, so the median width gives the median range
+        uint32_t n = latest.count < ULTRASONIC_MEDIAN ? latest.count : ULTRASONIC_MEDIAN;
+        uint32_t *widths = latest.widthUs;
+        std::nth_element(widths, widths + (n - 1) / 2, widths + n);
+        uint32_t width = widths[(n - 1) / 2];
+
+        reading.distance = width >= ULTRASONIC_MAX_ECHO_US ? ULTRASONIC_MAX_RANGE : width / ULTRASONIC_US_PER_CM;
+        reading.timeUs = latest.timeUs;
+        reading.count = latest.count;
+        return true;
+    }
+
+    // Pings that got no echo
+    uint32_t getTimeouts()
+    {
+        return timeouts;
+    }
+
+    // Edges and pulses rejected as not belonging to a ping
+    uint32_t getStray()
+    {
+        return stray;
+    }
+
+private:
+    enum State
+    {
+        IDLE,
+        WAIT_RISE,
+        WAIT_FALL
+    };
+
+    volatile State state = IDLE;
+    volatile uint32_t pingUs = 0;
+    uint32_t riseUs = 0;
+    EchoPulses pulses = {};
+    volatile uint32_t timeouts = 0;
+    volatile uint32_t stray = 0;
+    Mailbox<EchoPulses> published;
+};
+
+#endif // ULTRASONIC_H
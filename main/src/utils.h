@@ -4,47 +4,211 @@
 #include "config.h"
 #include "internet.h"
 #include "pid.h"
+#include "bench.h"
 
-bool TimerHandler(void *timerNo)
+static uint32_t appliedMove = 0; // version of the last StepperMove started by the ISR
+
+// Apply the latest command and move from the control loop to both motors at once. Called from the ISR before stepping
+void IRAM_ATTR applyStepperCommand()
+{
+    static uint32_t applied = 0;
+    StepperCommand command;
+    StepperMove move;
+    uint32_t version;
+
+    if (stepperCommand.version() != applied && stepperCommand.read(command, version))
+    {
+        step1.applyCommand(command.motor[0]);
+        step2.applyCommand(command.motor[1]);
+        applied = version;
+    }
+
+    if (stepperMove.version() != appliedMove && stepperMove.read(move, version))
+    {
+        step1.startMove(move.motor[0]);
+        step2.startMove(move.motor[1]);
+        appliedMove = version;
+    }
+}
+
+// Publish both motors' state for the control loop and return it. Called from the ISR after stepping
+StepperState IRAM_ATTR publishStepperState()
+{
+    StepperState state;
+    state.motor[0] = step1.getState();
+    state.motor[1] = step2.getState();
+    state.moveVersion = appliedMove;
+    stepperState.write(state);
+    return state;
+}
+
+// Read a consistent snapshot of both motors. Do not call from ISR
+StepperState readStepperState()
+{
+    StepperState state;
+    uint32_t version;
+    while (!stepperState.read(state, version))
+    {
+    }
+    return state;
+}
+
+// Start position moves on both motors. Returns the version to pass to isMoveComplete()
+uint32_t moveSteppers(const MotorMove &move1, const MotorMove &move2)
+{
+    StepperMove move;
+    move.motor[0] = move1;
+    move.motor[1] = move2;
+    stepperMove.write(move);
+    return stepperMove.version();
+}
+
+// Check whether the moves started by moveSteppers() have both finished
+bool isMoveComplete(uint32_t version)
+{
+    StepperState state = readStepperState();
+    return state.moveVersion == version && !state.motor[0].moving && !state.motor[1].moving;
+}
+
+// Start an in-place turn by angle rad (positive left) on exact wheel travel. Returns the move version
+uint32_t startWheelTurn(float angle)
+{
+    float wheelAngle = angle * WHEEL_BASE / (2 * WHEEL_RADIUS);
+    int32_t steps = static_cast<int32_t>(wheelAngle / step1.STEP_ANGLE);
+    wheel_turning = true;
+    return moveSteppers(step1.moveCommand(steps, TURN_MOVE_SPEED, TURN_MOVE_ACCEL),
+                        step2.moveCommand(-steps, TURN_MOVE_SPEED, TURN_MOVE_ACCEL));
+}
+
+// Check an in-place turn, and hold the new heading once it has finished
+bool isWheelTurnComplete(uint32_t version)
+{
+    if (!isMoveComplete(version))
+        return false;
+    wheel_turning = false;
+    target_angle = yaw;
+    return true;
+}
+
+// The stepper timer's counter, alarm and interrupt by their registers, timer 1 of timer group 1. The timer driver
+// functions are not in IRAM, so the ISR cannot call them. The alarm disables itself when it fires, auto reload or not
+static inline uint64_t IRAM_ATTR stepperTimerRead()
+{
+    // latch the counter, then read it
+    REG_WRITE(TIMG_T1UPDATE_REG(1), 1);
+    return (static_cast<uint64_t>(REG_READ(TIMG_T1HI_REG(1))) << 32) | REG_READ(TIMG_T1LO_REG(1));
+}
+
+static inline void IRAM_ATTR stepperTimerAlarm(uint64_t at)
+{
+    REG_WRITE(TIMG_T1ALARMLO_REG(1), static_cast<uint32_t>(at));
+    REG_WRITE(TIMG_T1ALARMHI_REG(1), static_cast<uint32_t>(at >> 32));
+    REG_SET_BIT(TIMG_T1CONFIG_REG(1), TIMG_T1_ALARM_EN);
+}
+
+static inline void IRAM_ATTR stepperTimerClear()
+{
+    REG_WRITE(TIMG_INT_CLR_TIMERS_REG(1), TIMG_T1_INT_CLR);
+}
+
+// Fixed STEPPER_INTERVAL_US tick handler
+void IRAM_ATTR TimerHandler(void *arg)
 {
     static bool toggle = false;
+    uint32_t start = cycleCount();
+
+    // the alarm reloads by itself, but has to be enabled again for the next tick
+    stepperTimerClear();
+    REG_SET_BIT(TIMG_T1CONFIG_REG(1), TIMG_T1_ALARM_EN);
 
     // Update the stepper motors
+    applyStepperCommand();
     step1.runStepper();
     step2.runStepper();
+    StepperState state = publishStepperState();
+
+    if (RECORD_ISR_STATS)
+        recordIsrCycles(cycleCount() - start, classifyTick(state));
 
     // Indicate that the ISR is running
-    digitalWrite(TOGGLE_PIN, toggle);
+    gpioWriteFast(TOGGLE_PIN, toggle);
     toggle = !toggle;
-    return true;
 }
 
-// Ultrasonic sensor stop
-bool ultrasonicStop()
+// One-shot alarm handler for STEPPER_EVENT_DRIVEN. Advances both motors by the real elapsed time and re-arms at the next edge
+void IRAM_ATTR EventTimerHandler(void *arg)
+{
+    static bool toggle = false;
+    static uint64_t lastEvent = 0;
+    uint32_t start = cycleCount();
+
+    stepperTimerClear();
+
+    uint64_t now = stepperTimerRead();
+    int32_t dt = static_cast<int32_t>(now - lastEvent);
+    lastEvent = now;
+
+    // Update the stepper motors
+    applyStepperCommand();
+    step1.advance(dt);
+    step2.advance(dt);
+    StepperState state = publishStepperState();
+
+    // Arm the alarm for whichever motor needs service first
+    int32_t next = step1.nextEventUs();
+    if (step2.nextEventUs() < next)
+        next = step2.nextEventUs();
+    if (next < STEPPER_MIN_ALARM_US)
+        next = STEPPER_MIN_ALARM_US;
+    stepperTimerAlarm(now + next);
+
+    if (RECORD_ISR_STATS)
+        recordIsrCycles(cycleCount() - start, classifyTick(state));
+
+    // Indicate that the ISR is running
+    gpioWriteFast(TOGGLE_PIN, toggle);
+    toggle = !toggle;
+}
+
+// Start the stepper interrupt on timer 1 of timer group 1 in the configured scheduling mode. It is allocated with
+// ESP_INTR_FLAG_IRAM, so it keeps stepping while flash writes disable the cache. The ESP32TimerInterrupt library and
+// the Arduino timer API allocate their interrupts without it
+bool startStepperTimer()
+{
+    timer_config_t config = {};
+    config.divider = 80; // 1 μs per count
+    config.counter_dir = TIMER_COUNT_UP;
+    config.counter_en = TIMER_PAUSE;
+    config.alarm_en = TIMER_ALARM_EN;
+    config.intr_type = TIMER_INTR_LEVEL;
+    config.auto_reload = STEPPER_EVENT_DRIVEN ? TIMER_AUTORELOAD_DIS : TIMER_AUTORELOAD_EN;
+
+    return timer_init(TIMER_GROUP_1, TIMER_1, &config) == ESP_OK &&
+           timer_set_counter_value(TIMER_GROUP_1, TIMER_1, 0) == ESP_OK &&
+           timer_set_alarm_value(TIMER_GROUP_1, TIMER_1, STEPPER_INTERVAL_US) == ESP_OK &&
+           timer_enable_intr(TIMER_GROUP_1, TIMER_1) == ESP_OK &&
+           timer_isr_register(TIMER_GROUP_1, TIMER_1, STEPPER_EVENT_DRIVEN ? EventTimerHandler : TimerHandler, nullptr,
+                              ESP_INTR_FLAG_IRAM, nullptr) == ESP_OK &&
+           timer_start(TIMER_GROUP_1, TIMER_1) == ESP_OK;
+}
+
+// Ultrasonic trigger pulse, run by ultrasonicTicker outside the control loop
+void triggerUltrasonic()
 {
-    digitalWrite(trigPin, LOW);
-    delayMicroseconds(2);
     digitalWrite(trigPin, HIGH);
-    delayMicroseconds(10);
+    delayMicroseconds(ULTRASONIC_TRIGGER_US);
     digitalWrite(trigPin, LOW);
-    duration = pulseIn(echoPin, HIGH);
-    distance = duration * 0.034 / 2;
-    // Serial.println(distance);
-    if (distance < 15)
-    {
+    ultrasonic.startPing(micros());
+}
 
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+void IRAM_ATTR ultrasonicEcho()
+{
+    ultrasonic.echoEdge(digitalRead(echoPin), micros());
 }
-// start Buzzer Task
+
+// start Buzzer Task. Only the buzzer task runs the melodies
 void startBuzzerTask(BuzzerTask *task, unsigned long currentMillis)
 {
-    currentBuzzerTask = task; // Set the currentBuzzerTask pointer to the provided task
-
     // Reset the task state to IDLE before starting or resuming
     task->state = IDLE;
 
@@ -89,16 +253,17 @@ void updateBuzzerTask(BuzzerTask *task, unsigned long currentMillis)
     }
 }
 
-// Check if the buzzer task is idle
-bool isBuzzerTaskIdle(BuzzerTask *task)
+// Ask the buzzer task to play a melody, or to stop with nullptr. Never blocks; the request is dropped if the queue
+// is full
+void requestBuzzer(BuzzerTask *task)
 {
-    return task->state == IDLE;
+    xQueueSend(buzzerRequests, &task, 0);
 }
 
-// Reset the buzzer task to idle
-void resetBuzzerToIdle(BuzzerTask *task)
+// Check if the buzzer is silent with no request waiting
+bool isBuzzerIdle()
 {
-    task->state == IDLE;
+    return buzzerIdle && uxQueueMessagesWaiting(buzzerRequests) == 0;
 }
 
 //if the pitch angle is stable
@@ -119,6 +284,8 @@ bool ifYawStable()
 
 void loopAutomatic(unsigned long currentMillis)
 {
+    static uint32_t turnMove = 0;
+
     switch (currentState)
     {
     case MOVING_FORWARD:
@@ -136,31 +303,34 @@ void loopAutomatic(unsigned long currentMillis)
 
     case STOPPED:
         // Code to stop the robot
-        // buzzer
-        // startBuzzerTask(&beat1, currentMillis);
         currentState = TURNING;
-        // target_angle = 1.57;
+        // turn 90 degrees to face the door
+        turnMove = startWheelTurn(PI / 2);
 
         break;
 
     case TURNING:
-        // Code to turn the robot 90 degrees
-        currentState = TURNED;
-        startBuzzerTask(&beat1, currentMillis);
+        if (isWheelTurnComplete(turnMove))
+        {
+            currentState = TURNED;
+            requestBuzzer(&beat1);
+        }
         break;
 
     case TURNED:
-        // currentBuzzerTask = &beat1;
-        if (isBuzzerTaskIdle(currentBuzzerTask))
+        if (isBuzzerIdle())
         {
-            currentBuzzerTask = nullptr;
             currentState = TURNING_BACK;
+            turnMove = startWheelTurn(-PI / 2);
         }
         break;
 
     case TURNING_BACK:
-        // Code to turn the robot back to its original direction
-        currentState = MOVING_FORWARD;
+        // turn back to the original direction
+        if (isWheelTurnComplete(turnMove))
+        {
+            currentState = MOVING_FORWARD;
+        }
         break;
 
     default:
@@ -197,6 +367,90 @@ void loopManual()
     }
 }
 
+// Analyse each full buffer of gyro samples handed over by feedImuSample()
+void spectrumTask(void *)
+{
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        gyroSpectrum.analyse(notch_count);
+    }
+}
+
+// Measure the IMU offsets from the first still window within timeoutMs, and store them. Returns false if the robot
+// did not keep still
+bool calibrateImu(unsigned long timeoutMs)
+{
+    unsigned long start = millis();
+    while (millis() - start < timeoutMs)
+    {
+        sensors_event_t a, g;
+        bool still = false;
+        if (IMU_FIFO_MODE)
+        {
+            ImuSample sample;
+            imu.poll();
+            while (!still && imu.pop(sample))
+            {
+                toEvents(sample, a, g);
+                still = stillWindow.observe(a, g);
+            }
+        }
+        else
+        {
+            sensors_event_t temp;
+            mpu.getEvent(&a, &g, &temp);
+            still = stillWindow.observe(a, g);
+            delay(1);
+        }
+
+        if (still && measureCalibration(calibration, stillWindow.getMean(), 1))
+        {
+            if (GYRO_TEMP_MODEL)
+                gyroModel.learn(stillWindow.getMean());
+            saveCalibration(CALIBRATION_NAMESPACE, calibration);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Store the balance offsets as soon as they are changed, and refreshed IMU offsets at most every CALIBRATION_SAVE_MS.
+// The balance task refreshes the offsets, so the write is of a copy
+void persistCalibration(unsigned long currentMillis)
+{
+    static unsigned long savedMs = 0;
+    bool tuned = calibration.pitchBias != bias || calibration.yawBias != yaw_bias ||
+                 calibration.cameraBias != camera_bias;
+    if (!tuned && !(calibrationDirty && (savedMs == 0 || currentMillis - savedMs >= CALIBRATION_SAVE_MS)))
+        return;
+
+    portENTER_CRITICAL(&imuStateLock);
+    calibration.pitchBias = bias;
+    calibration.yawBias = yaw_bias;
+    calibration.cameraBias = camera_bias;
+    Calibration snapshot = calibration;
+    calibrationDirty = false;
+    portEXIT_CRITICAL(&imuStateLock);
+
+    if (saveCalibration(CALIBRATION_NAMESPACE, snapshot))
+        savedMs = currentMillis;
+    else
+        calibrationDirty = true;
+}
+
+// Store what the gyro bias model has learned, at most every GYRO_MODEL_SAVE_MS
+void persistGyroModel(unsigned long currentMillis)
+{
+    if (!gyroModel.saveDue(currentMillis))
+        return;
+    static GyroTempData snapshot;
+    portENTER_CRITICAL(&imuStateLock);
+    snapshot = gyroModel.snapshot(currentMillis);
+    portEXIT_CRITICAL(&imuStateLock);
+    GyroTempModel::save(GYRO_MODEL_NAMESPACE, snapshot);
+}
+
 void setupSystem()
 {
     Serial.begin(115200);
@@ -207,7 +461,10 @@ void setupSystem()
 
     // ultrasonic sensor setup
     pinMode(trigPin, OUTPUT);
+    digitalWrite(trigPin, LOW);
     pinMode(echoPin, INPUT);
+    attachInterrupt(digitalPinToInterrupt(echoPin), ultrasonicEcho, CHANGE);
+    ultrasonicTicker.attach_ms(ULTRASONIC_PERIOD_MS, triggerUltrasonic);
 
     // wifi and server setup
     setupWifi();
@@ -224,55 +481,350 @@ void setupSystem()
     Serial.println("MPU6050 Found!");
     mpu.setAccelerometerRange(MPU6050_RANGE_2_G);
     mpu.setGyroRange(MPU6050_RANGE_250_DEG);
-    mpu.setFilterBandwidth(MPU6050_BAND_44_HZ);
+    mpu.setFilterBandwidth(IMU_DLPF_BANDWIDTH);
+    Wire.setClock(IMU_I2C_CLOCK_HZ);
 
-    if (!ITimer.attachInterruptInterval(STEPPER_INTERVAL_US, TimerHandler))
+    if (IMU_FIFO_MODE && !imu.begin(IMU_SAMPLE_RATE_HZ))
     {
-        Serial.println("Failed to start stepper interrupt");
+        Serial.println("Failed to start MPU6050 FIFO");
         while (1)
             delay(10);
     }
-    Serial.println("Initialised Interrupt for Stepper");
+    if (IMU_FIFO_MODE)
+    {
+        // the data ready interrupt needs INT wired to MPU_INT_PIN. Without it the FIFO is polled
+        delay(2 * IMU_READY_TIMEOUT_PERIODS * 1000 / IMU_SAMPLE_RATE_HZ);
+        imu.poll();
+        if (imu.isPolled())
+            Serial.println("No MPU6050 data ready interrupt on MPU_INT_PIN, polling the FIFO");
+    }
+    pitchRateFilter.configure(gyro_filter, gyro_filter_taps, GYRO_FILTER_RATIO);
+    yawRateFilter.configure(gyro_filter, gyro_filter_taps, GYRO_FILTER_RATIO);
+    if (GYRO_TEMP_MODEL)
+    {
+        Serial.println(gyroModel.load(GYRO_MODEL_NAMESPACE) ? "Loaded gyro bias model" : "No stored gyro bias model");
+        float celsius;
+        if (IMU_FIFO_MODE && imu.readTemperature(celsius))
+            gyroModel.setTemperature(celsius);
+    }
 
+    // a stored calibration starts balancing at once; otherwise wait briefly for the robot to be still
+    if (loadCalibration(CALIBRATION_NAMESPACE, calibration))
+    {
+        imuCalibrated = true;
+        bias = calibration.pitchBias;
+        yaw_bias = calibration.yawBias;
+        camera_bias = calibration.cameraBias;
+        Serial.println("Loaded IMU calibration");
+    }
+    else
+    {
+        imuCalibrated = calibrateImu(CALIBRATION_BOOT_MS);
+        Serial.println(imuCalibrated ? "Measured IMU calibration" : "IMU not still, calibrating later");
+    }
+    // below the web server, on the other core
+    xTaskCreatePinnedToCore(spectrumTask, "spectrum", 8192, nullptr, tskIDLE_PRIORITY + 1, &spectrumTaskHandle,
+                            NETWORK_CORE);
+
+    if (RUN_STEPPER_BENCH)
+    {
+        benchmarkDivide();
+        benchmarkSteppers();
+        benchmarkGpioWrites();
+        benchmarkSpectrum();
+    }
+
+    // before the ISR starts stepping, after which the motors are only set through stepperCommand
+    step1.setDDA(STEPPER_DDA);
+    step2.setDDA(STEPPER_DDA);
     step1.setAccelerationRad(10.0);
     step2.setAccelerationRad(10.0);
+    if (!startStepperTimer())
+    {
+        Serial.println("Failed to start stepper interrupt");
+        while (1)
+            delay(10);
+    }
+    Serial.println("Initialised Interrupt for Stepper");
 
     pinMode(STEPPER_EN, OUTPUT);
     digitalWrite(STEPPER_EN, false);
 }
 
+// Move the pitch rate notches to the peaks last published by the analyzer
+void retunePitchNotches()
+{
+    static uint32_t seen = 0;
+    if (gyroSpectrum.tuning.version() == seen)
+        return;
+
+    // overtaken by the analyzer's next write: try again next tick, when that one is complete
+    NotchTuning tuning;
+    if (!gyroSpectrum.tuning.read(tuning, seen))
+        return;
+    for (int n = 0; n < MAX_NOTCHES; n++)
+    {
+        if (tuning.freq[n] == 0)
+            pitchNotch[n].bypass();
+        else if (fabs(tuning.freq[n] - pitchNotchHz[n]) >= NOTCH_RETUNE_HZ)
+            pitchNotch[n].configureNotch(tuning.freq[n], NOTCH_Q, GYRO_SAMPLE_RATE_HZ);
+        else
+            continue;
+        pitchNotchHz[n] = tuning.freq[n];
+    }
+}
+
+// Reconfigure the decimators with the settings last published by the web handlers. The balance task pushes into
+// them, so only it may change them
+void reconfigureDecimators()
+{
+    static uint32_t seen = 0;
+    if (decimatorSettings.version() == seen)
+        return;
+
+    DecimatorSettings settings;
+    if (!decimatorSettings.read(settings, seen))
+        return;
+    pitchRateFilter.configure(settings.mode, settings.taps, GYRO_FILTER_RATIO);
+    yawRateFilter.configure(settings.mode, settings.taps, GYRO_FILTER_RATIO);
+}
+
+// Run one IMU sample through the calibration, the estimators, and their rates into the decimators. The pitch rate,
+// which the vertical loop's D term amplifies, passes through the vibration notches first
+void feedImuSample(sensors_event_t &a, sensors_event_t &g, uint32_t timestampUs, float forwardAccel)
+{
+    reconfigureDecimators();
+
+    // learn from the raw reading, then remove the offsets. Once they are known, they replace the attitude estimator's
+    // yaw bias heuristic
+    if (stillWindow.observe(a, g))
+    {
+        portENTER_CRITICAL(&imuStateLock);
+        if (GYRO_TEMP_MODEL)
+            gyroModel.learn(stillWindow.getMean());
+        if (measureCalibration(calibration, stillWindow.getMean(), imuCalibrated ? CALIBRATION_REFRESH_GAIN : 1))
+            imuCalibrated = calibrationDirty = true;
+        portEXIT_CRITICAL(&imuStateLock);
+        attitude.clearYawBias();
+    }
+    applyAccelCalibration(calibration, a);
+    if (GYRO_TEMP_MODEL && gyroModel.isTrained())
+        gyroModel.correct(g);
+    else
+        applyGyroCalibration(calibration, g);
+    float yawBiasGain = imuCalibrated || gyroModel.isTrained() ? 0 : ATTITUDE_YAW_BIAS_GAIN;
+
+    compensateLinearAccel(a, forwardAccel, pitch);
+    attitude.update(a, g, timestampUs, attitude_kp, attitude_ki, yawBiasGain);
+    pitchKalman.update(a, g, timestampUs, KALMAN_Q_ANGLE, KALMAN_Q_BIAS, KALMAN_R_ANGLE);
+
+    if (gyroSpectrum.push(g.gyro.y))
+        xTaskNotifyGive(spectrumTaskHandle);
+
+    float pitchRate = pitch_estimator == 1 ? pitchKalman.getPitchRate() : attitude.getPitchRate();
+    for (int n = 0; n < MAX_NOTCHES; n++)
+        pitchRate = pitchNotch[n].process(pitchRate);
+    pitchRateFilter.push(pitchRate);
+    yawRateFilter.push(attitude.getYawRate());
+}
+
+// Wheel speeds (rad/s) from the step edges, or the commanded speeds without MEASURED_WHEEL_VELOCITY
+void measureWheelSpeeds(const StepperState &state)
+{
+    if (MEASURED_WHEEL_VELOCITY)
+    {
+        StepEdge edges[VELOCITY_EDGES];
+        uint32_t count = step1.copyEdges(edges, VELOCITY_EDGES);
+        velocity1 = measureVelocity(edges, count, state.motor[0].clockUs, step1.STEP_ANGLE).speed;
+        count = step2.copyEdges(edges, VELOCITY_EDGES);
+        velcoity2 = measureVelocity(edges, count, state.motor[1].clockUs, step2.STEP_ANGLE).speed;
+    }
+    else
+    {
+        velocity1 = step1.getSpeedRad(state.motor[0]);
+        velcoity2 = step2.getSpeedRad(state.motor[1]);
+    }
+}
+
+// One inner loop tick, every LOOP_INTERVAL_INNER, with the velocity loop every LOOP_INTERVAL_OUTER. Runs in the
+// balance task, so it must not block: no serial output, no NVS, and the buzzer is only signalled
 void controlLoop()
 {
-    static unsigned long printTimer = 0;
-    static unsigned long loopTimer_inner = 0;
-    static unsigned long serverTimer = 0;
-    static unsigned long loopTimer_outter = 0;
-    static unsigned long controllerTimer = 0;
-    static unsigned long turnTimer = 0;
-    static unsigned long actionTimer = 0;
+    static unsigned long temperatureTimer = 0;
 
     static float vertical_output;
     static float velocity_output;
     static float turn_output;
-    static float yaw_drift;
-    static float current_target_angle;
     static float acc_input1;
     static float acc_input2;
+    static float velocity_target; // wheel speed target after obstacle braking (rad/s)
+    static bool lqrEngaged = false;
 
     unsigned long currentMillis = millis();
 
-    if (currentBuzzerTask != nullptr)
+    // the die warms slowly, so its temperature is read at a low rate. The FIFO driver owns the bus in this task
+    if (GYRO_TEMP_MODEL && IMU_FIFO_MODE && currentMillis - temperatureTimer >= TEMPERATURE_INTERVAL)
+    {
+        temperatureTimer = currentMillis;
+        float celsius;
+        if (imu.readTemperature(celsius))
+            gyroModel.setTemperature(celsius);
+    }
+
+    retunePitchNotches();
+
+    // feed every sample since the last tick, each with its own timestamp and without the acceleration commanded
+    // over that tick. Forward is negative wheel speed
+    sensors_event_t a, g;
+    float forward_accel = -wheel_accel * WHEEL_RADIUS * accel_comp_gain;
+    if (IMU_FIFO_MODE)
+    {
+        ImuSample sample;
+        imu.poll();
+        while (imu.pop(sample))
+        {
+            toEvents(sample, a, g);
+            feedImuSample(a, g, sample.timestampUs, forward_accel);
+        }
+    }
+    else
+    {
+        sensors_event_t temp;
+        mpu.getEvent(&a, &g, &temp);
+        if (GYRO_TEMP_MODEL)
+            gyroModel.setTemperature(temp.temperature);
+        feedImuSample(a, g, micros(), forward_accel);
+    }
+
+    // both estimators always run, so switching between them is bumpless
+    pitch = pitch_estimator == 1 ? pitchKalman.getPitch() : attitude.getPitch();
+    gyro_y = pitchRateFilter.output();
+
+    //turning loop
+    yaw = attitude.getYaw();
+    gyro_x = yawRateFilter.output();
+    turn_output = wheel_turning ? 0 : turn(gyro_x, yaw);
+
+    bool lqr = balance_controller == BALANCE_LQR;
+
+    if (outerTiming.due(micros(), static_cast<LoopPolicy>(loop_policy))) // velocity loop timer
     {
-        updateBuzzerTask(currentBuzzerTask, currentMillis);
+        measureWheelSpeeds(readStepperState());
+
+        // obstacle braking: cap the forward speed so the robot can stop at the standoff, from the speed the wheels
+        // have now. A sensor that has stopped answering stops the robot. Forward is negative wheel speed
+        RangeReading reading;
+        uint32_t nowUs = micros();
+        float allowed = 0;
+        float speed = -(velocity1 + velcoity2) / 2 * WHEEL_RADIUS;
+        if (ultrasonic.read(reading) && nowUs - reading.timeUs < ULTRASONIC_STALE_US)
+        {
+            obstacle.addRange(reading);
+            distance = reading.distance;
+            allowed = obstacle.allowedSpeed(nowUs, obstacle_standoff, obstacle_decel, speed);
+        }
+        float wanted = -target_velocity * WHEEL_RADIUS;
+        float forward = obstacle.limitSpeed(wanted, allowed, obstacle_decel, LOOP_INTERVAL_OUTER * 1e-3f, speed);
+        bool braking = forward < wanted;
+        velocity_target = braking ? -forward / WHEEL_RADIUS : target_velocity;
+        ultrasonic_flag = braking;
+
+        //velocity loop. The state feedback reads the wheels every tick instead
+        if (!lqr)
+            velocity_output = velocity(velocity_target, velocity1, velcoity2);
+        outerTiming.done(micros());
+    }
+
+    if (lqr)
+    {
+        // pitch from the balance pitch, and the wheels as they stand this tick. A positive balance output drives the
+        // wheels in the negative direction, so it is the negative of the acceleration
+        StepperState state = readStepperState();
+        measureWheelSpeeds(state);
+        int32_t steps = state.motor[0].position + state.motor[1].position;
+        if (!lqrEngaged)
+            balanceLqr.reset(steps);
+        lqrEngaged = true;
+        LqrGains gains = {lqr_k_pitch, lqr_k_rate, lqr_k_position, lqr_k_speed};
+        vertical_output = -balanceLqr.update(pitch - bias, gyro_y, steps, (velocity1 + velcoity2) / 2,
+                                             velocity_target, LOOP_INTERVAL_INNER * 1e-3f, step1.STEP_ANGLE, gains);
+    }
+    else
+    {
+        // back from the state feedback, the velocity loop starts again from rest
+        if (lqrEngaged)
+        {
+            velocityPid.reset();
+            velocity_output = 0;
+        }
+        lqrEngaged = false;
+
+        //vertical loop
+        vertical_output = vertical(bias + velocity_output, gyro_y);
+    }
+
+    //action on motor
+    acc_input1 = vertical_output + turn_output;
+    acc_input2 = vertical_output - turn_output;
+
+    // publish both motors' commands together so the ISR never mixes old and new values. The jerk and speed limits
+    // travel in them, so the ISR takes new ones on the same tick as the commands
+    step1.setJerkRad(wheel_jerk);
+    step2.setJerkRad(wheel_jerk);
+    step1.setMaxSpeedRad(wheel_speed_limit);
+    step2.setMaxSpeedRad(wheel_speed_limit);
+    StepperCommand command;
+    if (pitch > 0.6 || pitch < -0.6)
+    {
+        command.motor[0] = step1.commandRad(100, 0);
+        command.motor[1] = step2.commandRad(100, 0);
+        wheel_accel = 0;
+        lqrEngaged = false; // stood up again, the state feedback starts from where the wheels are then
+    }
+    else
+    {
+        // a positive balance output drives the wheels in the negative direction
+        command.motor[0] = step1.accelCommandRad(-acc_input1, wheel_speed_limit);
+        command.motor[1] = step2.accelCommandRad(-acc_input2, wheel_speed_limit);
+        wheel_accel = -(acc_input1 + acc_input2) / 2;
+    }
+    stepperCommand.write(command);
+}
+
+// Balance control at exact periods. Wakes every BALANCE_TICK_MS to drain the IMU in bursts, so a control tick only
+// waits on the samples since the last one, and runs controlLoop() every LOOP_INTERVAL_INNER. After a stall the
+// missed wakes come back to back, and loop_policy decides whether the control ticks do too
+void balanceTask(void *)
+{
+    TickType_t wake = xTaskGetTickCount();
+    while (true)
+    {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(BALANCE_TICK_MS));
+        if (IMU_FIFO_MODE)
+            imu.poll(IMU_BURST_SAMPLES);
+        if (!innerTiming.due(micros(), static_cast<LoopPolicy>(loop_policy)))
+            continue;
+
+        controlLoop();
+        innerTiming.done(micros());
     }
+}
 
-    if (currentMillis > controllerTimer)
+// Mode state machine every CONTROLLER_INTERVAL, and the NVS writes of what the balance task has learned
+void stateTask(void *)
+{
+    TickType_t wake = xTaskGetTickCount();
+    unsigned long persistTimer = 0;
+    while (true)
     {
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(CONTROLLER_INTERVAL));
+        if (!controllerTiming.due(micros(), static_cast<LoopPolicy>(loop_policy)))
+            continue;
+
+        unsigned long currentMillis = millis();
         switch (currentMode)
         {
         case AUTOMATIC:
-            // pinMode(STEPPER_EN, OUTPUT);
-            // digitalWrite(STEPPER_EN, false);
             loopAutomatic(currentMillis);
             break;
 
@@ -285,94 +837,74 @@ void controlLoop()
             loopManual();
             break;
         }
+        controllerTiming.done(micros());
 
-        // handle ultrasonic stop in low frequency
-        stop_flag = ultrasonicStop();
+        if (currentMillis - persistTimer >= TEMPERATURE_INTERVAL)
+        {
+            persistTimer = currentMillis;
+            if (GYRO_TEMP_MODEL)
+                persistGyroModel(currentMillis);
+            persistCalibration(currentMillis);
+        }
     }
+}
 
-    if (currentMillis > loopTimer_inner)
+// Melodies requested through buzzerRequests, and the obstacle alarm while the balance task reports braking
+void buzzerTask(void *)
+{
+    TickType_t wake = xTaskGetTickCount();
+    bool alarm = false;
+    BuzzerTask *current = nullptr;
+    while (true)
     {
-        loopTimer_inner += LOOP_INTERVAL_INNER;
-
-        sensors_event_t a, g, temp;
-        mpu.getEvent(&a, &g, &temp);
-        pitch = titltAngle(a, g);
+        vTaskDelayUntil(&wake, pdMS_TO_TICKS(BUZZER_INTERVAL_MS));
+        unsigned long currentMillis = millis();
 
-        //turning loop
-        yaw = yawAngle(a, g);
-        turn_output = turn(g.gyro.x, yaw);
-
-        if (currentMillis > loopTimer_outter)// velocity loop timer
+        // marked busy before a request leaves the queue, so isBuzzerIdle() never sees neither it nor its melody
+        BuzzerTask *request;
+        while (xQueuePeek(buzzerRequests, &request, 0) == pdTRUE)
         {
-            loopTimer_outter += LOOP_INTERVAL_OUTER;
-
-            //ultrasonic stop
-            stop_flag = ultrasonicStop();
-            if (stop_flag)
-            {
-                if (!ultrasonic_flag)
-                {
-                    last_target_velocity = target_velocity;
-                    startBuzzerTask(&alarm1, currentMillis);
-                    Serial.println("alarm1");
-                    ultrasonic_flag = true;
-                }
-                target_velocity = 0;
-            }
-            else if (ultrasonic_flag)
-            {
-                currentBuzzerTask = nullptr;
-                target_velocity = last_target_velocity;
-                ultrasonic_flag = false;
-                Serial.println("out");
-            }
-            
-            //velocity loop
-            velocity1 = step1.getSpeedRad();
-            velcoity2 = step2.getSpeedRad();
-            velocity_output = velocity(velocity1, velcoity2);
+            buzzerIdle = false;
+            xQueueReceive(buzzerRequests, &request, 0);
+            current = request;
+            if (current != nullptr)
+                startBuzzerTask(current, currentMillis);
         }
 
-        //vertical loop
-        vertical_output = vertical(bias + velocity_output, g.gyro.y);
-        
-        //action on motor
-        acc_input1 = vertical_output + turn_output;
-        acc_input2 = vertical_output - turn_output;
-
-        if (pitch > 0.6 || pitch < -0.6)
+        if (ultrasonic_flag && !alarm)
         {
-            step1.setTargetSpeedRad(0);
-            step2.setTargetSpeedRad(0);
-            step1.setAccelerationRad(100);
-            step2.setAccelerationRad(100);
+            current = &alarm1;
+            startBuzzerTask(current, currentMillis);
+            Serial.println("alarm1");
         }
-        else
+        else if (!ultrasonic_flag && alarm)
         {
-            step1.setAccelerationRad(acc_input1);
-            step2.setAccelerationRad(acc_input2);
-            if (acc_input1 > 0 && acc_input2 > 0)
-            {
-                step1.setTargetSpeedRad(-20);
-                step2.setTargetSpeedRad(-20);
-            }
-            else if (acc_input1 < 0 && acc_input2 < 0)
-            {
-                step1.setTargetSpeedRad(20);
-                step2.setTargetSpeedRad(20);
-            }
-            else if (acc_input1 > 0 && acc_input2 < 0)
-            {
-                step1.setTargetSpeedRad(-20);
-                step2.setTargetSpeedRad(20);
-            }
-            else if (acc_input1 < 0 && acc_input2 > 0)
-            {
-                step1.setTargetSpeedRad(20);
-                step2.setTargetSpeedRad(-20);
-            }
+            current = nullptr;
+            Serial.println("out");
         }
+        alarm = ultrasonic_flag;
+
+        if (current != nullptr)
+        {
+            updateBuzzerTask(current, currentMillis);
+            if (current->state == IDLE)
+                current = nullptr;
+        }
+        buzzerIdle = current == nullptr;
     }
 }
 
+// Start the control tasks. The balance task preempts the state task on its core; the buzzer runs on the other one
+// with the web server, so playing a melody takes no time from the control core
+void startTasks()
+{
+    buzzerRequests = xQueueCreate(BUZZER_QUEUE_LENGTH, sizeof(BuzzerTask *));
+    xTaskCreatePinnedToCore(balanceTask, "balance", BALANCE_TASK_STACK, nullptr, BALANCE_TASK_PRIORITY,
+                            &balanceTaskHandle, CONTROL_CORE);
+    xTaskCreatePinnedToCore(stateTask, "state", STATE_TASK_STACK, nullptr, STATE_TASK_PRIORITY, &stateTaskHandle,
+                            CONTROL_CORE);
+    xTaskCreatePinnedToCore(buzzerTask, "buzzer", BUZZER_TASK_STACK, nullptr, BUZZER_TASK_PRIORITY, &buzzerTaskHandle,
+                            NETWORK_CORE);
+}
+
 #endif // UTILS_H
@@ -0,0 +1,90 @@
+#ifndef WHEEL_VELOCITY_H
+#define WHEEL_VELOCITY_H
+
+#include <Arduino.h>
+#include <step.h>
+
+const uint32_t VELOCITY_EDGES = 48;         // step edges read per estimate, leaving the ISR headroom in the ring
+const uint32_t VELOCITY_WINDOW_US = 20000;  // regression window, back from the latest edge (μs)
+const uint32_t VELOCITY_STOPPED_US = 100000; // no step for this long reads as stopped (μs)
+
+// Wheel motion measured from step edges
+struct WheelVelocity
+{
+    float speed;      // (rad/s)
+    float accel;      // (rad/s/s)
+    uint32_t delayUs; // age of the measurement, time since the latest edge it is based on (μs)
+};
+
+// Fit position against time over the step edges in the window before the latest one, oldest first in edges, and
+// report speed and acceleration at the latest edge. A quadratic fit needs three edges, a line two. If the wheel has
+// gone longer without a step than the fitted speed allows, it can only be slower, so the speed is capped at one step
+// over the time since the last one
+WheelVelocity measureVelocity(const StepEdge *edges, uint32_t count, uint32_t nowUs, float stepAngle)
+{
+    WheelVelocity result = {0, 0, 0};
+    if (count == 0)
+        return result;
+
+    // an edge may land between copying the ring and reading the clock
+    const StepEdge &last = edges[count - 1];
+    int32_t signedGap = static_cast<int32_t>(nowUs - last.timeUs);
+    uint32_t gap = signedGap > 0 ? signedGap : 0;
+    result.delayUs = gap;
+    if (gap >= VELOCITY_STOPPED_US)
+        return result;
+
+    // Sums for the least squares fit, time in ms back from the latest edge and position in steps from it
+    float n = 0, st = 0, st2 = 0, st3 = 0, st4 = 0, sp = 0, stp = 0, st2p = 0;
+    for (uint32_t i = count; i-- > 0;)
+    {
+        uint32_t age = last.timeUs - edges[i].timeUs;
+        if (age > VELOCITY_WINDOW_US)
+            break;
+        float t = -static_cast<float>(age) * 1e-3f;
+        float p = static_cast<float>(edges[i].position - last.position);
+        n += 1;
+        st += t;
+        st2 += t * t;
+        st3 += t * t * t;
+        st4 += t * t * t * t;
+        sp += p;
+        stp += t * p;
+        st2p += t * t * p;
+    }
+
+    float speed = 0; // (steps/ms)
+    float accel = 0; // (steps/ms/ms)
+    float det = n * (st2 * st4 - st3 * st3) - st * (st * st4 - st2 * st3) + st2 * (st * st3 - st2 * st2);
+    if (n >= 3 && det != 0)
+    {
+        // p = c0 + c1 t + c2 t^2, solved by Cramer's rule
+        speed = (n * (stp * st4 - st3 * st2p) - sp * (st * st4 - st2 * st3) + st2 * (st * st2p - st2 * stp)) / det;
+        accel = 2 * (n * (st2 * st2p - st3 * stp) - st * (st * st2p - st2 * stp) + sp * (st * st3 - st2 * st2)) / det;
+    }
+    else if (n >= 2 && n * st2 != st * st)
+    {
+        // p = c0 + c1 t
+        speed = (n * stp - st * sp) / (n * st2 - st * st);
+    }
+    if (n < 2 && count >= 2)
+    {
+        // a single edge in the window, so time the last step period instead
+        uint32_t period = last.timeUs - edges[count - 2].timeUs;
+        speed = (last.position > edges[count - 2].position ? 1000.0f : -1000.0f) / (period > 0 ? period : 1);
+    }
+
+    // Low speed fallback
+    float bound = 1000.0f / (gap > 0 ? gap : 1);
+    if (speed > bound || speed < -bound)
+    {
+        speed = speed > 0 ? bound : -bound;
+        accel = 0;
+    }
+
+    result.speed = speed * 1e3f * stepAngle;
+    result.accel = accel * 1e6f * stepAngle;
+    return result;
+}
+
+#endif // WHEEL_VELOCITY_H
@@ -0,0 +1,23 @@
+#ifndef MOCK_ADAFRUIT_SENSOR_H
+#define MOCK_ADAFRUIT_SENSOR_H
+
+// Host stand-in for the sensor event the IMU code reads, with only the fields it uses
+
+#include <stdint.h>
+
+struct sensors_vec_t
+{
+    float x;
+    float y;
+    float z;
+};
+
+struct sensors_event_t
+{
+    sensors_vec_t acceleration; // (m/s/s)
+    sensors_vec_t gyro;         // (rad/s)
+    float temperature;          // (°C)
+    uint32_t timestamp;         // (ms)
+};
+
+#endif // MOCK_ADAFRUIT_SENSOR_H
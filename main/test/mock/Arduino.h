@@ -0,0 +1,49 @@
+#ifndef MOCK_ARDUINO_H
+#define MOCK_ARDUINO_H
+
+// Host stand-in for the parts of the Arduino core that the headers under test use. GPIO writes go nowhere and the
+// clock is the host's, so the motion code runs unchanged on the native env
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+#define PI 3.1415926535897932384626433832795
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define IRAM_ATTR
+
+template <typename T>
+T constrain(T x, T low, T high)
+{
+    return x < low ? low : (x > high ? high : x);
+}
+
+inline void pinMode(uint8_t, uint8_t)
+{
+}
+
+inline void digitalWrite(uint8_t, uint8_t)
+{
+}
+
+inline unsigned long micros()
+{
+    using namespace std::chrono;
+    return duration_cast<microseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+inline unsigned long millis()
+{
+    return micros() / 1000;
+}
+
+#endif // MOCK_ARDUINO_H
@@ -0,0 +1,70 @@
+#ifndef MOCK_PREFERENCES_H
+#define MOCK_PREFERENCES_H
+
+// Host stand-in for the ESP32 NVS Preferences library, kept in memory for the life of the process. Tests reach the
+// store through mockNvs() to empty it or damage what was written
+
+#include <stdint.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Stored blobs, keyed by namespace and key
+inline std::map<std::string, std::vector<uint8_t>> &mockNvs()
+{
+    static std::map<std::string, std::vector<uint8_t>> nvs;
+    return nvs;
+}
+
+class Preferences
+{
+
+public:
+    bool begin(const char *name, bool readOnly = false)
+    {
+        space = name;
+        return true;
+    }
+
+    void end()
+    {
+    }
+
+    size_t putBytes(const char *key, const void *value, size_t length)
+    {
+        const uint8_t *bytes = static_cast<const uint8_t *>(value);
+        mockNvs()[path(key)].assign(bytes, bytes + length);
+        return length;
+    }
+
+    size_t getBytes(const char *key, void *buffer, size_t length)
+    {
+        auto stored = mockNvs().find(path(key));
+        if (stored == mockNvs().end() || stored->second.size() > length)
+            return 0;
+        memcpy(buffer, stored->second.data(), stored->second.size());
+        return stored->second.size();
+    }
+
+    size_t getBytesLength(const char *key)
+    {
+        auto stored = mockNvs().find(path(key));
+        return stored == mockNvs().end() ? 0 : stored->second.size();
+    }
+
+    bool remove(const char *key)
+    {
+        return mockNvs().erase(path(key)) > 0;
+    }
+
+private:
+    std::string space;
+
+    std::string path(const char *key)
+    {
+        return space + "/" + key;
+    }
+};
+
+#endif // MOCK_PREFERENCES_H
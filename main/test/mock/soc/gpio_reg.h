@@ -0,0 +1,10 @@
+#ifndef MOCK_GPIO_REG_H
+#define MOCK_GPIO_REG_H
+
+// Indices into mockRegisters() for the output set and clear registers
+#define GPIO_OUT_W1TS_REG 0
+#define GPIO_OUT_W1TC_REG 1
+#define GPIO_OUT1_W1TS_REG 2
+#define GPIO_OUT1_W1TC_REG 3
+
+#endif // MOCK_GPIO_REG_H
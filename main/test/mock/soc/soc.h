@@ -0,0 +1,16 @@
+#ifndef MOCK_SOC_H
+#define MOCK_SOC_H
+
+#include <stdint.h>
+
+// GPIO registers as plain memory, so the stepper code's register writes cost what a store does
+inline volatile uint32_t *mockRegisters()
+{
+    static volatile uint32_t registers[4];
+    return registers;
+}
+
+#define REG_WRITE(reg, value) (mockRegisters()[(reg)] = (value))
+#define REG_READ(reg) (mockRegisters()[(reg)])
+
+#endif // MOCK_SOC_H
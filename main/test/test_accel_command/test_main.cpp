@@ -0,0 +1,169 @@
+// Wheel velocity latency of the balance loop's acceleration command: the old speed targets (setAccelerationRad(|a|)
+// and setTargetSpeedRad(+-wheel_speed_limit) by the sign of a, as controlLoop() set them) against ACCEL_MODE.
+// Commands go to the motor every LOOP_INTERVAL_INNER and the motor runs on the 20 μs fixed tick. The measured wheel
+// velocity, from the motor state the control loop reads, is compared with the commanded one: the lag that best
+// aligns them, and the error left after it
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <step.h>
+
+const int STEPPER_INTERVAL_US = 20;  // as config.h
+const int LOOP_INTERVAL_INNER = 8;   // (ms)
+const float WHEEL_SPEED_LIMIT = 20;  // (rad/s)
+const float FREQUENCY = 3;           // of the balance output (Hz)
+const float RUN_S = 4;
+const int TICKS_PER_LOOP = LOOP_INTERVAL_INNER * 1000 / STEPPER_INTERVAL_US;
+const int TICKS = static_cast<int>(RUN_S * 1e6 / STEPPER_INTERVAL_US);
+const int MAX_LAG_TICKS = 2 * TICKS_PER_LOOP;
+
+enum CommandPath
+{
+    SPEED_PATH, // the old four-way speed target chain
+    ACCEL_PATH, // accelCommandRad() through applyCommand()
+};
+
+struct Tracking
+{
+    float lagMs;    // shift of the commanded velocity that best matches the measured one (ms)
+    float rms;      // speed error after that shift (rad/s)
+    float rmsNoLag; // speed error without it (rad/s)
+};
+
+void command(step &motor, CommandPath path, float accel)
+{
+    if (path == ACCEL_PATH)
+    {
+        motor.applyCommand(motor.accelCommandRad(accel, WHEEL_SPEED_LIMIT));
+        return;
+    }
+    motor.setAccelerationRad(accel > 0 ? accel : -accel);
+    motor.setTargetSpeedRad(accel > 0 ? WHEEL_SPEED_LIMIT : -WHEEL_SPEED_LIMIT);
+}
+
+// Best shift of commanded against measured velocity, recorded every tick
+Tracking align(const float *commanded, const float *measured)
+{
+    Tracking tracking = {0, 1e9, 0};
+    for (int lag = 0; lag <= MAX_LAG_TICKS; lag++)
+    {
+        double squares = 0;
+        for (int i = MAX_LAG_TICKS; i < TICKS; i++)
+            squares += (measured[i] - commanded[i - lag]) * (measured[i] - commanded[i - lag]);
+        float rms = sqrt(squares / (TICKS - MAX_LAG_TICKS));
+        if (lag == 0)
+            tracking.rmsNoLag = rms;
+        if (rms < tracking.rms)
+        {
+            tracking.rms = rms;
+            tracking.lagMs = lag * STEPPER_INTERVAL_US * 1e-3;
+        }
+    }
+    return tracking;
+}
+
+float commanded[TICKS];
+float measured[TICKS];
+
+// Open loop: a sinusoidal balance output of peak accel (rad/s/s). The commanded velocity is its exact integral over
+// each loop interval
+Tracking openLoop(CommandPath path, float accel)
+{
+    step motor(STEPPER_INTERVAL_US, 2, 3);
+    double velocity = 0, output = 0;
+    for (int i = 0; i < TICKS; i++)
+    {
+        if (i % TICKS_PER_LOOP == 0)
+        {
+            output = accel * sin(2 * PI * FREQUENCY * i * STEPPER_INTERVAL_US * 1e-6);
+            command(motor, path, output);
+        }
+        motor.runStepper();
+        velocity += output * STEPPER_INTERVAL_US * 1e-6;
+        commanded[i] = velocity;
+        measured[i] = motor.getSpeedRad(motor.getState());
+    }
+    return align(commanded, measured);
+}
+
+// Closed loop: a velocity loop on the measured wheel velocity, feed forward of the reference's acceleration plus
+// gain (1/s) on the velocity error, tracks a sinusoidal reference of peak accel (rad/s/s)
+Tracking closedLoop(CommandPath path, float accel, float gain)
+{
+    step motor(STEPPER_INTERVAL_US, 2, 3);
+    double omega = 2 * PI * FREQUENCY;
+    for (int i = 0; i < TICKS; i++)
+    {
+        double t = i * STEPPER_INTERVAL_US * 1e-6;
+        double reference = accel / omega * (1 - cos(omega * t));
+        if (i % TICKS_PER_LOOP == 0)
+        {
+            double speed = motor.getSpeedRad(motor.getState());
+            double output = accel * sin(omega * t) + gain * (reference - speed);
+            command(motor, path, output);
+        }
+        motor.runStepper();
+        commanded[i] = reference;
+        measured[i] = motor.getSpeedRad(motor.getState());
+    }
+    return align(commanded, measured);
+}
+
+void report(const char *name, float accel, Tracking old, Tracking now)
+{
+    char message[160];
+    snprintf(message, sizeof(message),
+             "%-11s %4.0f rad/s/s  speed path lag %5.2f ms, rms %.4f (%.4f unshifted) | accel path lag %5.2f ms, "
+             "rms %.4f (%.4f unshifted) rad/s",
+             name, accel, old.lagMs, old.rms, old.rmsNoLag, now.lagMs, now.rms, now.rmsNoLag);
+    TEST_MESSAGE(message);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// The measured velocity of ACCEL_MODE trails the commanded one by no more than a speed update. The speed path applies
+// each command over up to a speed update before it arrived, so it barely lags but drifts from the commanded velocity
+void test_open_loop()
+{
+    const float ACCELS[] = {5, 50, 100};
+    for (float accel : ACCELS)
+    {
+        Tracking old = openLoop(SPEED_PATH, accel);
+        Tracking now = openLoop(ACCEL_PATH, accel);
+        report("open loop", accel, old, now);
+
+        TEST_ASSERT_TRUE(now.lagMs <= 1.0);
+        TEST_ASSERT_TRUE(now.rmsNoLag * 2 < old.rmsNoLag);
+    }
+}
+
+// With the velocity loop closed through the motor state, the feedback takes out the speed path's drift. Both then lag
+// by about a quarter of the loop interval, the sampling of the measured velocity, and ACCEL_MODE gains no latency
+void test_closed_loop()
+{
+    const float ACCELS[] = {5, 50};
+    for (float accel : ACCELS)
+    {
+        Tracking old = closedLoop(SPEED_PATH, accel, 20);
+        Tracking now = closedLoop(ACCEL_PATH, accel, 20);
+        report("closed loop", accel, old, now);
+
+        TEST_ASSERT_TRUE(fabs(now.lagMs - old.lagMs) <= 0.5);
+        TEST_ASSERT_TRUE(now.lagMs <= LOOP_INTERVAL_INNER / 2.0);
+        TEST_ASSERT_TRUE(now.rms <= old.rms * 1.25);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_open_loop);
+    RUN_TEST(test_closed_loop);
+    return UNITY_END();
+}
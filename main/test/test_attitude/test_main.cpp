@@ -0,0 +1,285 @@
+// Attitude and PitchKalman on synthetic IMU streams: pitch swings, a still robot with gyro bias, a turn while tilted,
+// and wheel acceleration steps with and without compensateLinearAccel(). Samples at 500 Hz with jittered timestamps
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <attitude.h>
+
+// From config.h
+const float KALMAN_Q_ANGLE = 0.001;
+const float KALMAN_Q_BIAS = 0.003;
+const float KALMAN_R_ANGLE = 0.03;
+const float ATTITUDE_KP = 2.5;
+const float ATTITUDE_KI = 0.05;
+
+const float SAMPLE_RATE_HZ = 500;
+const float JITTER_US = 200;   // sample time spread either side of the nominal period
+const float ACCEL_NOISE = 0.3; // accelerometer noise, standard deviation (m/s/s)
+const float SETTLE_S = 10;     // start of the error statistics
+const float FINAL_S = 10;      // length of the final window, for the residual error
+const float PI_F = 3.14159265f;
+
+enum Estimator
+{
+    MAHONY,
+    KALMAN
+};
+
+// The robot's motion at time t (s). Pitch about the axle, yaw about the vertical, forward acceleration of the axle
+struct Motion
+{
+    float pitch;        // (rad)
+    float pitchRate;    // (rad/s)
+    float yawRate;      // (rad/s)
+    float forwardAccel; // (m/s/s)
+};
+
+struct Scenario
+{
+    Motion (*motion)(float t);
+    float seconds;
+    float gyroBias[3]; // (rad/s)
+    float compGain;    // fraction of the forward acceleration given to compensateLinearAccel()
+    float swingHz;     // frequency of the pitch swing for the gain and phase, 0 for none
+};
+
+struct Result
+{
+    float residual; // mean pitch error over the last FINAL_S (rad)
+    float rms;      // pitch error (rad)
+    float peak;     // (rad)
+    float gain;     // of the pitch swing
+    float phaseDeg; // lead of the pitch swing
+    float yaw;      // final heading (rad)
+    float bias;     // final PitchKalman gyro bias (rad/s)
+};
+
+// Deterministic noise, so the bounds do not depend on the host's random number generator
+struct Noise
+{
+    uint32_t state = 12345;
+
+    float uniform()
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (1.0f / 16777216.0f);
+    }
+
+    // standard normal, from the sum of twelve uniforms
+    float normal()
+    {
+        float sum = 0;
+        for (int i = 0; i < 12; i++)
+            sum += uniform();
+        return sum - 6;
+    }
+};
+
+float swingAmplitude = 0.1;
+float swingHz = 1;
+
+Motion swing(float t)
+{
+    float w = 2 * PI_F * swingHz;
+    return {swingAmplitude * sinf(w * t), swingAmplitude * w * cosf(w * t), 0, 0};
+}
+
+Motion still(float t)
+{
+    return {0, 0, 0, 0};
+}
+
+// Held at 0.05 rad, turning 90 deg at 0.5 rad/s from 20 s
+Motion turnWhileTilted(float t)
+{
+    return {0.05f, 0, t >= 20 && t < 20 + PI_F ? 0.5f : 0, 0};
+}
+
+// Held at 0.05 rad through forward acceleration steps of +-3 m/s/s, 1 s each, from 10 s
+Motion accelSteps(float t)
+{
+    float accel = 0;
+    if (t >= 10)
+    {
+        int phase = static_cast<int>(t - 10) % 4;
+        accel = phase == 0 ? 3 : phase == 2 ? -3 : 0;
+    }
+    return {0.05f, 0, 0, accel};
+}
+
+Result simulate(Estimator which, const Scenario &scenario)
+{
+    Attitude attitude;
+    PitchKalman kalman;
+    Noise noise;
+    double sumFinal = 0, sumSquares = 0, sumSin = 0, sumCos = 0;
+    float peak = 0;
+    long count = 0, countFinal = 0;
+    float estimate = 0;
+    const float g = ATTITUDE_ONE_G;
+
+    long samples = static_cast<long>(scenario.seconds * SAMPLE_RATE_HZ);
+    for (long k = 0; k < samples; k++)
+    {
+        float timeUs = k * (1e6f / SAMPLE_RATE_HZ) + (noise.uniform() * 2 - 1) * JITTER_US;
+        float t = timeUs * 1e-6f;
+        Motion m = scenario.motion(t);
+
+        // Gravity along the tilted vertical x, forward acceleration along the tilted forward z
+        float c = cosf(m.pitch), s = sinf(m.pitch);
+        sensors_event_t a, gyro;
+        a.acceleration.x = g * c - m.forwardAccel * s + ACCEL_NOISE * noise.normal();
+        a.acceleration.y = ACCEL_NOISE * noise.normal();
+        a.acceleration.z = g * s + m.forwardAccel * c + ACCEL_NOISE * noise.normal();
+        gyro.gyro.x = m.yawRate * c + scenario.gyroBias[0];
+        gyro.gyro.y = m.pitchRate + scenario.gyroBias[1];
+        gyro.gyro.z = m.yawRate * s + scenario.gyroBias[2];
+
+        compensateLinearAccel(a, scenario.compGain * m.forwardAccel, estimate);
+        uint32_t timestampUs = static_cast<uint32_t>(timeUs + 1000);
+        if (which == MAHONY)
+        {
+            attitude.update(a, gyro, timestampUs, ATTITUDE_KP, ATTITUDE_KI, ATTITUDE_YAW_BIAS_GAIN);
+            estimate = attitude.getPitch();
+        }
+        else
+        {
+            kalman.update(a, gyro, timestampUs, KALMAN_Q_ANGLE, KALMAN_Q_BIAS, KALMAN_R_ANGLE);
+            estimate = kalman.getPitch();
+        }
+
+        if (t < SETTLE_S)
+            continue;
+        float error = estimate - m.pitch;
+        if (t >= scenario.seconds - FINAL_S)
+        {
+            sumFinal += error;
+            countFinal++;
+        }
+        sumSquares += error * error;
+        peak = fmaxf(peak, fabsf(error));
+        if (scenario.swingHz > 0)
+        {
+            sumSin += estimate * sin(2 * PI_F * scenario.swingHz * t);
+            sumCos += estimate * cos(2 * PI_F * scenario.swingHz * t);
+        }
+        count++;
+    }
+
+    Result result;
+    result.residual = sumFinal / countFinal;
+    result.rms = sqrt(sumSquares / count);
+    result.peak = peak;
+    float inPhase = 2 * sumSin / count, quadrature = 2 * sumCos / count;
+    result.gain = sqrt(inPhase * inPhase + quadrature * quadrature) / swingAmplitude;
+    result.phaseDeg = atan2(quadrature, inPhase) * 180 / PI_F;
+    result.yaw = attitude.getYaw();
+    result.bias = kalman.getBias();
+    return result;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Pitch swings at 0.5, 2 and 5 Hz with a gyro y bias: both estimators track with unity gain and little phase error,
+// and the Kalman filter has the lower error
+void test_pitch_swings()
+{
+    const float frequencies[] = {0.5, 2, 5};
+    for (float hz : frequencies)
+    {
+        swingHz = hz;
+        Scenario scenario = {swing, 70, {0, 0.03, 0}, 0, hz};
+        Result mahony = simulate(MAHONY, scenario);
+        Result kalman = simulate(KALMAN, scenario);
+
+        char message[160];
+        snprintf(message, sizeof(message),
+                 "%.1f Hz: Mahony rms %.4f rad gain %.3f phase %.2f deg, Kalman rms %.4f rad gain %.3f phase %.2f deg",
+                 hz, mahony.rms, mahony.gain, mahony.phaseDeg, kalman.rms, kalman.gain, kalman.phaseDeg);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, mahony.gain);
+        TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, kalman.gain);
+        TEST_ASSERT_FLOAT_WITHIN(2, 0, mahony.phaseDeg);
+        TEST_ASSERT_FLOAT_WITHIN(2, 0, kalman.phaseDeg);
+        TEST_ASSERT_LESS_THAN_FLOAT(0.01f, mahony.rms);
+        TEST_ASSERT_LESS_THAN_FLOAT(0.0035f, kalman.rms);
+        TEST_ASSERT_LESS_THAN_FLOAT(mahony.rms, kalman.rms);
+    }
+}
+
+// Still for 120 s with gyro bias on every axis: the bias is learned out of the pitch, and the yaw bias learner holds the
+// heading. The Mahony bias integral settles with a time constant of kp / ki, 50 s
+void test_still_with_gyro_bias()
+{
+    Scenario scenario = {still, 120, {0.02, 0.02, 0.02}, 0, 0};
+    Result mahony = simulate(MAHONY, scenario);
+    Result kalman = simulate(KALMAN, scenario);
+
+    char message[160];
+    snprintf(message, sizeof(message), "Mahony residual %.5f rms %.4f rad, yaw drift %.4f rad, Kalman residual %.5f rms %.4f rad",
+             mahony.residual, mahony.rms, mahony.yaw, kalman.residual, kalman.rms);
+    TEST_MESSAGE(message);
+
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0, mahony.residual);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0, kalman.residual);
+    TEST_ASSERT_LESS_THAN_FLOAT(0.005f, mahony.rms);
+    TEST_ASSERT_LESS_THAN_FLOAT(0.003f, kalman.rms);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 0, mahony.yaw);
+}
+
+// The Kalman filter's bias state settles on the gyro y bias
+void test_kalman_learns_gyro_bias()
+{
+    Scenario scenario = {still, 60, {0, 0.03, 0}, 0, 0};
+    Result kalman = simulate(KALMAN, scenario);
+    TEST_ASSERT_FLOAT_WITHIN(0.006f, 0.03f, kalman.bias);
+}
+
+// A 90 deg turn while tilted: the heading lands on it and the tilt is not disturbed
+void test_turn_while_tilted()
+{
+    Scenario scenario = {turnWhileTilted, 40, {0, 0, 0}, 0, 0};
+    Result mahony = simulate(MAHONY, scenario);
+    TEST_ASSERT_FLOAT_WITHIN(0.005f, PI_F / 2, mahony.yaw);
+    TEST_ASSERT_LESS_THAN_FLOAT(0.005f, mahony.peak);
+}
+
+// Wheel acceleration steps read as tilt without compensation, and are removed by it
+void test_linear_accel_compensation()
+{
+    Scenario uncompensated = {accelSteps, 50, {0, 0, 0}, 0, 0};
+    Scenario compensated = {accelSteps, 50, {0, 0, 0}, 1, 0};
+    const Estimator estimators[] = {MAHONY, KALMAN};
+    for (Estimator which : estimators)
+    {
+        Result off = simulate(which, uncompensated);
+        Result on = simulate(which, compensated);
+
+        char message[160];
+        snprintf(message, sizeof(message), "%s: gain 0 rms %.4f peak %.4f rad, gain 1 rms %.4f peak %.4f rad",
+                 which == MAHONY ? "Mahony" : "Kalman", off.rms, off.peak, on.rms, on.peak);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_GREATER_THAN_FLOAT(0.1f, off.rms);
+        TEST_ASSERT_LESS_THAN_FLOAT(which == MAHONY ? 0.002f : 0.003f, on.rms);
+        TEST_ASSERT_LESS_THAN_FLOAT(which == MAHONY ? 0.005f : 0.01f, on.peak);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_pitch_swings);
+    RUN_TEST(test_still_with_gyro_bias);
+    RUN_TEST(test_kalman_learns_gyro_bias);
+    RUN_TEST(test_turn_while_tilted);
+    RUN_TEST(test_linear_accel_compensation);
+    return UNITY_END();
+}
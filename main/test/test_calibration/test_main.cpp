@@ -0,0 +1,133 @@
+// The calibration blob in NVS: a round trip, and the cases loadCalibration() must refuse, leaving the calibration
+// it was given alone: an empty NVS, a CRC mismatch, a version bump and a layout change
+#include <unity.h>
+#include <calibration.h>
+
+const char *const SPACE = "calibration";
+
+Calibration measured()
+{
+    Calibration calibration = defaultCalibration(0.02f, -0.1f, 0.3f);
+    calibration.gyroOffset[0] = 0.011f;
+    calibration.gyroOffset[1] = -0.007f;
+    calibration.gyroOffset[2] = 0.003f;
+    calibration.accelOffsetY = 0.12f;
+    calibration.accelScale = 1.01f;
+    return calibration;
+}
+
+// What a refused load must leave untouched
+Calibration fallback()
+{
+    return defaultCalibration(0.05f, 0, 0);
+}
+
+void assertUnchanged(const Calibration &calibration)
+{
+    Calibration expected = fallback();
+    TEST_ASSERT_EQUAL_MEMORY(&expected, &calibration, sizeof(Calibration));
+}
+
+std::vector<uint8_t> &storedBlob()
+{
+    return mockNvs()[std::string(SPACE) + "/blob"];
+}
+
+void setUp()
+{
+    mockNvs().clear();
+}
+
+void tearDown()
+{
+}
+
+void test_crc32_check_value()
+{
+    const char *check = "123456789";
+    TEST_ASSERT_EQUAL_UINT32(0xCBF43926, crc32(reinterpret_cast<const uint8_t *>(check), 9));
+}
+
+void test_round_trip()
+{
+    Calibration saved = measured();
+    TEST_ASSERT_TRUE(saveCalibration(SPACE, saved));
+    Calibration loaded = fallback();
+    TEST_ASSERT_TRUE(loadCalibration(SPACE, loaded));
+    TEST_ASSERT_EQUAL_MEMORY(&saved, &loaded, sizeof(Calibration));
+}
+
+void test_empty_nvs()
+{
+    Calibration calibration = fallback();
+    TEST_ASSERT_FALSE(loadCalibration(SPACE, calibration));
+    assertUnchanged(calibration);
+}
+
+void test_crc_mismatch()
+{
+    Calibration saved = measured();
+    TEST_ASSERT_TRUE(saveCalibration(SPACE, saved));
+    // one bit of the pitch bias flipped in flash
+    storedBlob()[offsetof(Calibration, pitchBias)] ^= 0x04;
+    Calibration calibration = fallback();
+    TEST_ASSERT_FALSE(loadCalibration(SPACE, calibration));
+    assertUnchanged(calibration);
+}
+
+void test_version_bump()
+{
+    // an older firmware's blob, intact under its own CRC
+    Calibration saved = measured();
+    saved.version = CALIBRATION_VERSION - 1;
+    TEST_ASSERT_TRUE(saveCalibration(SPACE, saved));
+    Calibration calibration = fallback();
+    TEST_ASSERT_FALSE(loadCalibration(SPACE, calibration));
+    assertUnchanged(calibration);
+}
+
+void test_layout_change()
+{
+    // same version, but a field was removed without a bump
+    Calibration saved = measured();
+    TEST_ASSERT_TRUE(saveCalibration(SPACE, saved));
+    storedBlob().resize(sizeof(Calibration) - sizeof(float));
+    Calibration calibration = fallback();
+    TEST_ASSERT_FALSE(loadCalibration(SPACE, calibration));
+    assertUnchanged(calibration);
+
+    // or the size field disagrees
+    saved.size = sizeof(Calibration) + 4;
+    TEST_ASSERT_TRUE(saveCalibration(SPACE, saved));
+    TEST_ASSERT_FALSE(loadCalibration(SPACE, calibration));
+    assertUnchanged(calibration);
+}
+
+void test_implausible_accelerometer_is_not_measured()
+{
+    Calibration calibration = fallback();
+    // at rest, half a g
+    const float mean[6] = {0.01f, 0.01f, 0.01f, 0, 0, 0.5f * CALIBRATION_ONE_G};
+    TEST_ASSERT_FALSE(measureCalibration(calibration, mean, 1));
+    assertUnchanged(calibration);
+
+    // a plausible one is taken whole at weight 1
+    const float level[6] = {0.01f, -0.02f, 0.03f, 0, 0.1f, 1.02f * CALIBRATION_ONE_G};
+    TEST_ASSERT_TRUE(measureCalibration(calibration, level, 1));
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, -0.02f, calibration.gyroOffset[1]);
+    TEST_ASSERT_FLOAT_WITHIN(1e-6f, 0.1f, calibration.accelOffsetY);
+    TEST_ASSERT_FLOAT_WITHIN(1e-3f, 1 / 1.02f, calibration.accelScale);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_crc32_check_value);
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_empty_nvs);
+    RUN_TEST(test_crc_mismatch);
+    RUN_TEST(test_version_bump);
+    RUN_TEST(test_layout_change);
+    RUN_TEST(test_implausible_accelerometer_is_not_measured);
+    return UNITY_END();
+}
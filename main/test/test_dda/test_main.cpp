@@ -0,0 +1,126 @@
+// Step period error of the phase accumulator (setDDA) against the step period timer on the 20 μs fixed tick. At
+// constant speed, each step interval is compared with the ideal 1e6 / speed μs, and the achieved rate with the
+// commanded one
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <step.h>
+
+const int STEPPER_INTERVAL_US = 20; // as config.h
+const int32_t RUN_US = 2000000;
+const int32_t WARMUP_US = 100000;   // reach speed before measuring
+
+struct PeriodError
+{
+    float mean; // mean step interval less the ideal period (μs)
+    float rms;  // (μs)
+    float max;  // largest difference of a step interval from the ideal period (μs)
+    float rate; // achieved step rate (steps/s)
+};
+
+// Run one motor on the fixed tick at speed (steps/s), stepping by phase accumulator or step period timer
+PeriodError run(int32_t speed, bool dda)
+{
+    step motor(STEPPER_INTERVAL_US, 2, 3);
+    motor.setDDA(dda);
+    MotorCommand command = {1000000, speed * motor.SPEED_SCALE, 0, motor.MAX_SPEED * motor.SPEED_SCALE, SPEED_MODE};
+    motor.applyCommand(command);
+
+    double ideal = 1e6 / speed;
+    double total = 0, squares = 0, largest = 0;
+    int32_t nowUs = 0, firstStepUs = -1, lastStepUs = -1, position = 0, steps = 0;
+    while (nowUs < WARMUP_US + RUN_US)
+    {
+        motor.runStepper();
+        nowUs += STEPPER_INTERVAL_US;
+        if (motor.getPosition() == position)
+            continue;
+        position = motor.getPosition();
+        if (nowUs < WARMUP_US)
+            continue;
+
+        if (lastStepUs >= 0)
+        {
+            double error = (nowUs - lastStepUs) - ideal;
+            total += error;
+            squares += error * error;
+            largest = fmax(largest, fabs(error));
+            steps++;
+        }
+        else
+            firstStepUs = nowUs;
+        lastStepUs = nowUs;
+    }
+
+    PeriodError result = {0, 0, 0, 0};
+    if (steps > 0)
+    {
+        result.mean = total / steps;
+        result.rms = sqrt(squares / steps);
+        result.max = largest;
+        result.rate = steps * 1e6 / (lastStepUs - firstStepUs);
+    }
+    return result;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// 1k, 5k and 10k steps/s divide the tick, so both generators give the same edges with no error
+void test_tick_divisors()
+{
+    const int32_t speeds[] = {1000, 5000, 10000};
+    for (int32_t speed : speeds)
+    {
+        PeriodError timer = run(speed, false);
+        PeriodError dda = run(speed, true);
+
+        char message[96];
+        snprintf(message, sizeof(message), "%5d steps/s: timer max %.2f us, dda max %.2f us", speed, timer.max,
+                 dda.max);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_FLOAT_WITHIN(0.01, 0, timer.max);
+        TEST_ASSERT_FLOAT_WITHIN(0.01, 0, dda.max);
+        TEST_ASSERT_FLOAT_WITHIN(0.01, speed, timer.rate);
+        TEST_ASSERT_FLOAT_WITHIN(0.01, speed, dda.rate);
+    }
+}
+
+// Near 1k, 5k and 10k but off the tick, both keep the average rate exact: the timer carries the part of a step made
+// past each edge, as the phase accumulator does. Every edge of either stays within a tick of its ideal time
+void test_off_tick()
+{
+    const int32_t speeds[] = {1009, 5017, 7001, 9973};
+    TEST_MESSAGE("steps/s   timer mean / rms / max (us)  rate   | dda mean / rms / max (us)  rate");
+    for (int32_t speed : speeds)
+    {
+        PeriodError timer = run(speed, false);
+        PeriodError dda = run(speed, true);
+
+        char message[128];
+        snprintf(message, sizeof(message), "%7d   %6.2f / %4.1f / %4.1f  %8.2f | %6.2f / %4.1f / %4.1f  %8.2f", speed,
+                 timer.mean, timer.rms, timer.max, timer.rate, dda.mean, dda.rms, dda.max, dda.rate);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_FLOAT_WITHIN(0.02, 0, dda.mean);
+        TEST_ASSERT_FLOAT_WITHIN(speed * 1e-4, speed, dda.rate);
+        TEST_ASSERT_TRUE(dda.max <= STEPPER_INTERVAL_US);
+        TEST_ASSERT_TRUE(timer.max <= STEPPER_INTERVAL_US);
+        TEST_ASSERT_FLOAT_WITHIN(0.02, 0, timer.mean);
+        TEST_ASSERT_FLOAT_WITHIN(speed * 1e-4, speed, timer.rate);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_tick_divisors);
+    RUN_TEST(test_off_tick);
+    return UNITY_END();
+}
@@ -0,0 +1,107 @@
+// Event-driven stepper scheduling against the fixed tick over a speed sweep. The event-driven ISR re-arms its alarm
+// at nextEventUs(), no sooner than STEPPER_MIN_ALARM_US; the fixed tick runs every STEPPER_INTERVAL_US. For each,
+// count the interrupts per second and measure how far each step interval lands from the ideal period
+#include <unity.h>
+#include <stdio.h>
+#include <step.h>
+
+const int STEPPER_INTERVAL_US = 20;  // as config.h
+const int STEPPER_MIN_ALARM_US = 5;
+const int32_t RUN_US = 1000000;
+const int32_t WARMUP_US = 100000;    // reach speed before measuring
+
+struct Schedule
+{
+    uint32_t interrupts; // over RUN_US
+    uint32_t steps;
+    float meanError;     // mean step interval less the ideal period (μs)
+    uint32_t maxError;   // largest difference of a step interval from the ideal period (μs)
+};
+
+// Run one motor at speed (steps/s), event driven or on the fixed tick
+Schedule run(int32_t speed, bool eventDriven)
+{
+    step motor(STEPPER_INTERVAL_US, 2, 3);
+    MotorCommand command = {1000000, speed * motor.SPEED_SCALE, 0, motor.MAX_SPEED * motor.SPEED_SCALE, SPEED_MODE};
+    motor.applyCommand(command);
+
+    Schedule schedule = {0, 0, 0, 0};
+    double ideal = 1e6 / speed;
+    double errorTotal = 0;
+    int32_t nowUs = 0, lastStepUs = -1, position = 0;
+    while (nowUs < WARMUP_US + RUN_US)
+    {
+        int32_t dt = STEPPER_INTERVAL_US;
+        if (eventDriven)
+        {
+            dt = motor.nextEventUs();
+            if (dt < STEPPER_MIN_ALARM_US)
+                dt = STEPPER_MIN_ALARM_US;
+        }
+        nowUs += dt;
+        motor.advance(dt);
+        if (nowUs < WARMUP_US)
+        {
+            position = motor.getPosition();
+            continue;
+        }
+
+        schedule.interrupts++;
+        if (motor.getPosition() != position)
+        {
+            position = motor.getPosition();
+            if (lastStepUs >= 0)
+            {
+                double error = (nowUs - lastStepUs) - ideal;
+                errorTotal += error;
+                uint32_t size = static_cast<uint32_t>(fabs(error) + 0.5);
+                schedule.maxError = max(schedule.maxError, size);
+                schedule.steps++;
+            }
+            lastStepUs = nowUs;
+        }
+    }
+    schedule.meanError = schedule.steps > 0 ? errorTotal / schedule.steps : 0;
+    return schedule;
+}
+
+const int32_t SPEEDS[] = {100, 300, 500, 1000, 2000, 3000, 5000, 7000, 10000}; // (steps/s)
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_speed_sweep()
+{
+    TEST_MESSAGE("steps/s   interrupts/s fixed | event   step interval error mean / max (us) fixed | event");
+    for (int32_t speed : SPEEDS)
+    {
+        Schedule fixed = run(speed, false);
+        Schedule event = run(speed, true);
+
+        char message[128];
+        snprintf(message, sizeof(message), "%7d   %12u | %5u   %6.2f / %2u | %6.2f / %2u", speed, fixed.interrupts,
+                 event.interrupts, fixed.meanError, fixed.maxError, event.meanError, event.maxError);
+        TEST_MESSAGE(message);
+
+        // the same stepping rate
+        TEST_ASSERT_INT32_WITHIN(speed / 50 + 1, speed, fixed.steps);
+        TEST_ASSERT_INT32_WITHIN(speed / 50 + 1, speed, event.steps);
+        // one interrupt per step, plus one per speed update every MAX_SPEED_INTERVAL_US
+        TEST_ASSERT_LESS_OR_EQUAL(event.steps + 1000 + 2, event.interrupts);
+        // each edge within a μs of its period, against up to a tick on the fixed schedule
+        TEST_ASSERT_LESS_OR_EQUAL(2, event.maxError);
+        TEST_ASSERT_LESS_OR_EQUAL(STEPPER_INTERVAL_US, fixed.maxError);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_speed_sweep);
+    return UNITY_END();
+}
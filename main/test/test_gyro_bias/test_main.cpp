@@ -0,0 +1,139 @@
+// GyroTempModel's bias against temperature: the fit through the bins, the single-bin mean, the moving average of a
+// full bin, and the model's round trip through NVS
+#include <unity.h>
+#include <gyro_bias.h>
+
+// A gyro whose bias rises linearly with temperature, differently on each axis (rad/s)
+void lineBias(float celsius, float *bias)
+{
+    bias[0] = 0.010f + 0.0010f * (celsius - 25);
+    bias[1] = -0.020f + 0.0005f * (celsius - 25);
+    bias[2] = 0.005f - 0.0002f * (celsius - 25);
+}
+
+void setUp()
+{
+    mockNvs().clear();
+}
+
+void tearDown()
+{
+}
+
+void test_untrained_model_has_no_bias()
+{
+    GyroTempModel model;
+    TEST_ASSERT_FALSE(model.isTrained());
+    TEST_ASSERT_EQUAL_INT(0, model.getBins());
+    for (int axis = 0; axis < 3; axis++)
+        TEST_ASSERT_EQUAL_FLOAT(0, model.getBias(axis));
+}
+
+void test_single_bin_gives_its_mean()
+{
+    GyroTempModel model;
+    float bias[3];
+    lineBias(30, bias);
+    model.learn(30, bias);
+    // far from the bin, a single bin cannot give a slope
+    model.setTemperature(50);
+    TEST_ASSERT_TRUE(model.isTrained());
+    TEST_ASSERT_EQUAL_INT(1, model.getBins());
+    for (int axis = 0; axis < 3; axis++)
+        TEST_ASSERT_FLOAT_WITHIN(1e-6f, bias[axis], model.getBias(axis));
+}
+
+void test_fit_follows_a_linear_bias()
+{
+    GyroTempModel model;
+    float bias[3];
+    for (float celsius = 20; celsius <= 40; celsius += 4)
+    {
+        lineBias(celsius, bias);
+        model.learn(celsius, bias);
+    }
+    TEST_ASSERT_EQUAL_INT(6, model.getBins());
+
+    // between the bins and beyond them
+    const float temperatures[] = {31, 45, 10};
+    for (float celsius : temperatures)
+    {
+        model.setTemperature(celsius);
+        lineBias(celsius, bias);
+        for (int axis = 0; axis < 3; axis++)
+            TEST_ASSERT_FLOAT_WITHIN(1e-5f, bias[axis], model.getBias(axis));
+    }
+
+    // correct() removes it
+    sensors_event_t g = {};
+    g.gyro.x = bias[0] + 0.5f;
+    g.gyro.y = bias[1];
+    g.gyro.z = bias[2];
+    model.correct(g);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 0.5f, g.gyro.x);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 0, g.gyro.y);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 0, g.gyro.z);
+}
+
+void test_full_bin_keeps_adapting()
+{
+    GyroTempModel model;
+    float old[3] = {0.01f, 0.01f, 0.01f}, shifted[3] = {0.03f, 0.03f, 0.03f};
+    for (int i = 0; i < 1000; i++)
+        model.learn(25, old);
+    // an average over every window would barely move; a moving average over GYRO_BIN_MAX_WEIGHT follows the change
+    for (int i = 0; i < 4 * GYRO_BIN_MAX_WEIGHT; i++)
+        model.learn(25, shifted);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.03f, model.getBias(0));
+}
+
+void test_model_round_trips_through_nvs()
+{
+    GyroTempModel model;
+    float bias[3];
+    for (float celsius = 20; celsius <= 40; celsius += 10)
+    {
+        lineBias(celsius, bias);
+        model.learn(celsius, bias);
+    }
+    TEST_ASSERT_TRUE(model.saveDue(1000));
+    TEST_ASSERT_TRUE(GyroTempModel::save("gyro", model.snapshot(1000)));
+    TEST_ASSERT_FALSE(model.saveDue(2000));
+
+    GyroTempModel loaded;
+    TEST_ASSERT_TRUE(loaded.load("gyro"));
+    loaded.setTemperature(35);
+    model.setTemperature(35);
+    TEST_ASSERT_EQUAL_INT(3, loaded.getBins());
+    for (int axis = 0; axis < 3; axis++)
+        TEST_ASSERT_EQUAL_FLOAT(model.getBias(axis), loaded.getBias(axis));
+}
+
+void test_other_version_is_not_loaded()
+{
+    GyroTempModel model;
+    float bias[3] = {0.01f, 0.01f, 0.01f};
+    model.learn(25, bias);
+    GyroTempData data = model.snapshot(0);
+    data.version = GYRO_MODEL_VERSION + 1;
+    TEST_ASSERT_TRUE(GyroTempModel::save("gyro", data));
+
+    GyroTempModel loaded;
+    TEST_ASSERT_FALSE(loaded.load("gyro"));
+    TEST_ASSERT_FALSE(loaded.isTrained());
+    // and nothing at all
+    mockNvs().clear();
+    TEST_ASSERT_FALSE(loaded.load("gyro"));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_untrained_model_has_no_bias);
+    RUN_TEST(test_single_bin_gives_its_mean);
+    RUN_TEST(test_fit_follows_a_linear_bias);
+    RUN_TEST(test_full_bin_keeps_adapting);
+    RUN_TEST(test_model_round_trips_through_nvs);
+    RUN_TEST(test_other_version_is_not_loaded);
+    return UNITY_END();
+}
@@ -0,0 +1,139 @@
+// Jerk-limited S-curve of step::updateSpeedJerk() against the closed-form rest-to-cruise profile, and the speed limit
+// carried to the motor in MotorCommand. The motor runs on the 20 μs fixed tick; its speed and position are compared
+// with the profile every tick
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <step.h>
+
+const int STEPPER_INTERVAL_US = 20; // as config.h
+
+// Rest-to-cruise S-curve to v (steps/s) at acceleration up to a (steps/s/s) and jerk j (steps/s/s/s)
+struct SCurve
+{
+    double v, j;
+    double peak;  // highest acceleration reached, a or less if the jerk phases alone reach v (steps/s/s)
+    double ramp;  // duration of each jerk phase (s)
+    double hold;  // duration of the constant acceleration phase (s)
+
+    SCurve(double v, double a, double j) : v(v), j(j)
+    {
+        peak = v * j < a * a ? sqrt(v * j) : a;
+        ramp = peak / j;
+        hold = v / peak - ramp;
+    }
+
+    // Speed at t s
+    double speed(double t)
+    {
+        double end = 2 * ramp + hold;
+        if (t <= 0)
+            return 0;
+        if (t < ramp)
+            return j * t * t / 2;
+        if (t < ramp + hold)
+            return peak * ramp / 2 + peak * (t - ramp);
+        if (t < end)
+            return v - j * (end - t) * (end - t) / 2;
+        return v;
+    }
+};
+
+struct Deviation
+{
+    double speed;    // largest speed difference (steps/s)
+    double position; // largest position difference (steps)
+    double settled;  // time the motor first reached v (s)
+    double highest;  // highest speed (steps/s)
+};
+
+// Run one motor from rest to v with a and j, for twice the profile's duration
+Deviation follow(double v, double a, double j)
+{
+    step motor(STEPPER_INTERVAL_US, 2, 3);
+    MotorCommand command = {static_cast<int32_t>(a), static_cast<int32_t>(v * motor.SPEED_SCALE),
+                            static_cast<int32_t>(j), motor.MAX_SPEED * motor.SPEED_SCALE, SPEED_MODE};
+    motor.applyCommand(command);
+
+    SCurve profile(v, a, j);
+    int ticks = static_cast<int>(2 * (2 * profile.ramp + profile.hold) / (STEPPER_INTERVAL_US * 1e-6));
+    Deviation deviation = {0, 0, -1, 0};
+    double position = 0; // of the profile, integrated per μs
+    for (int i = 1; i <= ticks; i++)
+    {
+        for (int us = 0; us < STEPPER_INTERVAL_US; us++)
+            position += profile.speed(((i - 1) * STEPPER_INTERVAL_US + us + 0.5) * 1e-6) * 1e-6;
+        motor.runStepper();
+
+        double t = i * STEPPER_INTERVAL_US * 1e-6;
+        double speed = static_cast<double>(motor.getState().speed) / motor.SPEED_SCALE;
+        deviation.speed = fmax(deviation.speed, fabs(speed - profile.speed(t)));
+        deviation.position = fmax(deviation.position, fabs(motor.getPosition() - position));
+        deviation.highest = fmax(deviation.highest, speed);
+        if (deviation.settled < 0 && speed >= v)
+            deviation.settled = t;
+    }
+    return deviation;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Each profile's speed is followed to within what one MAX_SPEED_INTERVAL_US speed update moves it by, and its position
+// to within that speed error over the profile. The motor lands on the cruise speed without overshooting it, no
+// later than an update after the profile's end
+void test_profiles()
+{
+    const double PROFILES[][3] = {{5000, 2e4, 2e5}, {8000, 5e4, 1e5}, {1000, 3e4, 1e6}, {9000, 1e5, 5e5}};
+    TEST_MESSAGE("steps/s  accel  jerk   speed error (steps/s)  position error (steps)  settled / end (ms)");
+    for (const double *p : PROFILES)
+    {
+        double v = p[0], a = p[1], j = p[2];
+        SCurve profile(v, a, j);
+        double end = 2 * profile.ramp + profile.hold;
+        Deviation deviation = follow(v, a, j);
+
+        char message[128];
+        snprintf(message, sizeof(message), "%7.0f  %.0e  %.0e  %21.1f  %22.2f  %7.1f / %5.1f", v, a, j,
+                 deviation.speed, deviation.position, deviation.settled * 1e3, end * 1e3);
+        TEST_MESSAGE(message);
+
+        double update = 1e-3; // MAX_SPEED_INTERVAL_US (s)
+        TEST_ASSERT_TRUE(deviation.speed <= profile.peak * update + 1);
+        TEST_ASSERT_TRUE(deviation.position <= (profile.peak * update + 1) * end + 1);
+        TEST_ASSERT_TRUE(deviation.highest <= v);
+        TEST_ASSERT_TRUE(deviation.settled > 0 && deviation.settled <= end + update);
+    }
+}
+
+// The jerk-limited ramp stops at the command's speed limit rather than its target speed
+void test_speed_limit()
+{
+    step motor(STEPPER_INTERVAL_US, 2, 3);
+    motor.setJerkRad(1e6 * motor.STEP_ANGLE);
+    motor.setMaxSpeedRad(4000 * motor.STEP_ANGLE);
+    motor.applyCommand(motor.commandRad(1e5 * motor.STEP_ANGLE, 8000 * motor.STEP_ANGLE));
+    for (int i = 0; i < 50000; i++)
+        motor.runStepper();
+    TEST_ASSERT_INT32_WITHIN(motor.SPEED_SCALE, 4000 * motor.SPEED_SCALE, motor.getState().speed);
+
+    // lifted by the next command
+    motor.setMaxSpeedRad(100);
+    motor.applyCommand(motor.commandRad(1e5 * motor.STEP_ANGLE, 8000 * motor.STEP_ANGLE));
+    for (int i = 0; i < 50000; i++)
+        motor.runStepper();
+    TEST_ASSERT_INT32_WITHIN(motor.SPEED_SCALE, 8000 * motor.SPEED_SCALE, motor.getState().speed);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_profiles);
+    RUN_TEST(test_speed_limit);
+    return UNITY_END();
+}
@@ -0,0 +1,249 @@
+// BalanceLqr and the cascade of vertical() under velocity() balancing the nonlinear two-wheel pendulum lqr.py
+// linearizes, at its default geometry: pushes, a balance pitch that is off, a speed target and a mismodelled centre
+// of mass, each with a short and a long sensor delay. LQR is asserted to recover; the cascade is reported beside it
+#include <unity.h>
+#include <stdio.h>
+#include <deque>
+#include <utility>
+#include <pid_controller.h>
+#include <lqr.h>
+
+const double GRAVITY = 9.80665;
+const double SIM_DT = 1e-4;        // integration step (s)
+const int INNER_STEPS = 80;        // LOOP_INTERVAL_INNER, 8 ms
+const double OUTER_PERIOD = 0.01;  // LOOP_INTERVAL_OUTER (s)
+const double SIM_TIME = 6;         // (s)
+const float STEP_ANGLE = 2 * PI / 3200;
+const float MAX_ACCEL = 400;       // wheel acceleration command limit (rad/s/s)
+const float MAX_SPEED = 20;        // wheel speed limit (rad/s)
+const double FALLEN = 0.6;         // pitch the firmware treats as fallen (rad)
+const double SETTLED_PITCH = 0.01; // settled once pitch and wheel speed error stay within these (rad, rad/s)
+const double SETTLED_SPEED = 1.0;
+
+// Gains as config.h has them
+const LqrGains LQR_GAINS = {2194, 219.9, 27.36, 28.08};
+const float VERTICAL_KP = 200, VERTICAL_KD = 300;
+const float VELOCITY_KP = 0.03, VELOCITY_KI = 0.03 / 200;
+
+// lqr.py's default robot, and its pitch dynamics about the axle for a wheel acceleration u relative to the body,
+// D pitch'' = m g l sin(pitch) - N u
+struct Plant
+{
+    double D, N, mgl;
+
+    Plant(double comHeight)
+    {
+        const double bodyMass = 0.6, bodyHeight = 0.15, wheelMass = 0.1, radius = 0.034;
+        double bodyInertia = bodyMass * bodyHeight * bodyHeight / 12;
+        double wheelInertia = wheelMass * radius * radius / 2;
+        D = bodyInertia + bodyMass * (comHeight + radius) * (comHeight + radius) + wheelInertia +
+            wheelMass * radius * radius;
+        N = bodyMass * radius * (comHeight + radius) + wheelInertia + wheelMass * radius * radius;
+        mgl = bodyMass * GRAVITY * comHeight;
+    }
+};
+
+const double WHEEL_RADIUS = 0.034;
+
+enum Controller
+{
+    CASCADE,
+    LQR
+};
+
+struct Scenario
+{
+    double push;       // initial pitch rate (rad/s)
+    double pitchError; // balance pitch off by (rad)
+    float target;      // wheel speed target (rad/s)
+    double comHeight;  // of the simulated robot, against 0.05 m in the gains (m)
+    double delay;      // of the pitch and rate measurement (s)
+};
+
+struct Outcome
+{
+    bool fell;
+    double peakPitch;   // (rad)
+    double travel;      // furthest from where the target speed would have taken it (m)
+    double settled;     // time after which it stayed settled (s)
+    double finalSpeed;  // wheel speed at the end (rad/s)
+    double finalOffset; // distance from where the target speed would have taken it at the end (m)
+};
+
+Outcome simulate(Controller controller, const Scenario &scenario)
+{
+    Plant plant(scenario.comHeight);
+    double pitch = 0, rate = scenario.push, wheel = 0, wheelSpeed = 0, accel = 0;
+    Pid<float, PidDerivative, PidMeasuredRate> verticalPid;
+    Pid<float, PidErrorFilter, PidIntegral, PidIntegralClamp> velocityPid;
+    BalanceLqr lqr;
+    lqr.reset(0);
+    float velocityOutput = 0;
+    double outerDue = 0;
+    std::deque<std::pair<double, double>> measured; // pitch and rate, delayed
+    size_t delaySteps = static_cast<size_t>(scenario.delay / SIM_DT);
+
+    Outcome outcome = {false, 0, 0, 0, 0, 0};
+    for (int i = 0; i < static_cast<int>(SIM_TIME / SIM_DT); i++)
+    {
+        double t = i * SIM_DT;
+        measured.push_back(std::make_pair(pitch, rate));
+        while (measured.size() > delaySteps + 1)
+            measured.pop_front();
+
+        if (i % INNER_STEPS == 0)
+        {
+            float pitchMeasured = measured.front().first + scenario.pitchError;
+            float rateMeasured = measured.front().second;
+            float speed = wheelSpeed;
+            if (controller == CASCADE)
+            {
+                // as vertical() and velocity() in pid.h; the wheels accelerate against the output
+                if (t >= outerDue)
+                {
+                    outerDue += OUTER_PERIOD;
+                    PidGains<float> gains(VELOCITY_KP, VELOCITY_KI);
+                    gains.errorAlpha = 0.7;
+                    gains.integralMin = -0.1;
+                    gains.integralMax = 0.1;
+                    velocityOutput = velocityPid.update(scenario.target, speed, 1, gains);
+                }
+                accel = -verticalPid.update(velocityOutput, pitchMeasured, rateMeasured, OUTER_PERIOD * 1000,
+                                            PidGains<float>(VERTICAL_KP, 0, VERTICAL_KD));
+            }
+            else
+            {
+                int32_t steps = 2 * lround(wheel / STEP_ANGLE);
+                accel = lqr.update(pitchMeasured, rateMeasured, steps, speed, scenario.target, INNER_STEPS * SIM_DT,
+                                   STEP_ANGLE, LQR_GAINS);
+            }
+            accel = constrain(accel, -static_cast<double>(MAX_ACCEL), static_cast<double>(MAX_ACCEL));
+        }
+
+        double u = accel;
+        if ((wheelSpeed >= MAX_SPEED && u > 0) || (wheelSpeed <= -MAX_SPEED && u < 0))
+            u = 0;
+        rate += (plant.mgl * sin(pitch) - plant.N * u) / plant.D * SIM_DT;
+        pitch += rate * SIM_DT;
+        wheelSpeed += u * SIM_DT;
+        wheel += wheelSpeed * SIM_DT;
+
+        if (fabs(pitch) > FALLEN)
+        {
+            outcome.fell = true;
+            break;
+        }
+        double offset = WHEEL_RADIUS * (wheel + pitch) - scenario.target * WHEEL_RADIUS * t;
+        outcome.peakPitch = max(outcome.peakPitch, fabs(pitch));
+        outcome.travel = max(outcome.travel, fabs(offset));
+        if (fabs(pitch) > SETTLED_PITCH || fabs(wheelSpeed + rate - scenario.target) > SETTLED_SPEED)
+            outcome.settled = t;
+        outcome.finalSpeed = wheelSpeed;
+        outcome.finalOffset = offset;
+    }
+    return outcome;
+}
+
+void report(const char *name, const Scenario &scenario, const Outcome &outcome)
+{
+    char message[160];
+    snprintf(message, sizeof(message), "%-7s %.0f ms: %s peak %.3f rad, travel %.3f m, settled %.2f s, "
+             "end %.2f rad/s %.3f m", name, scenario.delay * 1e3, outcome.fell ? "FELL" : "up  ", outcome.peakPitch,
+             outcome.travel, outcome.settled, outcome.finalSpeed, outcome.finalOffset);
+    TEST_MESSAGE(message);
+}
+
+// Run both controllers at both delays, and return LQR's outcome at each
+void compare(Scenario scenario, Outcome *lqr)
+{
+    const double delays[] = {0.002, 0.006};
+    for (int d = 0; d < 2; d++)
+    {
+        scenario.delay = delays[d];
+        report("cascade", scenario, simulate(CASCADE, scenario));
+        lqr[d] = simulate(LQR, scenario);
+        report("lqr", scenario, lqr[d]);
+    }
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_push()
+{
+    const double pushes[] = {0.5, 1.5, 3.0};
+    for (double push : pushes)
+    {
+        char message[48];
+        snprintf(message, sizeof(message), "push of %.1f rad/s", push);
+        TEST_MESSAGE(message);
+        Outcome lqr[2];
+        compare({push, 0, 0, 0.05, 0}, lqr);
+        for (int d = 0; d < 2; d++)
+        {
+            TEST_ASSERT_FALSE(lqr[d].fell);
+            TEST_ASSERT_LESS_THAN(3, lqr[d].settled);
+            // rolled back to where it was pushed from
+            TEST_ASSERT_FLOAT_WITHIN(0.01f, 0, lqr[d].finalOffset);
+        }
+    }
+}
+
+void test_balance_pitch_error()
+{
+    // bias 0.02 rad off: the cascade leans on it and creeps, LQR holds station with a standing offset
+    Outcome lqr[2];
+    compare({0, 0.02, 0, 0.05, 0}, lqr);
+    for (int d = 0; d < 2; d++)
+    {
+        TEST_ASSERT_FALSE(lqr[d].fell);
+        TEST_ASSERT_FLOAT_WITHIN(0.05f, 0, lqr[d].finalSpeed);
+        TEST_ASSERT_FLOAT_WITHIN(0.1f, 0, lqr[d].finalOffset);
+    }
+}
+
+void test_speed_target()
+{
+    Outcome lqr[2];
+    compare({0, 0, 5, 0.05, 0}, lqr);
+    for (int d = 0; d < 2; d++)
+    {
+        TEST_ASSERT_FALSE(lqr[d].fell);
+        TEST_ASSERT_LESS_THAN(3, lqr[d].settled);
+        TEST_ASSERT_FLOAT_WITHIN(0.1f, 5, lqr[d].finalSpeed);
+    }
+}
+
+void test_mismodelled_centre_of_mass()
+{
+    // gains for 5 cm, on a robot with its centre of mass 30% lower and 40% higher
+    const double heights[] = {0.035, 0.07};
+    for (double height : heights)
+    {
+        char message[48];
+        snprintf(message, sizeof(message), "centre of mass %.0f mm, push of 1.5 rad/s", height * 1e3);
+        TEST_MESSAGE(message);
+        Outcome lqr[2];
+        compare({1.5, 0, 0, height, 0}, lqr);
+        for (int d = 0; d < 2; d++)
+        {
+            TEST_ASSERT_FALSE(lqr[d].fell);
+            TEST_ASSERT_LESS_THAN(SIM_TIME - 1, lqr[d].settled);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_push);
+    RUN_TEST(test_balance_pitch_error);
+    RUN_TEST(test_speed_target);
+    RUN_TEST(test_mismodelled_centre_of_mass);
+    return UNITY_END();
+}
@@ -0,0 +1,95 @@
+// Mailbox under a writer and a reader hammering it from two threads. Every field of a published value is derived
+// from one counter, so a copy mixing two writes is caught
+#include <unity.h>
+#include <stdio.h>
+#include <atomic>
+#include <thread>
+#include <mailbox.h>
+
+const uint32_t WRITES = 20000000;
+const int FIELDS = 12; // larger than StepperCommand, so a copy takes several stores
+
+struct Block
+{
+    uint32_t field[FIELDS];
+};
+
+Mailbox<Block> mailbox;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_reader_never_sees_a_torn_value()
+{
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        Block block;
+        for (uint32_t n = 1; n <= WRITES; n++)
+        {
+            for (int i = 0; i < FIELDS; i++)
+                block.field[i] = n * (i + 1);
+            mailbox.write(block);
+        }
+        done.store(true);
+    });
+
+    uint32_t reads = 0, retries = 0, torn = 0, backwards = 0;
+    uint32_t lastCount = 0, lastVersion = 0;
+    while (!done.load())
+    {
+        Block block;
+        uint32_t version;
+        if (!mailbox.read(block, version))
+        {
+            retries++;
+            continue;
+        }
+        reads++;
+        uint32_t n = block.field[0];
+        for (int i = 1; i < FIELDS; i++)
+            torn += block.field[i] != n * (i + 1);
+        // the version counts writes, so it names the value
+        torn += version != n;
+        backwards += n < lastCount || version < lastVersion;
+        lastCount = n;
+        lastVersion = version;
+    }
+    writer.join();
+
+    char message[128];
+    snprintf(message, sizeof(message), "%u writes, %u consistent reads, %u retries, %u torn, %u out of order", WRITES,
+             reads, retries, torn, backwards);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_EQUAL_UINT32(0, torn);
+    TEST_ASSERT_EQUAL_UINT32(0, backwards);
+    TEST_ASSERT_GREATER_THAN(0, reads);
+
+    Block last;
+    uint32_t version;
+    TEST_ASSERT_TRUE(mailbox.read(last, version));
+    TEST_ASSERT_EQUAL_UINT32(WRITES, version);
+    TEST_ASSERT_EQUAL_UINT32(WRITES, last.field[0]);
+}
+
+void test_empty_mailbox_reads_zero()
+{
+    Mailbox<Block> empty;
+    Block block;
+    uint32_t version = 1;
+    TEST_ASSERT_TRUE(empty.read(block, version));
+    TEST_ASSERT_EQUAL_UINT32(0, version);
+    TEST_ASSERT_EQUAL_UINT32(0, block.field[0]);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_empty_mailbox_reads_zero);
+    RUN_TEST(test_reader_never_sees_a_torn_value);
+    return UNITY_END();
+}
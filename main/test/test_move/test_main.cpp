@@ -0,0 +1,183 @@
+// Position moves through the ISR path: a StepperMove written to its mailbox is started by both motors on the next
+// tick, and the published StepperState carries its version once started. Each move must reach its target exactly,
+// never pass it, and be reported complete only once both motors have stopped
+#include <unity.h>
+#include <stdio.h>
+#include <step.h>
+#include <mailbox.h>
+
+const int STEPPER_INTERVAL_US = 20;  // as config.h
+const float TURN_MOVE_SPEED = 4.0;   // (rad/s)
+const float TURN_MOVE_ACCEL = 20.0;  // (rad/s/s)
+
+// As in config.h
+struct StepperMove
+{
+    MotorMove motor[2];
+};
+
+struct StepperState
+{
+    MotorState motor[2];
+    uint32_t moveVersion;
+};
+
+// The stepper ISR and its control loop side, as in utils.h
+struct Steppers
+{
+    step step1{STEPPER_INTERVAL_US, 2, 3};
+    step step2{STEPPER_INTERVAL_US, 4, 5};
+    Mailbox<StepperMove> stepperMove;
+    Mailbox<StepperState> stepperState;
+    uint32_t appliedMove = 0;
+
+    void tick()
+    {
+        StepperMove move;
+        uint32_t version;
+        if (stepperMove.version() != appliedMove && stepperMove.read(move, version))
+        {
+            step1.startMove(move.motor[0]);
+            step2.startMove(move.motor[1]);
+            appliedMove = version;
+        }
+        step1.runStepper();
+        step2.runStepper();
+        StepperState state;
+        state.motor[0] = step1.getState();
+        state.motor[1] = step2.getState();
+        state.moveVersion = appliedMove;
+        stepperState.write(state);
+    }
+
+    uint32_t moveSteppers(const MotorMove &move1, const MotorMove &move2)
+    {
+        StepperMove move;
+        move.motor[0] = move1;
+        move.motor[1] = move2;
+        stepperMove.write(move);
+        return stepperMove.version();
+    }
+
+    bool isMoveComplete(uint32_t version)
+    {
+        StepperState state;
+        uint32_t read;
+        while (!stepperState.read(state, read))
+        {
+        }
+        return state.moveVersion == version && !state.motor[0].moving && !state.motor[1].moving;
+    }
+};
+
+struct MoveResult
+{
+    int32_t end[2];     // positions once complete (steps)
+    int32_t furthest[2]; // largest distance from the start reached in the move's direction (steps)
+    float seconds;      // time to complete (s)
+    bool completed;
+};
+
+// Run opposite moves of steps on the two motors at speed and accel until reported complete, for at most 10 s
+MoveResult runMove(Steppers &steppers, int32_t steps, float speed, float accel)
+{
+    int32_t start[2] = {steppers.step1.getPosition(), steppers.step2.getPosition()};
+    uint32_t version = steppers.moveSteppers(steppers.step1.moveCommand(steps, speed, accel),
+                                             steppers.step2.moveCommand(-steps, speed, accel));
+    // not complete before the ISR has started it, although the last move's motors are stopped
+    TEST_ASSERT_FALSE(steppers.isMoveComplete(version));
+
+    MoveResult result = {{0, 0}, {0, 0}, 0, false};
+    int ticks = 0;
+    for (; ticks < 10000000 / STEPPER_INTERVAL_US && !result.completed; ticks++)
+    {
+        steppers.tick();
+        int32_t moved[2] = {steppers.step1.getPosition() - start[0], -(steppers.step2.getPosition() - start[1])};
+        for (int m = 0; m < 2; m++)
+        {
+            int32_t along = steps >= 0 ? moved[m] : -moved[m];
+            result.furthest[m] = along > result.furthest[m] ? along : result.furthest[m];
+        }
+        result.completed = steppers.isMoveComplete(version);
+    }
+    result.end[0] = steppers.step1.getPosition() - start[0];
+    result.end[1] = -(steppers.step2.getPosition() - start[1]);
+    result.seconds = ticks * STEPPER_INTERVAL_US * 1e-6;
+    return result;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Turns of a step to several revolutions at the in-place turn speed, and faster, both ways, one after another
+void test_moves()
+{
+    const int32_t STEPS[] = {1, 7, 100, 3200, -3200, 12800, -1};
+    const float SPEEDS[][2] = {{TURN_MOVE_SPEED, TURN_MOVE_ACCEL}, {15, 100}};
+    Steppers steppers;
+    for (const float *speed : SPEEDS)
+    {
+        for (int32_t steps : STEPS)
+        {
+            MoveResult result = runMove(steppers, steps, speed[0], speed[1]);
+
+            char message[128];
+            snprintf(message, sizeof(message), "%6d steps at %4.1f rad/s: ends %6d / %6d, furthest %6d / %6d, %.3f s",
+                     steps, speed[0], result.end[0], result.end[1], result.furthest[0], result.furthest[1],
+                     result.seconds);
+            TEST_MESSAGE(message);
+
+            TEST_ASSERT_TRUE(result.completed);
+            int32_t distance = steps >= 0 ? steps : -steps;
+            for (int m = 0; m < 2; m++)
+            {
+                TEST_ASSERT_EQUAL_INT32(steps, result.end[m]);
+                TEST_ASSERT_LESS_OR_EQUAL(distance, result.furthest[m]);
+            }
+            // stopped, so nothing more moves
+            for (int i = 0; i < 1000; i++)
+                steppers.tick();
+            TEST_ASSERT_EQUAL_INT32(0, steppers.step1.getState().speed);
+        }
+    }
+}
+
+// An absolute move lands on its target position from wherever the motor is
+void test_absolute()
+{
+    Steppers steppers;
+    runMove(steppers, 1234, TURN_MOVE_SPEED, TURN_MOVE_ACCEL);
+    uint32_t version = steppers.moveSteppers(steppers.step1.moveToCommand(-500, TURN_MOVE_SPEED, TURN_MOVE_ACCEL),
+                                             steppers.step2.moveToCommand(0, TURN_MOVE_SPEED, TURN_MOVE_ACCEL));
+    for (int i = 0; i < 10000000 / STEPPER_INTERVAL_US && !steppers.isMoveComplete(version); i++)
+        steppers.tick();
+    TEST_ASSERT_TRUE(steppers.isMoveComplete(version));
+    TEST_ASSERT_EQUAL_INT32(-500, steppers.step1.getPosition());
+    TEST_ASSERT_EQUAL_INT32(0, steppers.step2.getPosition());
+}
+
+// A move with no speed or acceleration completes at once without moving
+void test_empty()
+{
+    Steppers steppers;
+    MoveResult result = runMove(steppers, 500, 0, TURN_MOVE_ACCEL);
+    TEST_ASSERT_TRUE(result.completed);
+    TEST_ASSERT_EQUAL_INT32(0, result.end[0]);
+    result = runMove(steppers, 500, TURN_MOVE_SPEED, 0);
+    TEST_ASSERT_TRUE(result.completed);
+    TEST_ASSERT_EQUAL_INT32(0, result.end[0]);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_moves);
+    RUN_TEST(test_absolute);
+    RUN_TEST(test_empty);
+    return UNITY_END();
+}
@@ -0,0 +1,330 @@
+// The ultrasonic echo state machine fed edge timings, including timeouts and edges from crosstalk, the median range
+// read() makes of the pulse widths it publishes, and the braking built on it: the closing speed fit, the allowed
+// speed, the slewed speed limit, and a drive up to a wall
+#include <unity.h>
+#include <stdio.h>
+#include <obstacle.h>
+
+const uint32_t ECHO_DELAY_US = 450; // from the end of the trigger to the echo pin rising, as an HC-SR04 does
+
+// A ping with an echo from range (cm), starting at nowUs
+void ping(Ultrasonic &sensor, uint32_t nowUs, float range)
+{
+    sensor.startPing(nowUs);
+    uint32_t riseUs = nowUs + ECHO_DELAY_US;
+    sensor.echoEdge(true, riseUs);
+    sensor.echoEdge(false, riseUs + static_cast<uint32_t>(range * ULTRASONIC_US_PER_CM));
+}
+
+RangeReading latest(Ultrasonic &sensor)
+{
+    RangeReading reading = {0, 0, 0};
+    TEST_ASSERT_TRUE(sensor.read(reading));
+    return reading;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_echo_width_gives_the_range()
+{
+    Ultrasonic sensor;
+    RangeReading reading;
+    TEST_ASSERT_FALSE(sensor.read(reading));
+
+    ping(sensor, 1000, 120);
+    reading = latest(sensor);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 120, reading.distance);
+    TEST_ASSERT_EQUAL_UINT32(1000, reading.timeUs);
+    TEST_ASSERT_EQUAL_UINT32(1, reading.count);
+    TEST_ASSERT_EQUAL_UINT32(0, sensor.getTimeouts());
+    TEST_ASSERT_EQUAL_UINT32(0, sensor.getStray());
+
+    // the sensor's own no-echo pulse reads as nothing in range
+    sensor.startPing(60000);
+    sensor.echoEdge(true, 60000 + ECHO_DELAY_US);
+    sensor.echoEdge(false, 60000 + ECHO_DELAY_US + ULTRASONIC_MAX_ECHO_US + 10000);
+    reading = latest(sensor);
+    TEST_ASSERT_EQUAL_UINT32(2, reading.count);
+    // median of 120 and 400, the nearer
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 120, reading.distance);
+}
+
+// The interrupt only passes on widths: read() converts the median width, and reading again changes nothing
+void test_read_converts_the_median_width()
+{
+    Ultrasonic sensor;
+    const uint32_t widths[] = {1160, ULTRASONIC_MAX_ECHO_US + 5000, 2320};
+    uint32_t nowUs = 0;
+    for (uint32_t width : widths)
+    {
+        sensor.startPing(nowUs);
+        sensor.echoEdge(true, nowUs + ECHO_DELAY_US);
+        sensor.echoEdge(false, nowUs + ECHO_DELAY_US + width);
+        nowUs += ULTRASONIC_PERIOD_MS * 1000;
+    }
+
+    RangeReading first = latest(sensor), second = latest(sensor);
+    TEST_ASSERT_EQUAL_FLOAT(2320 / ULTRASONIC_US_PER_CM, first.distance);
+    TEST_ASSERT_EQUAL_UINT32(3, first.count);
+    TEST_ASSERT_EQUAL_UINT32(2 * ULTRASONIC_PERIOD_MS * 1000, first.timeUs);
+    TEST_ASSERT_EQUAL_FLOAT(first.distance, second.distance);
+    TEST_ASSERT_EQUAL_UINT32(first.count, second.count);
+
+    // nothing echoing twice more puts the no-echo pulse in the middle
+    for (int i = 0; i < 2; i++)
+    {
+        sensor.startPing(nowUs);
+        sensor.echoEdge(true, nowUs + ECHO_DELAY_US);
+        sensor.echoEdge(false, nowUs + ECHO_DELAY_US + ULTRASONIC_MAX_ECHO_US);
+        nowUs += ULTRASONIC_PERIOD_MS * 1000;
+    }
+    TEST_ASSERT_EQUAL_FLOAT(ULTRASONIC_MAX_RANGE, latest(sensor).distance);
+}
+
+void test_median_rejects_a_single_outlier()
+{
+    Ultrasonic sensor;
+    const float ranges[] = {80, 81, 20, 79, 80};
+    uint32_t nowUs = 0;
+    for (float range : ranges)
+    {
+        ping(sensor, nowUs, range);
+        nowUs += ULTRASONIC_PERIOD_MS * 1000;
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 80, latest(sensor).distance);
+}
+
+void test_ping_without_an_echo_times_out()
+{
+    Ultrasonic sensor;
+    sensor.startPing(0);
+    sensor.startPing(50000);
+    TEST_ASSERT_EQUAL_UINT32(1, sensor.getTimeouts());
+    RangeReading reading;
+    TEST_ASSERT_FALSE(sensor.read(reading));
+
+    // the second one answers
+    sensor.echoEdge(true, 50000 + ECHO_DELAY_US);
+    sensor.echoEdge(false, 50000 + ECHO_DELAY_US + 50 * 58);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 50, latest(sensor).distance);
+    TEST_ASSERT_EQUAL_UINT32(1, sensor.getTimeouts());
+}
+
+void test_late_rise_is_stray()
+{
+    // a late echo of an earlier ping, rising after the rise timeout
+    Ultrasonic sensor;
+    sensor.startPing(0);
+    sensor.echoEdge(true, ULTRASONIC_RISE_TIMEOUT_US + 1);
+    sensor.echoEdge(false, ULTRASONIC_RISE_TIMEOUT_US + 1 + 100 * 58);
+    TEST_ASSERT_EQUAL_UINT32(2, sensor.getStray());
+    RangeReading reading;
+    TEST_ASSERT_FALSE(sensor.read(reading));
+}
+
+void test_crosstalk_is_ignored()
+{
+    Ultrasonic sensor;
+    // another sensor's pulse while idle
+    sensor.echoEdge(true, 100);
+    sensor.echoEdge(false, 3000);
+    TEST_ASSERT_EQUAL_UINT32(2, sensor.getStray());
+
+    // a glitch shorter than the blind zone ends the wait for this ping's echo
+    sensor.startPing(10000);
+    sensor.echoEdge(true, 10000 + ECHO_DELAY_US);
+    sensor.echoEdge(false, 10000 + ECHO_DELAY_US + ULTRASONIC_MIN_ECHO_US - 1);
+    TEST_ASSERT_EQUAL_UINT32(3, sensor.getStray());
+    RangeReading reading;
+    TEST_ASSERT_FALSE(sensor.read(reading));
+
+    // a second rise within a pulse is stray, and the pulse is still timed from the first
+    ping(sensor, 60000, 70);
+    sensor.startPing(110000);
+    sensor.echoEdge(true, 110000 + ECHO_DELAY_US);
+    sensor.echoEdge(true, 110000 + ECHO_DELAY_US + 1000);
+    sensor.echoEdge(false, 110000 + ECHO_DELAY_US + 70 * 58);
+    TEST_ASSERT_EQUAL_UINT32(4, sensor.getStray());
+    reading = latest(sensor);
+    TEST_ASSERT_EQUAL_UINT32(2, reading.count);
+    TEST_ASSERT_FLOAT_WITHIN(0.05f, 70, reading.distance);
+}
+
+void test_closing_speed_and_prediction()
+{
+    // a wall approaching at 0.5 m/s, one reading per ping
+    ObstacleBrake brake;
+    uint32_t nowUs = 0;
+    for (uint32_t count = 1; count <= 10; count++)
+    {
+        RangeReading reading = {200 - 50 * nowUs * 1e-6f, nowUs, count};
+        brake.addRange(reading);
+        // repeats of a reading are not new ranges
+        brake.addRange(reading);
+        nowUs += ULTRASONIC_PERIOD_MS * 1000;
+    }
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.5f, brake.getClosingSpeed());
+
+    // carried forward past the median's lag to the present
+    uint32_t lastUs = nowUs - ULTRASONIC_PERIOD_MS * 1000;
+    float expected = 2 - 0.5f * (lastUs * 1e-6f + 0.02f + OBSTACLE_MEDIAN_LAG);
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, expected, brake.getRange(lastUs + 20000));
+    TEST_ASSERT_FLOAT_WITHIN(0.01f, expected / 0.5f, brake.getTimeToCollision(lastUs + 20000));
+}
+
+void test_jump_or_nothing_in_range_restarts_the_fit()
+{
+    ObstacleBrake brake;
+    uint32_t count = 0;
+    for (uint32_t nowUs = 0; nowUs < 500000; nowUs += 50000)
+        brake.addRange({150 - 50 * nowUs * 1e-6f, nowUs, ++count});
+    TEST_ASSERT_TRUE(brake.getClosingSpeed() > 0.4f);
+
+    // someone steps in front
+    brake.addRange({60, 500000, ++count});
+    TEST_ASSERT_EQUAL_FLOAT(0, brake.getClosingSpeed());
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, 0.6f, brake.getRange(500000 - OBSTACLE_MEDIAN_LAG * 1e6f));
+
+    // and leaves
+    brake.addRange({ULTRASONIC_MAX_RANGE, 550000, ++count});
+    TEST_ASSERT_EQUAL_FLOAT(0, brake.getClosingSpeed());
+    TEST_ASSERT_FLOAT_WITHIN(0.001f, ULTRASONIC_MAX_RANGE * 0.01f, brake.getRange(600000));
+    TEST_ASSERT_TRUE(brake.getTimeToCollision(600000) < 0);
+}
+
+void test_allowed_speed_stops_at_the_standoff()
+{
+    ObstacleBrake brake;
+    const float standoff = 0.15f, decel = 0.3f;
+    // read back at the median's lag after it was measured, so the range is the one measured
+    uint32_t measuredUs = OBSTACLE_MEDIAN_LAG * 1e6f;
+    brake.addRange({100, measuredUs, 1});
+    uint32_t nowUs = 0;
+
+    // the ramp down from the allowed target, and OBSTACLE_RESPONSE at the wheels' speed, cover the room to the standoff
+    const float speeds[] = {0, 0.3f, 0.6f};
+    for (float speed : speeds)
+    {
+        float allowed = brake.allowedSpeed(nowUs, standoff, decel, speed);
+        float covered = allowed * allowed / (2 * decel) + OBSTACLE_RESPONSE * speed;
+        TEST_ASSERT_FLOAT_WITHIN(1e-4f, 1 - standoff, covered);
+    }
+
+    // inside the standoff, stop
+    brake.addRange({10, measuredUs + 50000, 2});
+    TEST_ASSERT_EQUAL_FLOAT(0, brake.allowedSpeed(nowUs, standoff, decel, 0));
+}
+
+void test_speed_limit_never_steps_down()
+{
+    ObstacleBrake brake;
+    const float decel = 0.3f, dt = 0.01f;
+    float command = brake.limitSpeed(0.5f, 10, decel, dt, 0.5f);
+    TEST_ASSERT_EQUAL_FLOAT(0.5f, command);
+
+    // an obstacle found late allows nothing, but the command falls at OBSTACLE_EMERGENCY_FACTOR times decel
+    int ticks = 0;
+    while (command > 0)
+    {
+        float next = brake.limitSpeed(0.5f, 0, decel, dt, 0.5f);
+        TEST_ASSERT_FLOAT_WITHIN(1e-5f, max(command - OBSTACLE_EMERGENCY_FACTOR * decel * dt, 0.0f), next);
+        command = next;
+        ticks++;
+    }
+    TEST_ASSERT_INT32_WITHIN(1, 0.5f / (OBSTACLE_EMERGENCY_FACTOR * decel * dt), ticks);
+
+    // backing away is never limited
+    TEST_ASSERT_EQUAL_FLOAT(-0.2f, brake.limitSpeed(-0.2f, 0, decel, dt, 0));
+}
+
+void test_speed_limit_starts_from_the_wheels()
+{
+    // the wheels are still speeding up to the last command when an obstacle appears: the command drops to where they
+    // are at once, and falls from there
+    ObstacleBrake brake;
+    const float decel = 0.3f, dt = 0.01f;
+    brake.limitSpeed(0.5f, 10, decel, dt, 0.1f);
+    float command = brake.limitSpeed(0.5f, 0, decel, dt, 0.2f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, 0.2f - OBSTACLE_EMERGENCY_FACTOR * decel * dt, command);
+
+    // and keeps falling from the last command once the wheels are above it
+    float next = brake.limitSpeed(0.5f, 0, decel, dt, 0.2f);
+    TEST_ASSERT_FLOAT_WITHIN(1e-5f, command - OBSTACLE_EMERGENCY_FACTOR * decel * dt, next);
+}
+
+// Start 2 m from a wall wanting 0.5 m/s. Pings every ULTRASONIC_PERIOD_MS and the velocity loop every 10 ms as in
+// controlLoop(), with the wheels' speed following the loop's target with a time constant of response (s). Gives the
+// distance it stopped at, the closest it came and its final speed
+void driveUpToAWall(float response, float &stopped, float &closest, float &speed)
+{
+    const float standoff = 0.15f, decel = 0.3f, wanted = 0.5f, dt = 0.01f;
+    Ultrasonic sensor;
+    ObstacleBrake brake;
+    float position = 0, wall = 2, command = wanted;
+    speed = 0;
+    closest = wall;
+    for (uint32_t nowUs = 0; nowUs < 15000000; nowUs += 1000)
+    {
+        if (nowUs % (ULTRASONIC_PERIOD_MS * 1000) == 0)
+            ping(sensor, nowUs, (wall - position) * 100);
+        if (nowUs % 10000 == 0)
+        {
+            RangeReading reading;
+            float allowed = 0;
+            if (sensor.read(reading))
+            {
+                brake.addRange(reading);
+                allowed = brake.allowedSpeed(nowUs, standoff, decel, speed);
+            }
+            command = brake.limitSpeed(wanted, allowed, decel, dt, speed);
+        }
+        speed += (command - speed) * 1e-3f / response;
+        position += speed * 1e-3f;
+        closest = min(closest, wall - position);
+    }
+    stopped = wall - position;
+}
+
+void test_drive_up_to_a_wall()
+{
+    // the cascade's response, which OBSTACLE_RESPONSE is, and the quicker state feedback's
+    const float responses[] = {OBSTACLE_RESPONSE, 0.35f};
+    for (float response : responses)
+    {
+        float stopped, closest, speed;
+        driveUpToAWall(response, stopped, closest, speed);
+
+        char message[112];
+        snprintf(message, sizeof(message),
+                 "response %.2f s: stopped %.3f m from the wall, closest %.3f m, speed %.4f m/s", response, stopped,
+                 closest, speed);
+        TEST_MESSAGE(message);
+        TEST_ASSERT_FLOAT_WITHIN(0.005f, 0, speed);
+        TEST_ASSERT_FLOAT_WITHIN(0.01f, 0.15f, stopped);
+        TEST_ASSERT_FLOAT_WITHIN(0.01f, 0.15f, closest);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_echo_width_gives_the_range);
+    RUN_TEST(test_read_converts_the_median_width);
+    RUN_TEST(test_median_rejects_a_single_outlier);
+    RUN_TEST(test_ping_without_an_echo_times_out);
+    RUN_TEST(test_late_rise_is_stray);
+    RUN_TEST(test_crosstalk_is_ignored);
+    RUN_TEST(test_closing_speed_and_prediction);
+    RUN_TEST(test_jump_or_nothing_in_range_restarts_the_fit);
+    RUN_TEST(test_allowed_speed_stops_at_the_standoff);
+    RUN_TEST(test_speed_limit_never_steps_down);
+    RUN_TEST(test_speed_limit_starts_from_the_wheels);
+    RUN_TEST(test_drive_up_to_a_wall);
+    return UNITY_END();
+}
@@ -0,0 +1,304 @@
+// The Pid instances in config.h against the hand-written vertical(), velocity() and turn() they replaced, bit for
+// bit over random inputs, the other features on small cases, and the cost of an update of each. pid.h needs config.h,
+// so the loops are restated here with the globals they read, at representative gains
+#include <unity.h>
+#include <stdio.h>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <pid_controller.h>
+
+const int LOOP_INTERVAL_OUTER = 10;
+const float VELOCITY_ERROR_ALPHA = 0.7;
+const float VELOCITY_INTEGRAL_LIMIT = 0.1;
+
+float pitch;
+float vertical_kp = 200, vertical_kd = 300;
+float velocity_kp = 0.03, velocity_ki = 0.03 / 200;
+float turn_kp = -0.5, turn_kd = -1;
+float camera_kp = 0.02, camera_kd = 0.01;
+float cam_rho, cam_theta, target_angle;
+bool tracking;
+
+// The loops as pid.h had them, state in function statics
+__attribute__((noinline)) float handVertical(float angle_input, float gyro_y)
+{
+    float output;
+    static float last_angle_input;
+    float angle_input_d = (angle_input - last_angle_input) / LOOP_INTERVAL_OUTER;
+    last_angle_input = angle_input;
+
+    output = (angle_input - pitch) * vertical_kp + (angle_input_d - gyro_y) * vertical_kd;
+    return output;
+}
+
+__attribute__((noinline)) float handVelocity(float target, float step1_velocity, float step2_velocity)
+{
+    static float output;
+    static float velocity_err;
+    static float velocity_err_last;
+    const float a = 0.7; // low pass filter coefficient
+    static float velocity_err_integ;
+
+    velocity_err = target - (step1_velocity + step2_velocity) / 2;
+    velocity_err = (1 - a) * velocity_err + a * velocity_err_last;
+    velocity_err_last = velocity_err;
+    velocity_err_integ += velocity_err;
+
+    if (velocity_err_integ > 0.1)
+    {
+        velocity_err_integ = 0.1;
+    }
+    if (velocity_err_integ < -0.1)
+    {
+        velocity_err_integ = -0.1;
+    }
+    if (pitch > 0.6 || pitch < -0.6)
+    {
+        velocity_err_integ = 0;
+    }
+    output = velocity_kp * velocity_err + velocity_ki * velocity_err_integ;
+    return output;
+}
+
+__attribute__((noinline)) float handTurn(float gyro_x, float yaw)
+{
+    static float output;
+    if (tracking)
+    {
+        output = (cam_rho + cam_theta) * camera_kp + gyro_x * camera_kd;
+        cam_rho = 0;
+        cam_theta = 0;
+    }
+    else
+    {
+        output = (target_angle - yaw) * turn_kp - gyro_x * turn_kd;
+    }
+    return output;
+}
+
+// The loops as pid.h has them, on the instances declared in config.h
+typedef Pid<float, PidDerivative, PidMeasuredRate> VerticalPid;
+typedef Pid<float, PidErrorFilter, PidIntegral, PidIntegralClamp> VelocityPid;
+typedef Pid<float, PidDerivativeOnMeasurement, PidMeasuredRate> HeadingPid;
+
+VerticalPid verticalPid;
+VelocityPid velocityPid;
+HeadingPid headingPid;
+HeadingPid cameraPid;
+
+__attribute__((noinline)) float vertical(float angle_input, float gyro_y)
+{
+    return verticalPid.update(angle_input, pitch, gyro_y, LOOP_INTERVAL_OUTER,
+                              PidGains<float>(vertical_kp, 0, vertical_kd));
+}
+
+__attribute__((noinline)) float velocity(float target, float step1_velocity, float step2_velocity)
+{
+    PidGains<float> gains(velocity_kp, velocity_ki);
+    gains.errorAlpha = VELOCITY_ERROR_ALPHA;
+    gains.integralMin = -VELOCITY_INTEGRAL_LIMIT;
+    gains.integralMax = VELOCITY_INTEGRAL_LIMIT;
+    float output = velocityPid.update(target, (step1_velocity + step2_velocity) / 2, 1, gains);
+    if (pitch > 0.6 || pitch < -0.6)
+    {
+        velocityPid.resetIntegral();
+    }
+    return output;
+}
+
+__attribute__((noinline)) float turn(float gyro_x, float yaw)
+{
+    if (tracking)
+    {
+        float output = cameraPid.update(cam_rho + cam_theta, 0, -gyro_x, 1, PidGains<float>(camera_kp, 0, camera_kd));
+        cam_rho = 0;
+        cam_theta = 0;
+        return output;
+    }
+    return headingPid.update(target_angle, yaw, gyro_x, 1, PidGains<float>(turn_kp, 0, turn_kd));
+}
+
+const int SAMPLES = 100000;
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_loops_match_the_hand_written_ones()
+{
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    int verticalMismatches = 0, velocityMismatches = 0, turnMismatches = 0, upright = 0;
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        pitch = 0.7f * uniform(rng);
+        float setpoint = 0.12f + 0.05f * uniform(rng), gyro = uniform(rng);
+        float speed1 = 5 * uniform(rng), speed2 = 5 * uniform(rng), target = 3 * uniform(rng);
+        verticalMismatches += handVertical(setpoint, gyro) != vertical(setpoint, gyro);
+
+        // the hand-written loop clears the integral before its output, the Pid after; a fallen robot's output is
+        // not used either way
+        bool fallen = pitch > 0.6 || pitch < -0.6;
+        float hand = handVelocity(target, speed1, speed2), pid = velocity(target, speed1, speed2);
+        if (!fallen)
+        {
+            upright++;
+            velocityMismatches += hand != pid;
+        }
+
+        tracking = i % 3 == 0;
+        float rho = uniform(rng), theta = uniform(rng), yaw = uniform(rng);
+        target_angle = uniform(rng);
+        cam_rho = rho;
+        cam_theta = theta;
+        hand = handTurn(gyro, yaw);
+        cam_rho = rho;
+        cam_theta = theta;
+        turnMismatches += hand != turn(gyro, yaw);
+    }
+    TEST_ASSERT_EQUAL_INT(0, verticalMismatches);
+    TEST_ASSERT_GREATER_THAN(SAMPLES / 2, upright);
+    TEST_ASSERT_EQUAL_INT(0, velocityMismatches);
+    TEST_ASSERT_EQUAL_INT(0, turnMismatches);
+}
+
+void test_state_is_only_what_the_features_need()
+{
+    TEST_ASSERT_EQUAL_INT(1, sizeof(HeadingPid));  // PD on a measured rate: none
+    TEST_ASSERT_EQUAL_INT(4, sizeof(VerticalPid)); // PD on the error: the last setpoint
+    TEST_ASSERT_EQUAL_INT(8, sizeof(VelocityPid)); // filtered PI: the filtered error and the integral
+}
+
+void test_derivative_on_measurement_ignores_setpoint_steps()
+{
+    PidGains<float> gains(1, 0, 10);
+    Pid<float, PidDerivativeOnMeasurement> onMeasurement;
+    onMeasurement.update(0, 0, 1, gains);
+    TEST_ASSERT_EQUAL_FLOAT(1, onMeasurement.update(1, 0, 1, gains));
+    Pid<float, PidDerivative> onError;
+    onError.update(0, 0, 1, gains);
+    TEST_ASSERT_EQUAL_FLOAT(11, onError.update(1, 0, 1, gains));
+}
+
+void test_filtered_derivative()
+{
+    Pid<float, PidDerivativeOnMeasurement, PidMeasuredRate, PidFilteredDerivative> pid;
+    PidGains<float> gains(0, 0, 1);
+    gains.derivativeAlpha = 0.5;
+    TEST_ASSERT_EQUAL_FLOAT(0.5f, pid.update(0, 0, -1, 1, gains));
+    TEST_ASSERT_EQUAL_FLOAT(0.75f, pid.update(0, 0, -1, 1, gains));
+}
+
+void test_back_calculation_recovers_from_saturation()
+{
+    // 5 s saturated, then the setpoint drops
+    Pid<float, PidIntegral, PidOutputClamp> plain;
+    Pid<float, PidIntegral, PidOutputClamp, PidBackCalculation> back;
+    PidGains<float> gains(1, 1, 0);
+    gains.outputMin = -1;
+    gains.outputMax = 1;
+    gains.kb = 1;
+    const float dt = 0.01;
+    for (int i = 0; i < 500; i++)
+    {
+        plain.update(5, 0, dt, gains);
+        back.update(5, 0, dt, gains);
+    }
+    int plainTicks = -1, backTicks = -1;
+    for (int i = 0; i < 20000 && (plainTicks < 0 || backTicks < 0); i++)
+    {
+        if (plain.update(-0.2f, 0, dt, gains) < 0.5f && plainTicks < 0)
+            plainTicks = i;
+        if (back.update(-0.2f, 0, dt, gains) < 0.5f && backTicks < 0)
+            backTicks = i;
+    }
+
+    char message[96];
+    snprintf(message, sizeof(message), "output below 0.5 after %d ticks plain, %d with back-calculation", plainTicks,
+             backTicks);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_TRUE(backTicks >= 0);
+    TEST_ASSERT_TRUE(plainTicks < 0 || backTicks < plainTicks / 5);
+
+    Pid<float, PidOutputClamp> clamped;
+    TEST_ASSERT_EQUAL_FLOAT(1, clamped.update(5, 0, 1, gains));
+    TEST_ASSERT_EQUAL_FLOAT(-1, clamped.update(-5, 0, 1, gains));
+}
+
+void test_setpoint_weighting()
+{
+    Pid<float, PidDerivative, PidSetpointWeighting> pid;
+    PidGains<float> gains(2, 0, 1);
+    gains.b = 0.5;
+    gains.c = 0;
+    pid.update(0, 0, 1, gains);
+    // P on 0.5 * 1 - 0.25, D on the measurement alone, which did not move
+    TEST_ASSERT_EQUAL_FLOAT(2 * (0.5f - 0.25f) - 0.25f, pid.update(1, 0.25f, 1, gains));
+}
+
+void test_reset_clears_the_state()
+{
+    VelocityPid pid;
+    PidGains<float> gains(1, 1);
+    pid.update(1, 0, 1, gains);
+    TEST_ASSERT_TRUE(pid.getIntegral() != 0);
+    pid.reset();
+    TEST_ASSERT_EQUAL_FLOAT(0, pid.getIntegral());
+    TEST_ASSERT_EQUAL_FLOAT(0, pid.update(0, 0, 1, gains));
+}
+
+volatile float sink;
+
+// ns per call, the best of interleaved runs
+template <typename Loop>
+double timeLoop(Loop loop)
+{
+    const int CALLS = 2000000;
+    float x = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < CALLS; i++)
+    {
+        x += 1e-7f;
+        sink = loop(x);
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / CALLS;
+}
+
+void test_benchmark()
+{
+    pitch = 0;
+    tracking = false;
+    double best[6] = {1e9, 1e9, 1e9, 1e9, 1e9, 1e9};
+    for (int run = 0; run < 5; run++)
+    {
+        best[0] = std::min(best[0], timeLoop([](float x) { return handVertical(x, -x); }));
+        best[1] = std::min(best[1], timeLoop([](float x) { return vertical(x, -x); }));
+        best[2] = std::min(best[2], timeLoop([](float x) { return handVelocity(x, -x, 0.5f * x); }));
+        best[3] = std::min(best[3], timeLoop([](float x) { return velocity(x, -x, 0.5f * x); }));
+        best[4] = std::min(best[4], timeLoop([](float x) { return handTurn(x, -x); }));
+        best[5] = std::min(best[5], timeLoop([](float x) { return turn(x, -x); }));
+    }
+    char message[128];
+    snprintf(message, sizeof(message), "ns per update, hand-written | Pid: vertical %.2f | %.2f, velocity %.2f | %.2f, "
+             "turn %.2f | %.2f", best[0], best[1], best[2], best[3], best[4], best[5]);
+    TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_loops_match_the_hand_written_ones);
+    RUN_TEST(test_state_is_only_what_the_features_need);
+    RUN_TEST(test_derivative_on_measurement_ignores_setpoint_steps);
+    RUN_TEST(test_filtered_derivative);
+    RUN_TEST(test_back_calculation_recovers_from_saturation);
+    RUN_TEST(test_setpoint_weighting);
+    RUN_TEST(test_reset_clears_the_state);
+    RUN_TEST(test_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,147 @@
+// Gyro spectrum analysis and dynamic notches on a synthetic gyro stream: a slow balance motion with a vibration tone
+// on top. The analyzer finds the tone, and a notch tuned from it removes the tone and passes the balance motion
+#include <unity.h>
+#include <stdio.h>
+#include <math.h>
+#include <spectrum.h>
+
+const float RATE_HZ = 1000;          // GYRO_SAMPLE_RATE_HZ in FIFO mode
+const float BALANCE_HZ = 2;          // the robot's own pitch motion
+const float BALANCE_AMPLITUDE = 0.5; // (rad/s)
+const float TONE_AMPLITUDE = 0.2;    // (rad/s)
+const float NOISE = 0.01;            // uniform noise either side of the signal (rad/s)
+
+// Deterministic noise in [-1, 1]
+struct Noise
+{
+    uint32_t state = 12345;
+
+    float next()
+    {
+        state = state * 1664525u + 1013904223u;
+        return (state >> 8) * (2.0f / 16777216.0f) - 1;
+    }
+};
+
+// Gyro y at sample i: the balance motion, tones at the given frequencies (Hz) and noise
+float gyroSample(int i, const float *toneHz, int tones, Noise &noise)
+{
+    float t = i / RATE_HZ;
+    float sample = BALANCE_AMPLITUDE * sin(2 * PI * BALANCE_HZ * t) + NOISE * noise.next();
+    for (int n = 0; n < tones; n++)
+        sample += TONE_AMPLITUDE / (n + 1) * sin(2 * PI * toneHz[n] * t);
+    return sample;
+}
+
+// Feed the analyzer until a buffer is ready, analyse it and read the published notch frequencies
+NotchTuning analyseStream(SpectrumAnalyzer &analyzer, const float *toneHz, int tones, int notches)
+{
+    Noise noise;
+    int i = 0;
+    while (!analyzer.push(gyroSample(i++, toneHz, tones, noise)))
+        ;
+    analyzer.analyse(notches);
+
+    NotchTuning tuning;
+    uint32_t version;
+    TEST_ASSERT_TRUE(analyzer.tuning.read(tuning, version));
+    return tuning;
+}
+
+// Peak amplitude of the output of a filter over whole periods of freq Hz, after its transient
+float filteredAmplitude(Biquad filter, float freq)
+{
+    const int SETTLE = 2000;
+    const int PERIODS = 20;
+    int samples = static_cast<int>(PERIODS * RATE_HZ / freq);
+    float peak = 0;
+    for (int i = 0; i < SETTLE + samples; i++)
+    {
+        float out = filter.process(sin(2 * PI * freq * i / RATE_HZ));
+        if (i >= SETTLE)
+            peak = fmaxf(peak, fabsf(out));
+    }
+    return peak;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// A tone between bins is found to within a quarter bin, and its amplitude through the Hann window is near the input
+void test_finds_tone()
+{
+    const float frequencies[] = {61.3, 137.3, 250, 402.7};
+    for (float hz : frequencies)
+    {
+        SpectrumAnalyzer analyzer(RATE_HZ);
+        NotchTuning tuning = analyseStream(analyzer, &hz, 1, 1);
+
+        int bin = static_cast<int>(hz / analyzer.getBinHz() + 0.5f);
+        float amplitude = analyzer.getMagnitude()[bin];
+        char message[100];
+        snprintf(message, sizeof(message), "%.1f Hz tone: found %.2f Hz, amplitude %.3f", hz, tuning.freq[0], amplitude);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_FLOAT_WITHIN(analyzer.getBinHz() / 4, hz, tuning.freq[0]);
+        TEST_ASSERT_FLOAT_WITHIN(0.2f * TONE_AMPLITUDE, TONE_AMPLITUDE, amplitude);
+    }
+}
+
+// Two tones give two notches, one on each, and the balance motion below NOTCH_MIN_HZ is never a peak. New notches take
+// the peaks nearest to 0 Hz first, so the order is by frequency
+void test_finds_two_tones()
+{
+    SpectrumAnalyzer analyzer(RATE_HZ);
+    const float tones[] = {180.4, 95.2};
+    NotchTuning tuning = analyseStream(analyzer, tones, 2, 2);
+    TEST_ASSERT_FLOAT_WITHIN(analyzer.getBinHz() / 4, tones[1], tuning.freq[0]);
+    TEST_ASSERT_FLOAT_WITHIN(analyzer.getBinHz() / 4, tones[0], tuning.freq[1]);
+}
+
+// Without a tone nothing stands out of the noise, and the notch stays bypassed
+void test_no_tone_no_notch()
+{
+    SpectrumAnalyzer analyzer(RATE_HZ);
+    NotchTuning tuning = analyseStream(analyzer, nullptr, 0, MAX_NOTCHES);
+    for (int n = 0; n < MAX_NOTCHES; n++)
+        TEST_ASSERT_EQUAL_FLOAT(0, tuning.freq[n]);
+}
+
+// A notch at the found frequency takes the tone down by more than 20 dB and leaves the balance motion within 1%
+void test_notch_attenuates_tone()
+{
+    const float frequencies[] = {61.3, 137.3, 250, 402.7};
+    for (float hz : frequencies)
+    {
+        SpectrumAnalyzer analyzer(RATE_HZ);
+        NotchTuning tuning = analyseStream(analyzer, &hz, 1, 1);
+
+        Biquad notch;
+        notch.configureNotch(tuning.freq[0], NOTCH_Q, RATE_HZ);
+        float tone = filteredAmplitude(notch, hz);
+        float balance = filteredAmplitude(notch, BALANCE_HZ);
+
+        char message[100];
+        snprintf(message, sizeof(message), "%.1f Hz tone: notch at %.2f Hz, tone %.1f dB, balance gain %.4f", hz,
+                 tuning.freq[0], 20 * log10(tone), balance);
+        TEST_MESSAGE(message);
+
+        TEST_ASSERT_LESS_THAN_FLOAT(0.1f, tone);
+        TEST_ASSERT_FLOAT_WITHIN(0.01f, 1, balance);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_finds_tone);
+    RUN_TEST(test_finds_two_tones);
+    RUN_TEST(test_no_tone_no_notch);
+    RUN_TEST(test_notch_attenuates_tone);
+    return UNITY_END();
+}
@@ -0,0 +1,93 @@
+// fastDivide() and divideByReciprocal() against the hardware divide they replace in step::updateSpeed(), and what
+// each costs on the host
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include <random>
+#include <step.h>
+
+step motor(20, 0, 1);
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+// Every step period the ISR can ask for, PERIOD_SCALE over each speed up to MAX_SPEED
+void test_fast_divide_matches_every_period()
+{
+    const uint32_t maxSpeed = motor.MAX_SPEED * motor.SPEED_SCALE;
+    for (uint32_t speed = 1; speed <= maxSpeed; speed++)
+        TEST_ASSERT_EQUAL_UINT32(motor.PERIOD_SCALE / speed, fastDivide(motor.PERIOD_SCALE, speed));
+}
+
+// Random numerators below 2^31 over divisors of every magnitude
+void test_fast_divide_matches_random()
+{
+    std::mt19937 random(1);
+    for (int i = 0; i < 20000000; i++)
+    {
+        uint32_t num = random() & 0x7FFFFFFF;
+        uint32_t den = (random() >> (random() % 31)) | 1;
+        TEST_ASSERT_EQUAL_UINT32(num / den, fastDivide(num, den));
+    }
+}
+
+// The speed change per update, accel * speedTimer / 500, over the whole 32-bit range of its argument
+void test_divide_by_reciprocal_matches()
+{
+    const uint32_t divisor = 1000000 / motor.SPEED_SCALE;
+    for (uint64_t x = 0; x < (1ULL << 32); x += 97)
+        TEST_ASSERT_EQUAL_UINT32(static_cast<uint32_t>(x) / divisor,
+                                 divideByReciprocal(static_cast<uint32_t>(x), motor.ACCEL_RECIP));
+    for (uint32_t x = 0xFFFFF000; x != 0; x++)
+        TEST_ASSERT_EQUAL_UINT32(x / divisor, divideByReciprocal(x, motor.ACCEL_RECIP));
+}
+
+// Nanoseconds per period computation, best of several runs over the same speeds
+template <typename Divide>
+double timePeriods(const uint32_t *speeds, int n, Divide divide)
+{
+    double best = 1e9;
+    for (int run = 0; run < 7; run++)
+    {
+        uint32_t sum = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < n; i++)
+            sum += divide(motor.PERIOD_SCALE, speeds[i]);
+        auto end = std::chrono::steady_clock::now();
+        TEST_ASSERT_TRUE(sum != 1); // keep the loop
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / n;
+        best = ns < best ? ns : best;
+    }
+    return best;
+}
+
+void test_divide_benchmark()
+{
+    const int n = 1 << 20;
+    static uint32_t speeds[n];
+    std::mt19937 random(2);
+    for (int i = 0; i < n; i++)
+        speeds[i] = 1 + random() % (motor.MAX_SPEED * motor.SPEED_SCALE);
+
+    // volatile divisor, so the compiler cannot strength-reduce the reference divide
+    double hardware = timePeriods(speeds, n, [](uint32_t num, volatile uint32_t den) { return num / den; });
+    double fast = timePeriods(speeds, n, fastDivide);
+    char message[96];
+    snprintf(message, sizeof(message), "period: hardware divide %.2f ns, fastDivide %.2f ns", hardware, fast);
+    TEST_MESSAGE(message);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_fast_divide_matches_every_period);
+    RUN_TEST(test_fast_divide_matches_random);
+    RUN_TEST(test_divide_by_reciprocal_matches);
+    RUN_TEST(test_divide_benchmark);
+    return UNITY_END();
+}
@@ -0,0 +1,205 @@
+// Host benchmark of the stepper tick over the scenarios benchmarkSteppers() runs on the target, with the GPIO
+// registers mocked as memory. Times a step pair alone and the whole TimerHandler() path: command mailbox, both motors
+// and the state mailbox. Host nanoseconds only rank changes to the code; the ESP32 cycle counts
+// come from benchmarkSteppers() and /isrStats
+#include <unity.h>
+#include <stdio.h>
+#include <chrono>
+#include <algorithm>
+#include <vector>
+#include <step.h>
+#include <mailbox.h>
+#include <bench_scenarios.h>
+
+const int INTERVAL_US = 20;    // STEPPER_INTERVAL_US
+const int COMMAND_TICKS = 400; // ticks between commands, the 8 ms balance loop
+const int BENCH_TICKS = 200000;
+const int WARMUP_TICKS = 5000; // reach cruise speed before timing
+
+// As in config.h
+struct StepperCommand
+{
+    MotorCommand motor[2];
+};
+
+struct StepperState
+{
+    MotorState motor[2];
+};
+
+// Per-tick times of one stepper implementation over a scenario (ns)
+struct TickTimes
+{
+    std::vector<float> ns;
+
+    float mean()
+    {
+        double total = 0;
+        for (float t : ns)
+            total += t;
+        return total / ns.size();
+    }
+
+    float percentile(float fraction)
+    {
+        std::vector<float> sorted(ns);
+        std::sort(sorted.begin(), sorted.end());
+        return sorted[static_cast<size_t>(fraction * (sorted.size() - 1))];
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+// Cost of reading the clock twice, taken off every sample
+float clockOverhead()
+{
+    float best = 1e9;
+    for (int i = 0; i < 100000; i++)
+    {
+        Clock::time_point start = Clock::now();
+        Clock::time_point end = Clock::now();
+        best = std::min(best, std::chrono::duration<float, std::nano>(end - start).count());
+    }
+    return best;
+}
+
+float overhead;
+
+template <typename Tick>
+float timeTick(Tick tick)
+{
+    Clock::time_point start = Clock::now();
+    tick();
+    Clock::time_point end = Clock::now();
+    return std::max(0.0f, std::chrono::duration<float, std::nano>(end - start).count() - overhead);
+}
+
+// Run a scenario on a step pair and the full ISR path, returning the positions reached
+void runScenario(BenchScenario scenario, TickTimes &pair, TickTimes &isr, int32_t *positions)
+{
+    step a(INTERVAL_US, 2, 3), b(INTERVAL_US, 4, 5);
+    step c(INTERVAL_US, 2, 3), d(INTERVAL_US, 4, 5);
+    Mailbox<StepperCommand> commands;
+    Mailbox<StepperState> states;
+    uint32_t applied = 0;
+
+    for (int i = -WARMUP_TICKS; i < BENCH_TICKS; i++)
+    {
+        float accel = 0, speed = 0;
+        benchTargets(scenario, i < 0 && scenario == BENCH_ACCELERATING ? 0 : i, accel, speed);
+        if (i % COMMAND_TICKS == 0)
+        {
+            // opposite directions, as in a turn
+            a.applyCommand(a.commandRad(accel, speed));
+            b.applyCommand(b.commandRad(accel, -speed));
+            StepperCommand command;
+            command.motor[0] = c.commandRad(accel, speed);
+            command.motor[1] = d.commandRad(accel, -speed);
+            commands.write(command);
+        }
+
+        float pairNs = timeTick([&]() {
+            a.runStepper();
+            b.runStepper();
+        });
+        // TimerHandler() without the cycle statistics
+        float isrNs = timeTick([&]() {
+            StepperCommand command;
+            uint32_t version;
+            if (commands.version() != applied && commands.read(command, version))
+            {
+                c.applyCommand(command.motor[0]);
+                d.applyCommand(command.motor[1]);
+                applied = version;
+            }
+            c.runStepper();
+            d.runStepper();
+            StepperState state;
+            state.motor[0] = c.getState();
+            state.motor[1] = d.getState();
+            states.write(state);
+        });
+
+        if (i >= 0)
+        {
+            pair.ns.push_back(pairNs);
+            isr.ns.push_back(isrNs);
+        }
+    }
+    positions[0] = a.getPosition();
+    positions[1] = c.getPosition();
+}
+
+void report(BenchScenario scenario, const char *name, TickTimes &times)
+{
+    char message[128];
+    snprintf(message, sizeof(message), "%-12s %-11s mean %6.1f  p50 %6.1f  p99 %6.1f  p99.9 %6.1f  max %7.1f ns",
+             BENCH_SCENARIO_NAMES[scenario], name, times.mean(), times.percentile(0.5f), times.percentile(0.99f),
+             times.percentile(0.999f), times.percentile(1.0f));
+    TEST_MESSAGE(message);
+}
+
+void benchmark(BenchScenario scenario, int32_t *positions)
+{
+    TickTimes pair, isr;
+    runScenario(scenario, pair, isr, positions);
+    report(scenario, "step pair", pair);
+    report(scenario, "ISR path", isr);
+    // the mailboxes hand the same commands over on the same tick
+    TEST_ASSERT_EQUAL_INT32(positions[0], positions[1]);
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_idle()
+{
+    int32_t positions[2];
+    benchmark(BENCH_IDLE, positions);
+    for (int i = 0; i < 2; i++)
+        TEST_ASSERT_EQUAL_INT32(0, positions[i]);
+}
+
+void test_cruise()
+{
+    int32_t positions[2];
+    benchmark(BENCH_CRUISE, positions);
+    // 10 rad/s for the warmup and the timed ticks, within the ramp at the start
+    int32_t expected = static_cast<int32_t>(10 / (2 * PI / 3200) * (WARMUP_TICKS + BENCH_TICKS) * INTERVAL_US * 1e-6);
+    for (int i = 0; i < 2; i++)
+        TEST_ASSERT_INT32_WITHIN(expected / 50, expected, positions[i]);
+}
+
+void test_accelerating()
+{
+    int32_t positions[2];
+    benchmark(BENCH_ACCELERATING, positions);
+    for (int i = 0; i < 2; i++)
+        TEST_ASSERT_GREATER_THAN(0, positions[i]);
+}
+
+void test_reversal()
+{
+    int32_t positions[2];
+    benchmark(BENCH_REVERSAL, positions);
+    // never reaches 1 rad/s before turning, so it drifts less than that speed would carry it over the run
+    int32_t fullSpeed = static_cast<int32_t>(1 / (2 * PI / 3200) * (WARMUP_TICKS + BENCH_TICKS) * INTERVAL_US * 1e-6);
+    for (int i = 0; i < 2; i++)
+        TEST_ASSERT_INT32_WITHIN(fullSpeed, 0, positions[i]);
+}
+
+int main(int argc, char **argv)
+{
+    overhead = clockOverhead();
+    UNITY_BEGIN();
+    RUN_TEST(test_idle);
+    RUN_TEST(test_cruise);
+    RUN_TEST(test_accelerating);
+    RUN_TEST(test_reversal);
+    return UNITY_END();
+}
@@ -0,0 +1,105 @@
+// measureVelocity() over synthetic step edges: a constant speed, a steady ramp, standstill and the low speed fallback
+#include <unity.h>
+#include <stdio.h>
+#include <wheel_velocity.h>
+
+const float STEP_ANGLE = 2 * PI / 3200; // 16 microsteps
+
+StepEdge edges[VELOCITY_EDGES];
+
+// Edges of a wheel at speed (steps/ms) and constant acceleration (steps/ms/ms) from t = 0, the time each whole step
+// is reached rounded to the μs clock. Returns the number of edges
+uint32_t rampEdges(float speed, float accel, uint32_t count, int direction)
+{
+    for (uint32_t k = 0; k < count; k++)
+    {
+        float steps = k + 1;
+        float t = accel == 0 ? steps / speed : (-speed + sqrt(speed * speed + 2 * accel * steps)) / accel;
+        edges[k].timeUs = static_cast<uint32_t>(lround(t * 1000)) + 1000000;
+        edges[k].position = direction * static_cast<int32_t>(k + 1);
+    }
+    return count;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_constant_speed()
+{
+    // 2 steps/ms forward then backward
+    for (int direction = 1; direction >= -1; direction -= 2)
+    {
+        uint32_t count = rampEdges(2, 0, VELOCITY_EDGES, direction);
+        WheelVelocity velocity = measureVelocity(edges, count, edges[count - 1].timeUs + 100, STEP_ANGLE);
+        TEST_ASSERT_FLOAT_WITHIN(0.005f * 2000 * STEP_ANGLE, direction * 2000 * STEP_ANGLE, velocity.speed);
+        TEST_ASSERT_FLOAT_WITHIN(2, 0, velocity.accel);
+        TEST_ASSERT_EQUAL_UINT32(100, velocity.delayUs);
+    }
+}
+
+void test_ramping_speed()
+{
+    // 1 step/ms gaining 0.05 step/ms/ms, about 98 rad/s/s
+    const float speed = 1, accel = 0.05f;
+    uint32_t count = rampEdges(speed, accel, VELOCITY_EDGES, 1);
+    float t = (edges[count - 1].timeUs - 1000000) * 1e-3f;
+    float expectedSpeed = (speed + accel * t) * 1e3f * STEP_ANGLE;
+    float expectedAccel = accel * 1e6f * STEP_ANGLE;
+    WheelVelocity velocity = measureVelocity(edges, count, edges[count - 1].timeUs, STEP_ANGLE);
+
+    char message[96];
+    snprintf(message, sizeof(message), "speed %.3f of %.3f rad/s, accel %.1f of %.1f rad/s/s", velocity.speed,
+             expectedSpeed, velocity.accel, expectedAccel);
+    TEST_MESSAGE(message);
+    TEST_ASSERT_FLOAT_WITHIN(0.01f * expectedSpeed, expectedSpeed, velocity.speed);
+    TEST_ASSERT_FLOAT_WITHIN(0.1f * expectedAccel, expectedAccel, velocity.accel);
+}
+
+void test_zero_speed()
+{
+    // no edges at all
+    WheelVelocity velocity = measureVelocity(edges, 0, 1000000, STEP_ANGLE);
+    TEST_ASSERT_EQUAL_FLOAT(0, velocity.speed);
+    TEST_ASSERT_EQUAL_FLOAT(0, velocity.accel);
+
+    // stopped for VELOCITY_STOPPED_US after moving
+    uint32_t count = rampEdges(2, 0, VELOCITY_EDGES, 1);
+    velocity = measureVelocity(edges, count, edges[count - 1].timeUs + VELOCITY_STOPPED_US, STEP_ANGLE);
+    TEST_ASSERT_EQUAL_FLOAT(0, velocity.speed);
+    TEST_ASSERT_EQUAL_FLOAT(0, velocity.accel);
+    TEST_ASSERT_EQUAL_UINT32(VELOCITY_STOPPED_US, velocity.delayUs);
+}
+
+void test_slowing_is_capped_by_the_time_since_the_last_step()
+{
+    // 2 steps/ms, then nothing for 10 ms, so it cannot be faster than a step in 10 ms
+    uint32_t count = rampEdges(2, 0, VELOCITY_EDGES, 1);
+    WheelVelocity velocity = measureVelocity(edges, count, edges[count - 1].timeUs + 10000, STEP_ANGLE);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, 100 * STEP_ANGLE, velocity.speed);
+    TEST_ASSERT_EQUAL_FLOAT(0, velocity.accel);
+}
+
+void test_single_edge_in_the_window_times_the_step_period()
+{
+    // steps 30 ms apart, longer than the window
+    edges[0] = {1000000, 0};
+    edges[1] = {1030000, -1};
+    WheelVelocity velocity = measureVelocity(edges, 2, 1030000, STEP_ANGLE);
+    TEST_ASSERT_FLOAT_WITHIN(1e-4f, -STEP_ANGLE / 0.03f, velocity.speed);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(test_constant_speed);
+    RUN_TEST(test_ramping_speed);
+    RUN_TEST(test_zero_speed);
+    RUN_TEST(test_slowing_is_capped_by_the_time_since_the_last_step);
+    RUN_TEST(test_single_edge_in_the_window_times_the_step_period);
+    return UNITY_END();
+}